@@ -53,9 +53,11 @@ static Vulkan::BufferHandle create_buffer(Vulkan::Device &device)
 	// Initial data can be passed in. The data is copied on the transfer queue and barriers are taken care of.
 	// For more control, you can pass in nullptr here and deal with it manually.
 	// If you're creating a lot of buffers with initial data in one go, it might makes sense to do the upload manually.
+	// Sample 24 shows how to batch up uploads for many resources.
 	const void *initial_data = nullptr;
 
 	// Memory is allocated automatically.
+	// Every buffer gets its own VkBuffer. For lots of small buffers, see sample 27.
 	Vulkan::BufferHandle buffer = device.create_buffer(info, initial_data);
 	return buffer;
 }
@@ -75,6 +77,7 @@ static Vulkan::ImageHandle create_image(Vulkan::Device &device)
 
 	// We can request mips to be generated automatically.
 	// In this case, we only upload the first mip level.
+	// See sample 26 for generating mips for many images at once.
 	info.misc = Vulkan::IMAGE_MISC_GENERATE_MIPS_BIT;
 
 	Vulkan::ImageInitialData initial_data = {};
@@ -116,10 +119,12 @@ int main()
 	// The main differences from a std::shared_ptr<> are:
 	// - No weak pointer support.
 	// - Ref-count can be atomic or non-atomic based on if we build with MT support or not.
+	//   The counter type is a template parameter of Util::IntrusivePtrEnabled, so it can also be picked per type, see sample 29.
 	// - Ref-count block is always allocated with the object itself (intrusive part).
 	// - Even without the RAII IntrusivePtr wrapper, it's possible to manually use the ref-counts.
 	// - The handle pointers are allocated from an object pool.
 	// In the asymptotic case creating resource handles will never need heap allocation or frees.
+	// See sample 28 for how handle pools can scale when many threads create and destroy handles.
 	// The handles are freed with special deleters which the intrusive pointers take care of.
 
 	Vulkan::BufferHandle buffer = create_buffer(device);
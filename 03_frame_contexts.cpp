@@ -64,6 +64,7 @@ int main()
 	// A frame context generally maps to an on-screen frame, but it does not have to.
 	// In the earlier designs it used to map 1:1 to a WSI frame, but this got clumsy over time,
 	// especially in headless operation.
+	// The number of frame contexts can be changed at any time, see sample 23.
 	device.init_frame_contexts(2);
 
 	// We start in frame context #0.
@@ -126,6 +127,7 @@ int main()
 	// This is sub-optimal, but it is also 100% deterministic. This I believe is the right abstraction level for a "mid-level" implementation.
 	// If you have one very long frame that is doing a lot of work and you're allocating and freeing memory a lot, you might end up with an OOM scenario.
 	// To reclaim memory you must call Device::next_frame_context, or Device::wait_idle, which also immediately reclaims all memory and frees all pending resources.
+	// Sample 21 shows how next_frame_context() can be used to reclaim memory against a budget instead.
 	// Since we are resetting all command pools in wait_idle, all command buffers must have been submitted before calling this, similar to next_frame_context().
 	device.wait_idle();
 }
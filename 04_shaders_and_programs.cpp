@@ -67,8 +67,8 @@ int main()
 	// At this point, we also perform reflection with SPIRV-Cross.
 	// For each shader, we need to know which binding points and locations are active in the shader,
 	// as well as how many bytes of push constants are in use.
-	// In theory, if SPIR-V modules are built offline and shipped as-is, we could also provide the reflection info as side-band data
-	// without having to bundle a reflection library, but I never felt the need to this plumbing exercise yet.
+	// If SPIR-V modules are built offline and shipped as-is, we can also provide the reflection info as side-band data
+	// without having to bundle a reflection library. See sample 14 for how that plumbing works.
 
 	// An important thing to note is that we do *not* reflect any names, only semantically important decorations
 	// like bindings, locations and descriptor sets.
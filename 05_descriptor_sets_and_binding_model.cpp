@@ -108,7 +108,7 @@ int main()
 	// - Set 0: Global uniform data (projection matrices and that kind of stuff)
 	// - Set 1: Global texture resources (like shadow maps, etc)
 	// - Set 2: Per-material data like textures.
-	// - Set 3: Per-draw uniforms
+	// - Set 3: Per-draw uniforms (from the linear allocator, which uses dynamic offsets, see samples 07 and 17)
 
 	// Note that we do *NOT* take a reference-count on the individual resources here. Descriptor sets will eventually be recycled if bound resources are deleted,
 	// since that descriptor set will never be used again and never get a chance to "refresh" itself.
@@ -147,6 +147,8 @@ int main()
 	//   Then you can load resources by indexing into an array of resources. Pipeline layouts must remain fixed across all pipelines for optimal effect as well.
 	// The compatibility concern is the main reason I cannot commit to bindless. You cannot just bolt on bindless after the fact, it is something you need to commit to I think.
 	// I also don't have any use cases where bindless solves any problem for me in particular.
+	// That said, bindless can be used as an opt-in next to the set/binding model on devices which support it.
+	// See sample 16.
 
 	// Here we resolve all "dirty" state before calling vkCmdDispatch, make sure descriptor sets get allocated/found/created and bound to the command buffer.
 	// VkPipelines might also be created here, again, in a lazy way.
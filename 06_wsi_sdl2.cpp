@@ -125,6 +125,7 @@ static bool run_application(SDL_Window *window)
 	Vulkan::WSI wsi;
 	wsi.set_platform(&platform);
 	wsi.set_backbuffer_srgb(true); // Always choose SRGB backbuffer formats over UNORM. Can be toggled in run-time.
+	// Only the main thread records command buffers here. See sample 18 for recording on multiple threads.
 	if (!wsi.init(1 /*num_thread_indices*/))
 		return false;
 
@@ -157,8 +157,10 @@ static bool run_application(SDL_Window *window)
 			// which needs to be copied on the DMA queue when submitting command buffers.
 			// I never found any gain from doing that, and letting GPU cache source read-only data over PCI
 			// on-demand works just fine.
+			// The exception is large vertex streams which are read by many draws, see sample 31.
 
 			// Each command buffer owns a buffer at a time, and allocations are completely lock-free.
+			// For very large per-frame allocations, see sample 30 for a ring buffer with adaptive sizing.
 
 			// Here we do a lot of stuff in one call:
 			// Allocate N bytes of data from a linear allocator (ultra-cheap).
@@ -216,11 +218,16 @@ static bool run_application(SDL_Window *window)
 					VK_FORMAT_R32G32B32A32_SFLOAT, /*format*/
 					0 /*offset*/);
 
+			// Full precision floats are rarely needed for dynamic geometry. See sample 32 for packed formats.
+
 			// The most useful allocator, the uniform buffer allocator.
 			// We allocate data, binding the buffer to designated set/binding,
 			// and get a pointer where we can fill in UBO data.
 			// There is a convenience templated member function which returns
 			// T* rather than having to deal with void* and computing size in bytes.
+			// Uniform buffers are bound as UNIFORM_BUFFER_DYNAMIC, and the offset into the linear buffer is a dynamic offset,
+			// so a new allocation from the same VkBuffer does not need a new descriptor set, just a rebind.
+			// This is what makes per-draw uniforms (set 3 in sample 05) cheap. See sample 17 for numbers.
 
 			// see shaders/triangle.vert
 			struct VertexUBO
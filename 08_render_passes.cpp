@@ -233,6 +233,7 @@ static bool run_application(SDL_Window *window)
 		// Ideally, Vulkan would not require this object ...
 		// These framebuffers are also created on-demand and destroyed if not used in a few frames.
 		// We use the temporary hashmap data structure here as well, similar to descriptor set management.
+		// See sample 33 for how to pre-create render passes and framebuffers, and keep framebuffers from being evicted.
 		cmd->begin_render_pass(rp);
 		{
 			cmd->set_opaque_state();
@@ -24,9 +24,18 @@
 #include "device.hpp"
 #include "wsi.hpp"
 #include "util.hpp"
+#include "hash.hpp"
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_vulkan.h>
 #include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <unordered_map>
 
 // See sample 06 for details.
 struct SDL2Platform : Vulkan::WSIPlatform
@@ -94,6 +103,253 @@ struct SDL2Platform : Vulkan::WSIPlatform
 	bool is_alive = true;
 };
 
+// A persistent service which completes readbacks on worker threads.
+// It is tempting to just use std::async for this, but the std::future returned by std::async blocks in its destructor
+// until the task is done. If the future is discarded, we end up waiting for the GPU right there in the render loop,
+// which defeats the entire purpose.
+// Instead, we keep a few worker threads around for the lifetime of the application.
+// The render loop only hands over shared ownership of a Vulkan::Fence and a Vulkan::BufferHandle,
+// and the workers wait for the fence, map the buffer and deliver the data through a callback or a std::future.
+class ReadbackService
+{
+public:
+	using Callback = std::function<void (const void *data, VkDeviceSize size)>;
+
+	explicit ReadbackService(Vulkan::Device &device_, unsigned num_workers = 1)
+		: device(device_)
+	{
+		for (unsigned i = 0; i < num_workers; i++)
+			workers.emplace_back(&ReadbackService::worker_loop, this);
+	}
+
+	// Any readbacks which are still queued up are completed before the workers exit.
+	// The service must be torn down before the device.
+	~ReadbackService()
+	{
+		{
+			std::lock_guard<std::mutex> holder{lock};
+			dead = true;
+		}
+		cond.notify_all();
+		for (auto &worker : workers)
+			worker.join();
+	}
+
+	// The callback is called from a worker thread once the fence has signalled.
+	// The pointer is only valid for the duration of the callback.
+	void read(Vulkan::Fence fence, Vulkan::BufferHandle buffer, Callback callback)
+	{
+		{
+			std::lock_guard<std::mutex> holder{lock};
+			queue.push_back({ std::move(fence), std::move(buffer), std::move(callback) });
+			pending++;
+		}
+		cond.notify_one();
+	}
+
+	// Unlike the future returned by std::async, this future does not block when it is destroyed.
+	std::future<std::vector<uint8_t>> read(Vulkan::Fence fence, Vulkan::BufferHandle buffer)
+	{
+		auto promise = std::make_shared<std::promise<std::vector<uint8_t>>>();
+		auto future = promise->get_future();
+		read(std::move(fence), std::move(buffer), [promise](const void *data, VkDeviceSize size) {
+			auto *bytes = static_cast<const uint8_t *>(data);
+			promise->set_value(std::vector<uint8_t>(bytes, bytes + size));
+		});
+		return future;
+	}
+
+	// Number of readbacks which have been requested, but not delivered yet.
+	unsigned get_pending()
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		return pending;
+	}
+
+	// Blocks until every readback has been delivered. Only really useful for teardown or benchmarking.
+	void flush()
+	{
+		std::unique_lock<std::mutex> holder{lock};
+		idle_cond.wait(holder, [this]() { return pending == 0; });
+	}
+
+private:
+	struct Request
+	{
+		Vulkan::Fence fence;
+		Vulkan::BufferHandle buffer;
+		Callback callback;
+	};
+
+	Vulkan::Device &device;
+	std::vector<std::thread> workers;
+	std::deque<Request> queue;
+	std::mutex lock;
+	std::condition_variable cond;
+	std::condition_variable idle_cond;
+	unsigned pending = 0;
+	bool dead = false;
+
+	void worker_loop()
+	{
+		for (;;)
+		{
+			Request req;
+			{
+				std::unique_lock<std::mutex> holder{lock};
+				cond.wait(holder, [this]() { return dead || !queue.empty(); });
+				if (queue.empty())
+					return;
+				req = std::move(queue.front());
+				queue.pop_front();
+			}
+
+			req.fence->wait();
+
+			// The only thing mapping buffers does is to potentially invalidate CPU caches,
+			// no vkMapMemory overhead and other shenanigans.
+			const void *data = device.map_host_buffer(*req.buffer, Vulkan::MEMORY_ACCESS_READ_BIT);
+			req.callback(data, req.buffer->get_create_info().size);
+			device.unmap_host_buffer(*req.buffer, Vulkan::MEMORY_ACCESS_READ_BIT);
+
+			// Drop our references before reporting completion.
+			// The buffer and fence are recycled through the frame context like any other object.
+			req = {};
+
+			{
+				std::lock_guard<std::mutex> holder{lock};
+				pending--;
+			}
+			idle_cond.notify_all();
+		}
+	}
+};
+
+// A pool of recyclable images.
+// Creating an image every frame means allocating memory, creating the VkImage and VkImageView,
+// and then destroying all of it again through the frame context a few frames later.
+// Instead, images are handed back to the pool together with the fence of their last use.
+// Once that fence has signalled, the image can be handed out again to anyone asking for an identical ImageCreateInfo.
+// Images which have not been requested for a while are released back to the device.
+class ImagePool
+{
+public:
+	struct Stats
+	{
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		VkDeviceSize resident_bytes = 0;
+		unsigned resident_images = 0;
+	};
+
+	explicit ImagePool(Vulkan::Device &device_)
+		: device(device_)
+	{
+	}
+
+	// The returned image is not in use by the GPU anymore, so its contents must be considered UNDEFINED.
+	Vulkan::ImageHandle request(const Vulkan::ImageCreateInfo &info)
+	{
+		auto &bucket = buckets[hash_create_info(info)];
+		for (auto itr = bucket.begin(); itr != bucket.end(); ++itr)
+		{
+			// A non-blocking poll of the fence.
+			if (!itr->fence || itr->fence->wait_timeout(0))
+			{
+				Vulkan::ImageHandle image = std::move(itr->image);
+				stats.resident_bytes -= itr->size;
+				stats.resident_images--;
+				bucket.erase(itr);
+				stats.hits++;
+				return image;
+			}
+		}
+
+		stats.misses++;
+		return device.create_image(info);
+	}
+
+	// Hands the image back to the pool. The fence must cover the last GPU use of the image.
+	void recycle(Vulkan::ImageHandle image, Vulkan::Fence fence)
+	{
+		VkMemoryRequirements reqs;
+		vkGetImageMemoryRequirements(device.get_device(), image->get_image(), &reqs);
+
+		Entry entry;
+		entry.size = reqs.size;
+		entry.last_frame = frame_index;
+		entry.fence = std::move(fence);
+		entry.image = std::move(image);
+
+		auto &bucket = buckets[hash_create_info(entry.image->get_create_info())];
+		bucket.push_back(std::move(entry));
+		stats.resident_bytes += reqs.size;
+		stats.resident_images++;
+	}
+
+	// Call once per frame. Images which have not been recycled in a while are released.
+	void begin_frame()
+	{
+		frame_index++;
+		for (auto &bucket : buckets)
+		{
+			auto &entries = bucket.second;
+			for (auto itr = entries.begin(); itr != entries.end(); )
+			{
+				if (frame_index - itr->last_frame > MaxIdleFrames)
+				{
+					stats.resident_bytes -= itr->size;
+					stats.resident_images--;
+					itr = entries.erase(itr);
+				}
+				else
+					++itr;
+			}
+		}
+	}
+
+	const Stats &get_stats() const
+	{
+		return stats;
+	}
+
+private:
+	// Same as the descriptor set recycling in sample 05.
+	enum { MaxIdleFrames = 8 };
+
+	struct Entry
+	{
+		Vulkan::ImageHandle image;
+		Vulkan::Fence fence;
+		VkDeviceSize size = 0;
+		uint64_t last_frame = 0;
+	};
+
+	Vulkan::Device &device;
+	std::unordered_map<Util::Hash, std::vector<Entry>> buckets;
+	Stats stats;
+	uint64_t frame_index = 0;
+
+	static Util::Hash hash_create_info(const Vulkan::ImageCreateInfo &info)
+	{
+		Util::Hasher h;
+		h.u32(uint32_t(info.domain));
+		h.u32(info.width);
+		h.u32(info.height);
+		h.u32(info.depth);
+		h.u32(info.levels);
+		h.u32(info.format);
+		h.u32(info.type);
+		h.u32(info.layers);
+		h.u32(info.usage);
+		h.u32(info.samples);
+		h.u32(info.flags);
+		h.u32(info.misc);
+		h.u32(info.initial_layout);
+		return h.get();
+	}
+};
+
 static bool run_application(SDL_Window *window)
 {
 	// Copy-pastaed from sample 06.
@@ -127,9 +383,17 @@ static bool run_application(SDL_Window *window)
 	buffer_readback_info.domain = Vulkan::BufferDomain::CachedHost;
 	buffer_readback_info.size = 4 * 4 * sizeof(uint32_t);
 
+	// Declared after the WSI, so it's torn down (and drained) before the device goes away.
+	ReadbackService readback(device);
+
+	// The pool needs to go away before the device as well.
+	ImagePool rt_pool(device);
+	unsigned frame_count = 0;
+
 	while (platform.is_alive)
 	{
 		wsi.begin_frame();
+		rt_pool.begin_frame();
 		auto graphics_cmd = device.request_command_buffer(Vulkan::CommandBuffer::Type::Generic);
 
 		// Now we're starting to see manual synchronization come into play.
@@ -149,8 +413,10 @@ static bool run_application(SDL_Window *window)
 		// since this case only applies to depth attachments and input attachments.
 		// The General layout always assumes GENERAL image layout. This is useful for image load/store images for example.
 
-		// We create a new image here every frame to break the "bubble" of ping-ponging the image between transfer and graphics queues.
-		Vulkan::ImageHandle rt = device.create_image(rt_info);
+		// We need a new image every frame to break the "bubble" of ping-ponging the image between transfer and graphics queues.
+		// Rather than creating and destroying an image every frame, we pull one from the pool.
+		// The pool only hands out images which the GPU is done with, so we can transition from UNDEFINED as usual.
+		Vulkan::ImageHandle rt = rt_pool.request(rt_info);
 
 		// Optimal is the default which should be used in almost all cases, this line is just for illustration.
 		rt->set_layout(Vulkan::Layout::Optimal);
@@ -223,20 +489,17 @@ static bool run_application(SDL_Window *window)
 		Vulkan::Fence readback_fence;
 		device.submit(transfer_cmd, &readback_fence);
 
-		// We can wait for the fence on a thread async and read the result there.
-		// We transfer shared ownership of the handles to the thread now, so we must
-		// capture readback_fence and buffer_readback by value.
-		std::async(std::launch::async, [&device, readback_fence, buffer_readback]() mutable {
-			readback_fence->wait();
+		// The copy in the transfer queue is the last use of the image, so once the readback fence signals,
+		// the image can be reused.
+		rt_pool.recycle(rt, readback_fence);
 
-			// The only thing mapping buffers does is to potentially invalidate CPU caches,
-			// no vkMapMemory overhead and other shenanigans.
-			auto *data = static_cast<const uint32_t *>(device.map_host_buffer(*buffer_readback, Vulkan::MEMORY_ACCESS_READ_BIT));
+		// Hand over the fence and the buffer to the readback service.
+		// We transfer shared ownership of the handles to the service, and the render loop never waits for the GPU here.
+		readback.read(readback_fence, buffer_readback, [](const void *ptr, VkDeviceSize) {
+			auto *data = static_cast<const uint32_t *>(ptr);
 			for (unsigned y = 0; y < 4; y++)
 				for (unsigned x = 0; x < 4; x++)
 					LOGI("Pixel %u, %u is: 0x%08x\n", x, y, data[y * 4 + x]);
-
-			device.unmap_host_buffer(*buffer_readback, Vulkan::MEMORY_ACCESS_READ_BIT);
 		});
 
 		// Just render something to the swapchain.
@@ -250,6 +513,14 @@ static bool run_application(SDL_Window *window)
 		// and VkFence objects back to the fence/semaphore pools.
 
 		wsi.end_frame();
+
+		if ((++frame_count & 255) == 0)
+		{
+			auto &stats = rt_pool.get_stats();
+			LOGI("Image pool: %.1f %% hit rate, %u images resident (%llu bytes).\n",
+			     100.0 * double(stats.hits) / double(stats.hits + stats.misses),
+			     stats.resident_images, static_cast<unsigned long long>(stats.resident_bytes));
+		}
 	}
 
 	return true;
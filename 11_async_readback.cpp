@@ -0,0 +1,317 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "vulkan.hpp"
+#include "device.hpp"
+#include "util.hpp"
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <chrono>
+
+// A headless benchmark for the readback service introduced in sample 09.
+// We measure frame times when a frame issues 1, 4 or 16 readbacks,
+// both with the naive approach where we wait for the fence in the render loop,
+// and with the readback service where worker threads wait for us.
+
+// Copy-pastaed from sample 09.
+// A persistent service which completes readbacks on worker threads.
+// It is tempting to just use std::async for this, but the std::future returned by std::async blocks in its destructor
+// until the task is done. If the future is discarded, we end up waiting for the GPU right there in the render loop,
+// which defeats the entire purpose.
+// Instead, we keep a few worker threads around for the lifetime of the application.
+// The render loop only hands over shared ownership of a Vulkan::Fence and a Vulkan::BufferHandle,
+// and the workers wait for the fence, map the buffer and deliver the data through a callback or a std::future.
+class ReadbackService
+{
+public:
+	using Callback = std::function<void (const void *data, VkDeviceSize size)>;
+
+	explicit ReadbackService(Vulkan::Device &device_, unsigned num_workers = 1)
+		: device(device_)
+	{
+		for (unsigned i = 0; i < num_workers; i++)
+			workers.emplace_back(&ReadbackService::worker_loop, this);
+	}
+
+	// Any readbacks which are still queued up are completed before the workers exit.
+	// The service must be torn down before the device.
+	~ReadbackService()
+	{
+		{
+			std::lock_guard<std::mutex> holder{lock};
+			dead = true;
+		}
+		cond.notify_all();
+		for (auto &worker : workers)
+			worker.join();
+	}
+
+	// The callback is called from a worker thread once the fence has signalled.
+	// The pointer is only valid for the duration of the callback.
+	void read(Vulkan::Fence fence, Vulkan::BufferHandle buffer, Callback callback)
+	{
+		{
+			std::lock_guard<std::mutex> holder{lock};
+			queue.push_back({ std::move(fence), std::move(buffer), std::move(callback) });
+			pending++;
+		}
+		cond.notify_one();
+	}
+
+	// Unlike the future returned by std::async, this future does not block when it is destroyed.
+	std::future<std::vector<uint8_t>> read(Vulkan::Fence fence, Vulkan::BufferHandle buffer)
+	{
+		auto promise = std::make_shared<std::promise<std::vector<uint8_t>>>();
+		auto future = promise->get_future();
+		read(std::move(fence), std::move(buffer), [promise](const void *data, VkDeviceSize size) {
+			auto *bytes = static_cast<const uint8_t *>(data);
+			promise->set_value(std::vector<uint8_t>(bytes, bytes + size));
+		});
+		return future;
+	}
+
+	// Number of readbacks which have been requested, but not delivered yet.
+	unsigned get_pending()
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		return pending;
+	}
+
+	// Blocks until every readback has been delivered. Only really useful for teardown or benchmarking.
+	void flush()
+	{
+		std::unique_lock<std::mutex> holder{lock};
+		idle_cond.wait(holder, [this]() { return pending == 0; });
+	}
+
+private:
+	struct Request
+	{
+		Vulkan::Fence fence;
+		Vulkan::BufferHandle buffer;
+		Callback callback;
+	};
+
+	Vulkan::Device &device;
+	std::vector<std::thread> workers;
+	std::deque<Request> queue;
+	std::mutex lock;
+	std::condition_variable cond;
+	std::condition_variable idle_cond;
+	unsigned pending = 0;
+	bool dead = false;
+
+	void worker_loop()
+	{
+		for (;;)
+		{
+			Request req;
+			{
+				std::unique_lock<std::mutex> holder{lock};
+				cond.wait(holder, [this]() { return dead || !queue.empty(); });
+				if (queue.empty())
+					return;
+				req = std::move(queue.front());
+				queue.pop_front();
+			}
+
+			req.fence->wait();
+
+			// The only thing mapping buffers does is to potentially invalidate CPU caches,
+			// no vkMapMemory overhead and other shenanigans.
+			const void *data = device.map_host_buffer(*req.buffer, Vulkan::MEMORY_ACCESS_READ_BIT);
+			req.callback(data, req.buffer->get_create_info().size);
+			device.unmap_host_buffer(*req.buffer, Vulkan::MEMORY_ACCESS_READ_BIT);
+
+			// Drop our references before reporting completion.
+			// The buffer and fence are recycled through the frame context like any other object.
+			req = {};
+
+			{
+				std::lock_guard<std::mutex> holder{lock};
+				pending--;
+			}
+			idle_cond.notify_all();
+		}
+	}
+};
+
+
+static const unsigned Width = 256;
+static const unsigned Height = 256;
+static const unsigned NumFrames = 500;
+
+// 0xff00ff in RGBA8 is the magenta clear color we use below.
+static const uint32_t ExpectedPixel = 0x00ff00ffu;
+
+struct Result
+{
+	double frame_time_ms;
+	double drain_time_ms;
+	unsigned mismatches;
+};
+
+static Result run_benchmark(Vulkan::Device &device, ReadbackService &service, unsigned readbacks_per_frame, bool blocking)
+{
+	// The render targets are created once and reused every frame. This is fine since all work goes to the same queue,
+	// and the barrier from TRANSFER stage below makes sure we don't clobber the image while last frame's copy is still reading it.
+	Vulkan::ImageCreateInfo rt_info = Vulkan::ImageCreateInfo::render_target(Width, Height, VK_FORMAT_R8G8B8A8_UNORM);
+	rt_info.usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+	rt_info.initial_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+	std::vector<Vulkan::ImageHandle> rts;
+	for (unsigned i = 0; i < readbacks_per_frame; i++)
+		rts.push_back(device.create_image(rt_info));
+
+	Vulkan::BufferCreateInfo buffer_readback_info;
+	buffer_readback_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	buffer_readback_info.domain = Vulkan::BufferDomain::CachedHost;
+	buffer_readback_info.size = Width * Height * sizeof(uint32_t);
+
+	std::atomic<unsigned> mismatches;
+	mismatches.store(0);
+
+	auto check_pixels = [&mismatches](const void *ptr, VkDeviceSize size) {
+		auto *data = static_cast<const uint32_t *>(ptr);
+		size_t count = size / sizeof(uint32_t);
+		for (size_t i = 0; i < count; i++)
+		{
+			if (data[i] != ExpectedPixel)
+			{
+				mismatches.fetch_add(1, std::memory_order_relaxed);
+				break;
+			}
+		}
+	};
+
+	auto start = std::chrono::steady_clock::now();
+
+	for (unsigned frame = 0; frame < NumFrames; frame++)
+	{
+		for (auto &rt : rts)
+		{
+			auto cmd = device.request_command_buffer();
+
+			// See sample 09 for what all these barriers are doing.
+			cmd->image_barrier(*rt, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+			                   VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+			                   VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT);
+
+			Vulkan::RenderPassInfo rp;
+			rp.num_color_attachments = 1;
+			rp.color_attachments[0] = &rt->get_view();
+			rp.store_attachments = 1 << 0;
+			rp.clear_attachments = 1 << 0;
+			rp.clear_color[0].float32[0] = 1.0f;
+			rp.clear_color[0].float32[1] = 0.0f;
+			rp.clear_color[0].float32[2] = 1.0f;
+			rp.clear_color[0].float32[3] = 0.0f;
+			cmd->begin_render_pass(rp);
+			cmd->end_render_pass();
+
+			cmd->image_barrier(*rt, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+			                   VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+			                   VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+
+			auto buffer_readback = device.create_buffer(buffer_readback_info);
+			cmd->copy_image_to_buffer(*buffer_readback, *rt, 0, {}, { Width, Height, 1 }, 0, 0, { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 });
+			cmd->barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+			             VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+
+			Vulkan::Fence readback_fence;
+			device.submit(cmd, &readback_fence);
+
+			if (blocking)
+			{
+				// This is what the old std::async code ended up doing in practice.
+				readback_fence->wait();
+				const void *data = device.map_host_buffer(*buffer_readback, Vulkan::MEMORY_ACCESS_READ_BIT);
+				check_pixels(data, buffer_readback_info.size);
+				device.unmap_host_buffer(*buffer_readback, Vulkan::MEMORY_ACCESS_READ_BIT);
+			}
+			else
+				service.read(std::move(readback_fence), std::move(buffer_readback), check_pixels);
+		}
+
+		// See sample 03. This is what WSI would do for us in end_frame().
+		device.next_frame_context();
+	}
+
+	auto end_frames = std::chrono::steady_clock::now();
+	service.flush();
+	auto end_drain = std::chrono::steady_clock::now();
+
+	Result result;
+	result.frame_time_ms = std::chrono::duration<double, std::milli>(end_frames - start).count() / NumFrames;
+	result.drain_time_ms = std::chrono::duration<double, std::milli>(end_drain - end_frames).count();
+	result.mismatches = mismatches.load();
+	return result;
+}
+
+int main()
+{
+	// See sample 01.
+	if (!Vulkan::Context::init_loader(nullptr))
+	{
+		LOGE("Failed to create loader!\n");
+		return 1;
+	}
+
+	Vulkan::Context context;
+	if (!context.init_instance_and_device(nullptr, 0, nullptr, 0))
+	{
+		LOGE("Failed to create VkInstance and VkDevice.\n");
+		return 1;
+	}
+
+	Vulkan::Device device;
+	device.set_context(context);
+	////
+
+	{
+		// Multiple workers lets us wait for several fences at once,
+		// but the render loop never cares how many there are.
+		ReadbackService service(device, 2);
+
+		static const unsigned readback_counts[] = { 1, 4, 16 };
+		for (unsigned count : readback_counts)
+		{
+			for (bool blocking : { true, false })
+			{
+				Result result = run_benchmark(device, service, count, blocking);
+				LOGI("%2u readbacks in flight, %s: %.3f ms / frame (drain %.3f ms, %u mismatches)\n",
+				     count, blocking ? "blocking" : "service ",
+				     result.frame_time_ms, result.drain_time_ms, result.mismatches);
+			}
+		}
+	}
+
+	device.wait_idle();
+}
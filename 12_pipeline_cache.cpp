@@ -0,0 +1,444 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "vulkan.hpp"
+#include "device.hpp"
+#include "util.hpp"
+#include <vector>
+#include <thread>
+#include <unordered_set>
+#include <algorithm>
+#include <string>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// In sample 10 we saw that pipelines are created lazily when we draw, which causes hitches the first time
+// a particular combination of program, render state and render pass is seen.
+// Here we make the warm-up explicit and persistent:
+// - The VkPipelineCache is serialized to disk on shutdown and handed back to the device right after set_context().
+// - We also keep a small database of which pipeline combinations we have seen in previous runs.
+//   On startup, these are compiled up front on worker threads by recording command buffers
+//   which only exist to warm up the caches.
+// Both files are written atomically, so a crash while writing them can never leave a corrupt cache behind.
+
+// Run once to populate the caches, then run again to see the difference.
+// Pass --cold to throw away the caches and measure a cold start.
+// Pass --level N to render a different "level". Each level only uses a subset of all pipelines,
+// and the database only learns about the pipelines a level actually used.
+
+static const uint32_t simple_vert[] =
+#include "shaders/simple.vert.inc"
+;
+
+static const uint32_t simple_frag[] =
+#include "shaders/simple.frag.inc"
+;
+
+static const uint32_t gbuffer_vert[] =
+#include "shaders/gbuffer.vert.inc"
+;
+
+static const char *pipeline_cache_path = "12_pipeline_cache.bin";
+static const char *pipeline_database_path = "12_pipeline_database.bin";
+
+// The pipeline "database" does not store any Vulkan structures.
+// It stores the application level description of how we got to a pipeline, so we can replay it later.
+// The Vulkan-level hashing of render state, program and render pass is all taken care of by Granite once we replay the key.
+// In a real engine, this would be a material ID, a render pass type and so on.
+struct PipelineKey
+{
+	uint8_t program;
+	uint8_t state;
+	uint8_t format;
+	uint8_t write_mask;
+
+	uint32_t encode() const
+	{
+		return uint32_t(program) | (uint32_t(state) << 8) | (uint32_t(format) << 16) | (uint32_t(write_mask) << 24);
+	}
+
+	static PipelineKey decode(uint32_t value)
+	{
+		PipelineKey key;
+		key.program = uint8_t(value);
+		key.state = uint8_t(value >> 8);
+		key.format = uint8_t(value >> 16);
+		key.write_mask = uint8_t(value >> 24);
+		return key;
+	}
+};
+
+enum { NumPrograms = 2, NumStates = 3, NumWriteMasks = 16 };
+
+static const VkFormat render_target_formats[] = {
+	VK_FORMAT_R8G8B8A8_UNORM,
+	VK_FORMAT_R16G16B16A16_SFLOAT,
+	VK_FORMAT_A2B10G10R10_UNORM_PACK32,
+};
+
+static bool read_file(const char *path, std::vector<uint8_t> &data)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		return false;
+
+	fseek(file, 0, SEEK_END);
+	long len = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	if (len < 0)
+	{
+		fclose(file);
+		return false;
+	}
+
+	data.resize(size_t(len));
+	bool ret = fread(data.data(), 1, data.size(), file) == data.size();
+	fclose(file);
+	return ret;
+}
+
+// Write to a temporary file first and rename it over the old one.
+// rename() is atomic on POSIX, so readers either see the old file or the new file, never something in between.
+static bool write_file_atomic(const char *path, const void *data, size_t size)
+{
+	std::string tmp_path = std::string(path) + ".tmp";
+	FILE *file = fopen(tmp_path.c_str(), "wb");
+	if (!file)
+		return false;
+
+	bool ret = fwrite(data, 1, size, file) == size;
+	ret = (fflush(file) == 0) && ret;
+	ret = (fclose(file) == 0) && ret;
+
+	if (!ret)
+	{
+		remove(tmp_path.c_str());
+		return false;
+	}
+
+#ifdef _WIN32
+	// rename() does not replace existing files on Windows.
+	remove(path);
+#endif
+	return rename(tmp_path.c_str(), path) == 0;
+}
+
+static const uint32_t DatabaseMagic = 0x50495045u; // "EPIP"
+static const uint32_t DatabaseVersion = 1;
+
+static std::vector<uint32_t> load_pipeline_database()
+{
+	std::vector<uint8_t> data;
+	if (!read_file(pipeline_database_path, data) || data.size() < 3 * sizeof(uint32_t))
+		return {};
+
+	uint32_t header[3];
+	memcpy(header, data.data(), sizeof(header));
+	if (header[0] != DatabaseMagic || header[1] != DatabaseVersion)
+		return {};
+
+	if (data.size() != sizeof(header) + header[2] * sizeof(uint32_t))
+		return {};
+
+	std::vector<uint32_t> keys(header[2]);
+	memcpy(keys.data(), data.data() + sizeof(header), keys.size() * sizeof(uint32_t));
+	return keys;
+}
+
+static bool save_pipeline_database(const std::vector<uint32_t> &keys)
+{
+	std::vector<uint32_t> data;
+	data.reserve(keys.size() + 3);
+	data.push_back(DatabaseMagic);
+	data.push_back(DatabaseVersion);
+	data.push_back(uint32_t(keys.size()));
+	data.insert(data.end(), keys.begin(), keys.end());
+	return write_file_atomic(pipeline_database_path, data.data(), data.size() * sizeof(uint32_t));
+}
+
+static void set_render_state(Vulkan::CommandBuffer &cmd, const PipelineKey &key)
+{
+	switch (key.state)
+	{
+	case 0:
+		cmd.set_opaque_state();
+		break;
+
+	case 1:
+		cmd.set_quad_state();
+		break;
+
+	default:
+		// Additive blending.
+		cmd.set_opaque_state();
+		cmd.set_depth_test(false, false);
+		cmd.set_blend_enable(true);
+		cmd.set_blend_factors(VK_BLEND_FACTOR_ONE, VK_BLEND_FACTOR_ONE);
+		cmd.set_blend_op(VK_BLEND_OP_ADD);
+		break;
+	}
+
+	cmd.set_color_write_mask(key.write_mask);
+}
+
+static void draw_key(Vulkan::CommandBuffer &cmd, Vulkan::Program *const *programs, const PipelineKey &key)
+{
+	set_render_state(cmd, key);
+	cmd.set_program(programs[key.program]);
+
+	if (key.program == 0)
+	{
+		// simple.vert pulls in a vertex attribute, so vertex input state participates in the pipeline as well.
+		static const float positions[3 * 4] = {
+			-1.0f, -1.0f, 0.0f, 1.0f,
+			-1.0f, +3.0f, 0.0f, 1.0f,
+			+3.0f, -1.0f, 0.0f, 1.0f,
+		};
+		void *data = cmd.allocate_vertex_data(0, sizeof(positions), 4 * sizeof(float));
+		memcpy(data, positions, sizeof(positions));
+		cmd.set_vertex_attrib(0, 0, VK_FORMAT_R32G32B32A32_SFLOAT, 0);
+	}
+
+	cmd.draw(3);
+}
+
+static void begin_render_pass(Vulkan::Device &device, Vulkan::CommandBuffer &cmd, VkFormat format, unsigned thread_index)
+{
+	// Transient attachments are synchronized automatically (see sample 08).
+	// Each thread uses its own attachment index, so threads never share an attachment.
+	Vulkan::RenderPassInfo rp;
+	rp.num_color_attachments = 1;
+	rp.color_attachments[0] = &device.get_transient_attachment(64, 64, format, thread_index);
+	rp.clear_attachments = 1 << 0;
+	cmd.begin_render_pass(rp);
+}
+
+// Pipelines only depend on the "compatible" render pass, so a tiny throw-away render target of the same format
+// is enough to warm up pipelines which will be used with full-sized render targets later.
+static void prewarm_pipelines(Vulkan::Device &device, Vulkan::Program *const *programs,
+                              const std::vector<uint32_t> &keys, unsigned num_threads)
+{
+	std::vector<std::thread> workers;
+	for (unsigned thread_index = 0; thread_index < num_threads; thread_index++)
+	{
+		workers.emplace_back([&, thread_index]() {
+			// Each worker thread records against its own thread index, so command pools and linear allocators are not shared.
+			auto cmd = device.request_command_buffer_for_thread(thread_index);
+
+			for (unsigned format = 0; format < sizeof(render_target_formats) / sizeof(render_target_formats[0]); format++)
+			{
+				bool in_render_pass = false;
+				for (size_t i = thread_index; i < keys.size(); i += num_threads)
+				{
+					auto key = PipelineKey::decode(keys[i]);
+					if (key.format != format)
+						continue;
+
+					if (!in_render_pass)
+					{
+						begin_render_pass(device, *cmd, render_target_formats[format], thread_index);
+						in_render_pass = true;
+					}
+
+					// This is where the actual vkCreateGraphicsPipelines happens.
+					draw_key(*cmd, programs, key);
+				}
+
+				if (in_render_pass)
+					cmd->end_render_pass();
+			}
+
+			device.submit(cmd);
+		});
+	}
+
+	for (auto &worker : workers)
+		worker.join();
+}
+
+static bool key_is_valid(const PipelineKey &key)
+{
+	return key.program < NumPrograms &&
+	       key.state < NumStates &&
+	       key.format < sizeof(render_target_formats) / sizeof(render_target_formats[0]) &&
+	       key.write_mask < NumWriteMasks;
+}
+
+// The pipelines a level needs. In a real engine, this falls out of which materials are loaded.
+// Here we pick a deterministic, pseudo-random quarter of all combinations, which overlaps between levels.
+static std::vector<PipelineKey> get_level_keys(unsigned level)
+{
+	std::vector<PipelineKey> level_keys;
+	for (uint8_t format = 0; format < sizeof(render_target_formats) / sizeof(render_target_formats[0]); format++)
+	{
+		for (uint8_t program = 0; program < NumPrograms; program++)
+		{
+			for (uint8_t state = 0; state < NumStates; state++)
+			{
+				for (uint8_t write_mask = 0; write_mask < NumWriteMasks; write_mask++)
+				{
+					PipelineKey key = { program, state, format, write_mask };
+					uint32_t h = key.encode() * 0x9e3779b1u + level * 0x85ebca6bu;
+					if (((h >> 16) & 3) == 0)
+						level_keys.push_back(key);
+				}
+			}
+		}
+	}
+	return level_keys;
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+{
+	return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+int main(int argc, char **argv)
+{
+	unsigned level = 0;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--cold") == 0)
+		{
+			remove(pipeline_cache_path);
+			remove(pipeline_database_path);
+		}
+		else if (strcmp(argv[i], "--level") == 0 && i + 1 < argc)
+			level = unsigned(strtoul(argv[++i], nullptr, 0));
+	}
+
+	// See sample 01.
+	if (!Vulkan::Context::init_loader(nullptr))
+	{
+		LOGE("Failed to create loader!\n");
+		return 1;
+	}
+
+	unsigned num_threads = std::max(1u, std::min(std::thread::hardware_concurrency(), 16u));
+
+	auto start_time = std::chrono::steady_clock::now();
+
+	Vulkan::Context context;
+	// Every thread which records command buffers needs its own thread index.
+	context.set_num_thread_indices(num_threads);
+	if (!context.init_instance_and_device(nullptr, 0, nullptr, 0))
+	{
+		LOGE("Failed to create VkInstance and VkDevice.\n");
+		return 1;
+	}
+
+	Vulkan::Device device;
+	device.set_context(context);
+	////
+
+	// Replace the empty VkPipelineCache which was created in set_context() with the one from last run.
+	// This has to happen before we create any pipelines.
+	// The blob has a header with vendor ID, device ID and pipeline cache UUID.
+	// If the driver or GPU changed since last run, the data is rejected and we just start out cold.
+	std::vector<uint8_t> cache_data;
+	if (read_file(pipeline_cache_path, cache_data))
+	{
+		if (!device.init_pipeline_cache(cache_data.data(), cache_data.size()))
+		{
+			LOGW("Pipeline cache is stale, starting cold.\n");
+			device.init_pipeline_cache(nullptr, 0);
+		}
+	}
+
+	std::vector<uint32_t> keys = load_pipeline_database();
+	keys.erase(std::remove_if(keys.begin(), keys.end(), [](uint32_t key) {
+		return !key_is_valid(PipelineKey::decode(key));
+	}), keys.end());
+
+	Vulkan::Program *programs[NumPrograms] = {
+		device.request_program(device.request_shader(simple_vert, sizeof(simple_vert)),
+		                       device.request_shader(simple_frag, sizeof(simple_frag))),
+		device.request_program(device.request_shader(gbuffer_vert, sizeof(gbuffer_vert)),
+		                       device.request_shader(simple_frag, sizeof(simple_frag))),
+	};
+
+	auto load_time = std::chrono::steady_clock::now();
+	prewarm_pipelines(device, programs, keys, num_threads);
+	auto warm_time = std::chrono::steady_clock::now();
+
+	// Our "first frame". It uses the pipelines the level needs, which is not necessarily what we prewarmed.
+	// Pipelines which were used in earlier runs are already in Granite's hashmap here, and cost nothing.
+	// Pipelines we have never seen before are compiled right here on the render thread.
+	std::unordered_set<uint32_t> prewarmed_keys(keys.begin(), keys.end());
+	std::unordered_set<uint32_t> seen_keys;
+	unsigned num_missed = 0;
+	auto level_keys = get_level_keys(level);
+	{
+		auto cmd = device.request_command_buffer();
+		int current_format = -1;
+		for (auto &key : level_keys)
+		{
+			if (int(key.format) != current_format)
+			{
+				if (current_format >= 0)
+					cmd->end_render_pass();
+				current_format = key.format;
+				begin_render_pass(device, *cmd, render_target_formats[key.format], 0);
+			}
+
+			draw_key(*cmd, programs, key);
+			seen_keys.insert(key.encode());
+			if (!prewarmed_keys.count(key.encode()))
+				num_missed++;
+		}
+
+		if (current_format >= 0)
+			cmd->end_render_pass();
+		device.submit(cmd);
+	}
+	auto frame_time = std::chrono::steady_clock::now();
+
+	device.next_frame_context();
+	device.wait_idle();
+
+	LOGI("Startup: %.3f ms to load caches, %.3f ms to prewarm %u pipelines on %u threads, %.3f ms first frame (%.3f ms total).\n",
+	     elapsed_ms(start_time, load_time), elapsed_ms(load_time, warm_time),
+	     unsigned(keys.size()), num_threads,
+	     elapsed_ms(warm_time, frame_time), elapsed_ms(start_time, frame_time));
+	LOGI("Level %u used %u pipelines, %u of them were not prewarmed.\n",
+	     level, unsigned(level_keys.size()), num_missed);
+
+	// Write back everything we know about for next run.
+	size_t cache_size = device.get_pipeline_cache_size();
+	cache_data.resize(cache_size);
+	if (cache_size && device.get_pipeline_cache_data(cache_data.data(), cache_size))
+	{
+		if (!write_file_atomic(pipeline_cache_path, cache_data.data(), cache_size))
+			LOGE("Failed to write pipeline cache.\n");
+	}
+
+	// The database only records pipelines which were actually used, in this run or an earlier one.
+	// Sort the keys to keep the file stable between runs.
+	for (auto key : keys)
+		seen_keys.insert(key);
+	keys.assign(seen_keys.begin(), seen_keys.end());
+	std::sort(keys.begin(), keys.end());
+	if (!save_pipeline_database(keys))
+		LOGE("Failed to write pipeline database.\n");
+}
@@ -0,0 +1,447 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "vulkan.hpp"
+#include "device.hpp"
+#include "util.hpp"
+#include "hash.hpp"
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_set>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+
+// In sample 10 and 12 we saw that pipelines are compiled lazily on the recording thread when we draw.
+// Sample 12 solves this for pipelines we know about up front, but new materials can stream in at any time.
+// Here we move compilation of unseen pipelines over to a pool of compile threads instead.
+// When the render thread finds a pipeline which is not compiled yet, it queues up the compile and
+// either skips the draw, draws with a fallback material which is known to be compiled, or blocks and compiles inline.
+// The policy is chosen per command buffer.
+
+// The compile threads simply record a command buffer which draws with the exact same state in a compatible render pass,
+// just like the warm-up in sample 12. Once that is done, the pipeline lives in the device and the real draw is just a hash lookup.
+// NOTE: Compile threads submit their command buffers to the device, and the device waits for all outstanding command buffers
+// to be submitted before it can move on to the next frame context. We therefore only compile one pipeline per command buffer,
+// so the worst case stall at the end of a frame is one pipeline compile, not the entire queue.
+
+static const uint32_t simple_vert[] =
+#include "shaders/simple.vert.inc"
+;
+
+static const uint32_t simple_frag[] =
+#include "shaders/simple.frag.inc"
+;
+
+static const uint32_t gbuffer_vert[] =
+#include "shaders/gbuffer.vert.inc"
+;
+
+// A "material" here is just the program and render state. See sample 12.
+struct Material
+{
+	Vulkan::Program *program;
+	bool needs_vertex_buffer;
+	uint8_t state;
+	uint8_t write_mask;
+};
+
+// See sample 12.
+static void draw_material(Vulkan::CommandBuffer &cmd, const Material &material)
+{
+	switch (material.state)
+	{
+	case 0:
+		cmd.set_opaque_state();
+		break;
+
+	case 1:
+		cmd.set_quad_state();
+		break;
+
+	default:
+		cmd.set_opaque_state();
+		cmd.set_depth_test(false, false);
+		cmd.set_blend_enable(true);
+		cmd.set_blend_factors(VK_BLEND_FACTOR_ONE, VK_BLEND_FACTOR_ONE);
+		cmd.set_blend_op(VK_BLEND_OP_ADD);
+		break;
+	}
+
+	cmd.set_color_write_mask(material.write_mask);
+	cmd.set_program(material.program);
+
+	if (material.needs_vertex_buffer)
+	{
+		static const float positions[3 * 4] = {
+			-1.0f, -1.0f, 0.0f, 1.0f,
+			-1.0f, +3.0f, 0.0f, 1.0f,
+			+3.0f, -1.0f, 0.0f, 1.0f,
+		};
+		void *data = cmd.allocate_vertex_data(0, sizeof(positions), 4 * sizeof(float));
+		memcpy(data, positions, sizeof(positions));
+		cmd.set_vertex_attrib(0, 0, VK_FORMAT_R32G32B32A32_SFLOAT, 0);
+	}
+
+	cmd.draw(3);
+}
+
+static void begin_render_pass(Vulkan::Device &device, Vulkan::CommandBuffer &cmd, VkFormat format, unsigned thread_index)
+{
+	Vulkan::RenderPassInfo rp;
+	rp.num_color_attachments = 1;
+	rp.color_attachments[0] = &device.get_transient_attachment(64, 64, format, thread_index);
+	rp.clear_attachments = 1 << 0;
+	cmd.begin_render_pass(rp);
+}
+
+// The application level pipeline key. Pipelines also depend on the render pass, so the format goes in here as well.
+static Util::Hash hash_material(const Material &material, VkFormat format)
+{
+	Util::Hasher h;
+	h.u64(reinterpret_cast<uintptr_t>(material.program));
+	h.u32(material.needs_vertex_buffer ? 1 : 0);
+	h.u32(material.state);
+	h.u32(material.write_mask);
+	h.u32(format);
+	return h.get();
+}
+
+class PipelineCompiler
+{
+public:
+	struct Stats
+	{
+		unsigned pending;
+		unsigned compiled;
+	};
+
+	// Compile threads use thread indices [first_thread_index, first_thread_index + num_threads).
+	PipelineCompiler(Vulkan::Device &device_, unsigned first_thread_index, unsigned num_threads)
+		: device(device_)
+	{
+		for (unsigned i = 0; i < num_threads; i++)
+			workers.emplace_back(&PipelineCompiler::worker_loop, this, first_thread_index + i);
+	}
+
+	~PipelineCompiler()
+	{
+		{
+			std::lock_guard<std::mutex> holder{lock};
+			dead = true;
+		}
+		cond.notify_all();
+		for (auto &worker : workers)
+			worker.join();
+	}
+
+	// Returns true if the pipeline is compiled.
+	// Otherwise, a compile is queued up if requested and there isn't one in flight already.
+	bool request(const Material &material, VkFormat format, bool queue_compile)
+	{
+		Util::Hash hash = hash_material(material, format);
+		std::lock_guard<std::mutex> holder{lock};
+		if (ready.count(hash))
+			return true;
+
+		if (queue_compile && queued.insert(hash).second)
+		{
+			jobs.push_back({ hash, material, format });
+			cond.notify_one();
+		}
+		return false;
+	}
+
+	// When a pipeline was compiled inline on the render thread.
+	void mark_ready(const Material &material, VkFormat format)
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		ready.insert(hash_material(material, format));
+	}
+
+	Stats get_stats()
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		Stats stats;
+		stats.pending = unsigned(queued.size());
+		stats.compiled = compiled;
+		return stats;
+	}
+
+private:
+	struct Job
+	{
+		Util::Hash hash;
+		Material material;
+		VkFormat format;
+	};
+
+	Vulkan::Device &device;
+	std::vector<std::thread> workers;
+	std::deque<Job> jobs;
+	std::unordered_set<Util::Hash> queued;
+	std::unordered_set<Util::Hash> ready;
+	std::mutex lock;
+	std::condition_variable cond;
+	unsigned compiled = 0;
+	bool dead = false;
+
+	void worker_loop(unsigned thread_index)
+	{
+		for (;;)
+		{
+			Job job;
+			{
+				std::unique_lock<std::mutex> holder{lock};
+				cond.wait(holder, [this]() { return dead || !jobs.empty(); });
+				if (dead)
+					return;
+				job = jobs.front();
+				jobs.pop_front();
+			}
+
+			// One pipeline per command buffer, see the note at the top.
+			auto cmd = device.request_command_buffer_for_thread(thread_index);
+			begin_render_pass(device, *cmd, job.format, thread_index);
+			draw_material(*cmd, job.material);
+			cmd->end_render_pass();
+			device.submit(cmd);
+
+			std::lock_guard<std::mutex> holder{lock};
+			queued.erase(job.hash);
+			ready.insert(job.hash);
+			compiled++;
+		}
+	}
+};
+
+enum class CompilePolicy
+{
+	// Compile on the recording thread like Granite normally does.
+	Block,
+	// Drop the draw until the pipeline is ready.
+	Skip,
+	// Draw with a caller-supplied material which is known to be compiled.
+	Fallback
+};
+
+// Wraps a command buffer with a compile policy.
+// Different command buffers can use different policies, e.g. a shadow pass might skip, while the main pass falls back.
+class PolicyCommandBuffer
+{
+public:
+	struct Stats
+	{
+		unsigned draws = 0;
+		unsigned skipped = 0;
+		unsigned fallbacks = 0;
+		double stall_ms = 0.0;
+	};
+
+	PolicyCommandBuffer(PipelineCompiler &compiler_, Vulkan::CommandBuffer &cmd_, VkFormat format_,
+	                    CompilePolicy policy_, const Material *fallback_ = nullptr)
+		: compiler(compiler_), cmd(cmd_), format(format_), policy(policy_), fallback(fallback_)
+	{
+	}
+
+	void draw(const Material &material)
+	{
+		// With the blocking policy, there is no point in compiling the same pipeline twice.
+		if (compiler.request(material, format, policy != CompilePolicy::Block))
+		{
+			draw_material(cmd, material);
+			stats.draws++;
+			return;
+		}
+
+		switch (policy)
+		{
+		case CompilePolicy::Block:
+		{
+			auto start = std::chrono::steady_clock::now();
+			draw_material(cmd, material);
+			auto end = std::chrono::steady_clock::now();
+			stats.stall_ms += std::chrono::duration<double, std::milli>(end - start).count();
+			stats.draws++;
+			compiler.mark_ready(material, format);
+			break;
+		}
+
+		case CompilePolicy::Fallback:
+			if (fallback)
+			{
+				draw_material(cmd, *fallback);
+				stats.fallbacks++;
+			}
+			else
+				stats.skipped++;
+			break;
+
+		case CompilePolicy::Skip:
+			stats.skipped++;
+			break;
+		}
+	}
+
+	const Stats &get_stats() const
+	{
+		return stats;
+	}
+
+private:
+	PipelineCompiler &compiler;
+	Vulkan::CommandBuffer &cmd;
+	VkFormat format;
+	CompilePolicy policy;
+	const Material *fallback;
+	Stats stats;
+};
+
+static const char *policy_to_string(CompilePolicy policy)
+{
+	switch (policy)
+	{
+	case CompilePolicy::Block:
+		return "block";
+	case CompilePolicy::Skip:
+		return "skip";
+	case CompilePolicy::Fallback:
+		return "fallback";
+	}
+	return "?";
+}
+
+int main()
+{
+	// See sample 01.
+	if (!Vulkan::Context::init_loader(nullptr))
+	{
+		LOGE("Failed to create loader!\n");
+		return 1;
+	}
+
+	// Thread index 0 is the render thread, the rest are compile threads.
+	unsigned num_compile_threads = std::max(2u, std::min(std::thread::hardware_concurrency(), 16u)) - 1u;
+
+	Vulkan::Context context;
+	context.set_num_thread_indices(1 + num_compile_threads);
+	if (!context.init_instance_and_device(nullptr, 0, nullptr, 0))
+	{
+		LOGE("Failed to create VkInstance and VkDevice.\n");
+		return 1;
+	}
+
+	Vulkan::Device device;
+	device.set_context(context);
+	////
+
+	Vulkan::Program *programs[2] = {
+		device.request_program(device.request_shader(simple_vert, sizeof(simple_vert)),
+		                       device.request_shader(simple_frag, sizeof(simple_frag))),
+		device.request_program(device.request_shader(gbuffer_vert, sizeof(gbuffer_vert)),
+		                       device.request_shader(simple_frag, sizeof(simple_frag))),
+	};
+
+	std::vector<Material> materials;
+	for (unsigned program = 0; program < 2; program++)
+		for (uint8_t state = 0; state < 3; state++)
+			for (uint8_t write_mask = 0; write_mask < 16; write_mask++)
+				materials.push_back({ programs[program], program == 0, state, write_mask });
+
+	const Material fallback = { programs[1], false, 0, 0xf };
+
+	// Each policy renders to a different format, so every policy starts out with cold pipelines.
+	static const struct
+	{
+		CompilePolicy policy;
+		VkFormat format;
+	} runs[] = {
+		{ CompilePolicy::Block, VK_FORMAT_R8G8B8A8_UNORM },
+		{ CompilePolicy::Skip, VK_FORMAT_R16G16B16A16_SFLOAT },
+		{ CompilePolicy::Fallback, VK_FORMAT_A2B10G10R10_UNORM_PACK32 },
+	};
+
+	// Pretend materials stream in over time.
+	static const unsigned NewMaterialsPerFrame = 8;
+	static const unsigned NumFrames = 120;
+
+	{
+		PipelineCompiler compiler(device, 1, num_compile_threads);
+
+		for (auto &run : runs)
+		{
+			// The fallback must be compiled up front, otherwise it's no better than what it replaces.
+			{
+				auto cmd = device.request_command_buffer();
+				begin_render_pass(device, *cmd, run.format, 0);
+				draw_material(*cmd, fallback);
+				cmd->end_render_pass();
+				device.submit(cmd);
+				compiler.mark_ready(fallback, run.format);
+			}
+
+			double total_ms = 0.0;
+			double worst_ms = 0.0;
+			PolicyCommandBuffer::Stats totals;
+
+			for (unsigned frame = 0; frame < NumFrames; frame++)
+			{
+				size_t visible = std::min(materials.size(), size_t(frame + 1) * NewMaterialsPerFrame);
+
+				auto start = std::chrono::steady_clock::now();
+				auto cmd = device.request_command_buffer();
+				begin_render_pass(device, *cmd, run.format, 0);
+				PolicyCommandBuffer policy_cmd(compiler, *cmd, run.format, run.policy, &fallback);
+				for (size_t i = 0; i < visible; i++)
+					policy_cmd.draw(materials[i]);
+				cmd->end_render_pass();
+				device.submit(cmd);
+				auto end = std::chrono::steady_clock::now();
+
+				double ms = std::chrono::duration<double, std::milli>(end - start).count();
+				total_ms += ms;
+				worst_ms = std::max(worst_ms, ms);
+
+				auto &stats = policy_cmd.get_stats();
+				totals.draws += stats.draws;
+				totals.skipped += stats.skipped;
+				totals.fallbacks += stats.fallbacks;
+				totals.stall_ms += stats.stall_ms;
+
+				device.next_frame_context();
+			}
+
+			auto compiler_stats = compiler.get_stats();
+			LOGI("Policy %8s: recording %.3f ms avg, %.3f ms worst | %u draws, %u skipped, %u fallbacks, "
+			     "%.3f ms stalled | %u compiled in background, %u pending.\n",
+			     policy_to_string(run.policy), total_ms / NumFrames, worst_ms,
+			     totals.draws, totals.skipped, totals.fallbacks, totals.stall_ms,
+			     compiler_stats.compiled, compiler_stats.pending);
+		}
+	}
+
+	device.wait_idle();
+}
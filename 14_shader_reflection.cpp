@@ -0,0 +1,205 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "vulkan.hpp"
+#include "device.hpp"
+#include "util.hpp"
+#include <vector>
+#include <chrono>
+#include <string.h>
+
+// As mentioned in sample 04, Device::request_shader() runs SPIRV-Cross on every new shader to figure out
+// which bindings, locations and push constant ranges are in use.
+// With a handful of shaders this is irrelevant, but with thousands of shaders, startup time is dominated by reflection.
+// Since we compile our SPIR-V offline anyways, we can just as well reflect it offline.
+// shaders/reflect.py emits a compact reflection blob next to every SPIR-V module (*.refl.inc), and here we
+// decode it into a Vulkan::ResourceLayout which we pass along with the SPIR-V.
+// When a layout is provided, the device trusts it and does not run SPIRV-Cross at all.
+
+static const uint32_t triangle_vert[] =
+#include "shaders/triangle.vert.inc"
+;
+
+static const uint32_t triangle_vert_refl[] =
+#include "shaders/triangle.vert.refl.inc"
+;
+
+static const uint32_t triangle_frag[] =
+#include "shaders/triangle.frag.inc"
+;
+
+static const uint32_t triangle_frag_refl[] =
+#include "shaders/triangle.frag.refl.inc"
+;
+
+static const uint32_t lighting_frag[] =
+#include "shaders/lighting.frag.inc"
+;
+
+static const uint32_t lighting_frag_refl[] =
+#include "shaders/lighting.frag.refl.inc"
+;
+
+static const uint32_t simple_comp[] =
+#include "shaders/simple.comp.inc"
+;
+
+static const uint32_t simple_comp_refl[] =
+#include "shaders/simple.comp.refl.inc"
+;
+
+// See shaders/reflect.py for the layout of the blob.
+static const uint32_t ReflectionMagic = 0x4c465247u; // "GRFL"
+static const uint32_t ReflectionVersion = 1;
+static const unsigned ReflectionHeaderWords = 6;
+static const unsigned ReflectionSetWords = 9 + VULKAN_NUM_BINDINGS / 4;
+
+static_assert(VULKAN_NUM_DESCRIPTOR_SETS == 4 && VULKAN_NUM_BINDINGS == 16,
+              "Reflection blob format assumes 4 sets and 16 bindings.");
+
+static bool decode_resource_layout(const uint32_t *blob, size_t size, Vulkan::ResourceLayout &layout)
+{
+	if (size != (ReflectionHeaderWords + VULKAN_NUM_DESCRIPTOR_SETS * ReflectionSetWords) * sizeof(uint32_t))
+		return false;
+	if (blob[0] != ReflectionMagic || blob[1] != ReflectionVersion)
+		return false;
+
+	layout = {};
+	layout.input_mask = blob[2];
+	layout.output_mask = blob[3];
+	layout.push_constant_size = blob[4];
+	layout.spec_constant_mask = blob[5];
+
+	const uint32_t *set_data = blob + ReflectionHeaderWords;
+	for (unsigned set = 0; set < VULKAN_NUM_DESCRIPTOR_SETS; set++, set_data += ReflectionSetWords)
+	{
+		auto &set_layout = layout.sets[set];
+		set_layout.sampled_image_mask = set_data[0];
+		set_layout.storage_image_mask = set_data[1];
+		set_layout.uniform_buffer_mask = set_data[2];
+		set_layout.storage_buffer_mask = set_data[3];
+		set_layout.sampled_buffer_mask = set_data[4];
+		set_layout.input_attachment_mask = set_data[5];
+		set_layout.sampler_mask = set_data[6];
+		set_layout.separate_image_mask = set_data[7];
+		set_layout.fp_mask = set_data[8];
+		// Array sizes are packed as little-endian bytes.
+		memcpy(set_layout.array_size, set_data + 9, VULKAN_NUM_BINDINGS);
+	}
+
+	return true;
+}
+
+struct ShaderSource
+{
+	const uint32_t *code;
+	size_t code_size;
+	const uint32_t *reflection;
+	size_t reflection_size;
+};
+
+#define SHADER_SOURCE(name) { name, sizeof(name), name##_refl, sizeof(name##_refl) }
+static const ShaderSource sources[] = {
+	SHADER_SOURCE(triangle_vert),
+	SHADER_SOURCE(triangle_frag),
+	SHADER_SOURCE(lighting_frag),
+	SHADER_SOURCE(simple_comp),
+};
+
+// To simulate a large number of unique shaders, we make copies of our shaders
+// where the generator word in the SPIR-V header is changed.
+// The generator word does not affect the meaning of the module, but it does affect its hash.
+static std::vector<std::vector<uint32_t>> make_unique_shaders(unsigned count, uint32_t generator_base)
+{
+	std::vector<std::vector<uint32_t>> shaders;
+	shaders.reserve(count);
+	for (unsigned i = 0; i < count; i++)
+	{
+		auto &source = sources[i % (sizeof(sources) / sizeof(sources[0]))];
+		std::vector<uint32_t> code(source.code, source.code + source.code_size / sizeof(uint32_t));
+		code[2] = generator_base + i;
+		shaders.push_back(std::move(code));
+	}
+	return shaders;
+}
+
+int main()
+{
+	// See sample 01.
+	if (!Vulkan::Context::init_loader(nullptr))
+	{
+		LOGE("Failed to create loader!\n");
+		return 1;
+	}
+
+	Vulkan::Context context;
+	if (!context.init_instance_and_device(nullptr, 0, nullptr, 0))
+	{
+		LOGE("Failed to create VkInstance and VkDevice.\n");
+		return 1;
+	}
+
+	Vulkan::Device device;
+	device.set_context(context);
+	////
+
+	// Decoding the blobs is just a few memcpys, so this is done once up front.
+	Vulkan::ResourceLayout layouts[sizeof(sources) / sizeof(sources[0])];
+	for (unsigned i = 0; i < sizeof(sources) / sizeof(sources[0]); i++)
+	{
+		if (!decode_resource_layout(sources[i].reflection, sources[i].reflection_size, layouts[i]))
+		{
+			LOGE("Reflection blob %u is invalid. Rebuild shaders with make -C shaders.\n", i);
+			return 1;
+		}
+	}
+
+	// The blob path can be used just like the normal path.
+	Vulkan::Program *program = device.request_program(
+			device.request_shader(triangle_vert, sizeof(triangle_vert), &layouts[0]),
+			device.request_shader(triangle_frag, sizeof(triangle_frag), &layouts[1]));
+	(void)program;
+
+	static const unsigned NumShaders = 4096;
+
+	// Use different generator words for the two runs, so the second run can't hit the shader cache of the first.
+	auto reflected = make_unique_shaders(NumShaders, 0x10000);
+	auto side_band = make_unique_shaders(NumShaders, 0x20000);
+
+	auto start = std::chrono::steady_clock::now();
+	for (auto &code : reflected)
+		device.request_shader(code.data(), code.size() * sizeof(uint32_t));
+	auto end_reflected = std::chrono::steady_clock::now();
+
+	for (unsigned i = 0; i < NumShaders; i++)
+	{
+		auto &code = side_band[i];
+		device.request_shader(code.data(), code.size() * sizeof(uint32_t),
+		                      &layouts[i % (sizeof(sources) / sizeof(sources[0]))]);
+	}
+	auto end_side_band = std::chrono::steady_clock::now();
+
+	double reflected_s = std::chrono::duration<double>(end_reflected - start).count();
+	double side_band_s = std::chrono::duration<double>(end_side_band - end_reflected).count();
+	LOGI("request_shader with SPIRV-Cross: %.0f shaders / s.\n", NumShaders / reflected_s);
+	LOGI("request_shader with reflection blob: %.0f shaders / s.\n", NumShaders / side_band_s);
+}
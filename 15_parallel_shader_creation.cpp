@@ -0,0 +1,224 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "vulkan.hpp"
+#include "device.hpp"
+#include "util.hpp"
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+
+// In sample 04, shaders and programs are requested one by one on the main thread.
+// With thousands of shaders, loading time scales linearly with the shader count, while the other cores sit idle.
+// When Granite is built with GRANITE_VULKAN_MT, the hashed shader and program caches in the device are thread-safe,
+// so we can hash, reflect (see sample 14) and create VkShaderModules, as well as descriptor set layouts and pipeline layouts
+// for programs from any number of threads at once.
+// If two threads race to create the same object, one of them wins and the other object is discarded.
+
+// Here we build a small batch API on top of that. We queue up every shader and program we need,
+// fan the work out over worker threads and return when everything is ready.
+
+static const uint32_t triangle_vert[] =
+#include "shaders/triangle.vert.inc"
+;
+
+static const uint32_t triangle_frag[] =
+#include "shaders/triangle.frag.inc"
+;
+
+static const uint32_t simple_comp[] =
+#include "shaders/simple.comp.inc"
+;
+
+class ShaderBatch
+{
+public:
+	// The SPIR-V must remain valid until build() returns.
+	// The layout is optional, see sample 14.
+	unsigned add_shader(const uint32_t *code, size_t size, const Vulkan::ResourceLayout *layout = nullptr)
+	{
+		shader_infos.push_back({ code, size, layout });
+		return unsigned(shader_infos.size() - 1);
+	}
+
+	unsigned add_program(unsigned vert, unsigned frag)
+	{
+		program_infos.push_back({ vert, frag, true });
+		return unsigned(program_infos.size() - 1);
+	}
+
+	unsigned add_program(unsigned comp)
+	{
+		program_infos.push_back({ comp, 0, false });
+		return unsigned(program_infos.size() - 1);
+	}
+
+	// Programs depend on their shaders, so we create all shaders first, then all programs.
+	void build(Vulkan::Device &device, unsigned num_threads)
+	{
+		shaders.resize(shader_infos.size());
+		programs.resize(program_infos.size());
+
+		run_parallel(num_threads, unsigned(shader_infos.size()), [&](unsigned index) {
+			auto &info = shader_infos[index];
+			shaders[index] = device.request_shader(info.code, info.size, info.layout);
+		});
+
+		run_parallel(num_threads, unsigned(program_infos.size()), [&](unsigned index) {
+			auto &info = program_infos[index];
+			if (info.graphics)
+				programs[index] = device.request_program(shaders[info.first], shaders[info.second]);
+			else
+				programs[index] = device.request_program(shaders[info.first]);
+		});
+	}
+
+	Vulkan::Shader *get_shader(unsigned index) const
+	{
+		return shaders[index];
+	}
+
+	Vulkan::Program *get_program(unsigned index) const
+	{
+		return programs[index];
+	}
+
+private:
+	struct ShaderInfo
+	{
+		const uint32_t *code;
+		size_t size;
+		const Vulkan::ResourceLayout *layout;
+	};
+
+	struct ProgramInfo
+	{
+		unsigned first;
+		unsigned second;
+		bool graphics;
+	};
+
+	std::vector<ShaderInfo> shader_infos;
+	std::vector<ProgramInfo> program_infos;
+	std::vector<Vulkan::Shader *> shaders;
+	std::vector<Vulkan::Program *> programs;
+
+	// Work is handed out one item at a time from an atomic counter.
+	// Shaders vary a lot in size, so static partitioning would leave threads idle.
+	template <typename Func>
+	static void run_parallel(unsigned num_threads, unsigned count, const Func &func)
+	{
+		std::atomic<unsigned> next;
+		next.store(0);
+
+		auto worker = [&]() {
+			unsigned index;
+			while ((index = next.fetch_add(1, std::memory_order_relaxed)) < count)
+				func(index);
+		};
+
+		std::vector<std::thread> threads;
+		for (unsigned i = 1; i < num_threads; i++)
+			threads.emplace_back(worker);
+
+		// The calling thread helps out as well.
+		worker();
+
+		for (auto &thread : threads)
+			thread.join();
+	}
+};
+
+// See sample 14.
+static std::vector<uint32_t> make_unique_shader(const uint32_t *code, size_t size, uint32_t generator)
+{
+	std::vector<uint32_t> unique_code(code, code + size / sizeof(uint32_t));
+	unique_code[2] = generator;
+	return unique_code;
+}
+
+int main()
+{
+	// See sample 01.
+	if (!Vulkan::Context::init_loader(nullptr))
+	{
+		LOGE("Failed to create loader!\n");
+		return 1;
+	}
+
+	Vulkan::Context context;
+	if (!context.init_instance_and_device(nullptr, 0, nullptr, 0))
+	{
+		LOGE("Failed to create VkInstance and VkDevice.\n");
+		return 1;
+	}
+
+	Vulkan::Device device;
+	device.set_context(context);
+	////
+
+	static const unsigned NumGraphicsPrograms = 1024;
+	static const unsigned NumComputePrograms = 1024;
+
+	unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+	double single_thread_ms = 0.0;
+
+	for (unsigned num_threads = 1; num_threads <= 32; num_threads *= 2)
+	{
+		if (num_threads > max_threads)
+			break;
+
+		// Every run needs its own unique shaders, or we would just hit the caches of the previous run.
+		uint32_t generator_base = num_threads << 16;
+		std::vector<std::vector<uint32_t>> code;
+		code.reserve(2 * NumGraphicsPrograms + NumComputePrograms);
+		for (unsigned i = 0; i < NumGraphicsPrograms; i++)
+		{
+			code.push_back(make_unique_shader(triangle_vert, sizeof(triangle_vert), generator_base + i));
+			code.push_back(make_unique_shader(triangle_frag, sizeof(triangle_frag), generator_base + i));
+		}
+		for (unsigned i = 0; i < NumComputePrograms; i++)
+			code.push_back(make_unique_shader(simple_comp, sizeof(simple_comp), generator_base + i));
+
+		ShaderBatch batch;
+		for (auto &c : code)
+			batch.add_shader(c.data(), c.size() * sizeof(uint32_t));
+		for (unsigned i = 0; i < NumGraphicsPrograms; i++)
+			batch.add_program(2 * i, 2 * i + 1);
+		for (unsigned i = 0; i < NumComputePrograms; i++)
+			batch.add_program(2 * NumGraphicsPrograms + i);
+
+		auto start = std::chrono::steady_clock::now();
+		batch.build(device, num_threads);
+		auto end = std::chrono::steady_clock::now();
+
+		double ms = std::chrono::duration<double, std::milli>(end - start).count();
+		if (num_threads == 1)
+			single_thread_ms = ms;
+
+		LOGI("%2u threads: %u shaders and %u programs in %.3f ms (%.2fx).\n",
+		     num_threads, unsigned(code.size()), NumGraphicsPrograms + NumComputePrograms,
+		     ms, single_thread_ms / ms);
+	}
+}
@@ -0,0 +1,414 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "vulkan.hpp"
+#include "device.hpp"
+#include "util.hpp"
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <string.h>
+
+// In sample 05, bindless was ruled out as the default binding model, mostly for compatibility reasons.
+// On hardware which supports descriptor indexing, however, it's a very nice tool to have in the box
+// when draw counts get large, since the per-draw cost of resolving descriptor sets goes away entirely.
+// Here we set up an opt-in bindless heap which coexists with the normal set/binding model:
+// - Textures are registered in the heap once, typically when they are created, and get a stable index back.
+// - The heap is one large descriptor set with an unsized array of sampled images.
+//   It's bound to a dedicated descriptor set, and shaders pick the texture with an index passed in push constants.
+// - The descriptor set is allocated once. Registering a texture only writes the descriptor for its own slot.
+// - Granite's bindless pools only deal with images, so storage buffers are sub-allocated from one large buffer
+//   which is bound once per command buffer, and shaders index into it the same way.
+// - An unregistered slot might still be read by the GPU, so it's only reused once a fence tells us the GPU is done.
+// - Other descriptor sets work exactly like before, so legacy shaders and bindless shaders can be mixed freely,
+//   even within the same render pass.
+
+// This sample benchmarks the CPU cost per draw when every draw uses a different texture.
+
+static const uint32_t gbuffer_vert[] =
+#include "shaders/gbuffer.vert.inc"
+;
+
+static const uint32_t texture_frag[] =
+#include "shaders/texture.frag.inc"
+;
+
+static const uint32_t bindless_frag[] =
+#include "shaders/bindless.frag.inc"
+;
+
+class BindlessHeap
+{
+public:
+	enum : uint32_t { InvalidIndex = ~0u };
+	// Buffers are handed out in fixed-size slots of vec4s, see shaders/bindless.frag.
+	enum { BufferSlotSize = 16 * sizeof(float) * 4 };
+
+	BindlessHeap(Vulkan::Device &device_, unsigned texture_capacity_, unsigned buffer_capacity_)
+		: device(device_), texture_capacity(texture_capacity_), buffer_capacity(buffer_capacity_),
+		  texture_images(texture_capacity_)
+	{
+	}
+
+	// The pool, the descriptor set and the buffer are created once, and live as long as the heap.
+	bool init()
+	{
+		pool = device.create_bindless_descriptor_pool(Vulkan::BindlessResourceType::ImageFP, 1, texture_capacity);
+		if (!pool || !pool->allocate_descriptors(texture_capacity))
+		{
+			pool.reset();
+			return false;
+		}
+
+		Vulkan::BufferCreateInfo info;
+		info.size = VkDeviceSize(buffer_capacity) * BufferSlotSize;
+		info.domain = Vulkan::BufferDomain::Host;
+		info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+		buffer = device.create_buffer(info);
+		return bool(buffer);
+	}
+
+	// The heap holds a reference to the image for as long as it's registered.
+	// The index is stable until the texture is unregistered.
+	// Only the new slot is written, the rest of the descriptor set is left alone.
+	// Bindless descriptor sets are UPDATE_AFTER_BIND, so we can write a slot while command buffers
+	// which use the set are in flight, as long as they do not read that slot, see retire().
+	uint32_t register_texture(Vulkan::ImageHandle image)
+	{
+		reclaim();
+		uint32_t index = textures.allocate(texture_capacity);
+		if (index == InvalidIndex)
+			return InvalidIndex;
+
+		pool->set_texture(index, image->get_view());
+		texture_images[index] = std::move(image);
+		return index;
+	}
+
+	void unregister_texture(uint32_t index)
+	{
+		if (!textures.free(index))
+		{
+			LOGE("Unregistering texture %u which is not registered.\n", index);
+			return;
+		}
+
+		// Dropping the reference defers destruction like any other image.
+		// The descriptor in the slot is left dangling, which is fine since bindless descriptor sets are PARTIALLY_BOUND,
+		// and no shader will index it again.
+		texture_images[index].reset();
+	}
+
+	// Storage buffers go into one large buffer, which is bound once, just like the texture heap.
+	// Returns the index of the first vec4 in the slot, which is what the shader uses.
+	uint32_t register_buffer(const void *data, VkDeviceSize size)
+	{
+		if (size > BufferSlotSize)
+			return InvalidIndex;
+
+		reclaim();
+		uint32_t slot = buffers.allocate(buffer_capacity);
+		if (slot == InvalidIndex)
+			return InvalidIndex;
+
+		auto *mapped = static_cast<uint8_t *>(device.map_host_buffer(*buffer, Vulkan::MEMORY_ACCESS_WRITE_BIT));
+		memcpy(mapped + VkDeviceSize(slot) * BufferSlotSize, data, size_t(size));
+		device.unmap_host_buffer(*buffer, Vulkan::MEMORY_ACCESS_WRITE_BIT);
+		return slot * uint32_t(BufferSlotSize / (4 * sizeof(float)));
+	}
+
+	void unregister_buffer(uint32_t index)
+	{
+		if (index % (BufferSlotSize / (4 * sizeof(float))) != 0 ||
+		    !buffers.free(index / uint32_t(BufferSlotSize / (4 * sizeof(float)))))
+		{
+			LOGE("Unregistering buffer %u which is not registered.\n", index);
+		}
+	}
+
+	// Slots which were unregistered might still be read by command buffers which are in flight,
+	// and writing a new descriptor or new data into them would race with the GPU.
+	// Call this after submitting command buffers which use the heap.
+	// The slots freed so far are not handed out again until the fence has signalled.
+	void retire(Vulkan::Fence fence)
+	{
+		textures.retire(fence);
+		buffers.retire(fence);
+	}
+
+	VkDescriptorSet get_descriptor_set() const
+	{
+		return pool ? pool->get_descriptor_set() : VK_NULL_HANDLE;
+	}
+
+	const Vulkan::Buffer &get_buffer() const
+	{
+		return *buffer;
+	}
+
+private:
+	// Stable indices with a free list. Freed indices are held back until the GPU is done with them.
+	class SlotAllocator
+	{
+	public:
+		uint32_t allocate(unsigned capacity)
+		{
+			uint32_t index;
+			if (!free_indices.empty())
+			{
+				index = free_indices.back();
+				free_indices.pop_back();
+			}
+			else if (allocated.size() < capacity)
+			{
+				index = uint32_t(allocated.size());
+				allocated.push_back(false);
+			}
+			else
+				return InvalidIndex;
+
+			allocated[index] = true;
+			return index;
+		}
+
+		bool free(uint32_t index)
+		{
+			if (index >= allocated.size() || !allocated[index])
+				return false;
+			allocated[index] = false;
+			unretired.push_back(index);
+			return true;
+		}
+
+		void retire(Vulkan::Fence fence)
+		{
+			if (unretired.empty())
+				return;
+			pending.push_back({ std::move(fence), std::move(unretired) });
+			unretired.clear();
+		}
+
+		void reclaim()
+		{
+			// Fences signal in submission order, so we can stop at the first one which has not signalled.
+			while (!pending.empty() && (!pending.front().fence || pending.front().fence->wait_timeout(0)))
+			{
+				auto &indices = pending.front().indices;
+				free_indices.insert(free_indices.end(), indices.begin(), indices.end());
+				pending.pop_front();
+			}
+		}
+
+	private:
+		std::vector<bool> allocated;
+		std::vector<uint32_t> free_indices;
+		std::vector<uint32_t> unretired;
+
+		struct Pending
+		{
+			Vulkan::Fence fence;
+			std::vector<uint32_t> indices;
+		};
+		std::deque<Pending> pending;
+	};
+
+	Vulkan::Device &device;
+	unsigned texture_capacity;
+	unsigned buffer_capacity;
+	Vulkan::BindlessDescriptorPoolHandle pool;
+	Vulkan::BufferHandle buffer;
+	std::vector<Vulkan::ImageHandle> texture_images;
+	SlotAllocator textures;
+	SlotAllocator buffers;
+
+	void reclaim()
+	{
+		textures.reclaim();
+		buffers.reclaim();
+	}
+};
+
+static Vulkan::ImageHandle create_texture(Vulkan::Device &device, uint32_t color)
+{
+	// See sample 02.
+	Vulkan::ImageCreateInfo info = Vulkan::ImageCreateInfo::immutable_2d_image(4, 4, VK_FORMAT_R8G8B8A8_UNORM);
+	info.initial_layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+	uint32_t texels[4 * 4];
+	for (auto &texel : texels)
+		texel = color;
+
+	Vulkan::ImageInitialData initial_data = {};
+	initial_data.data = texels;
+	return device.create_image(info, &initial_data);
+}
+
+static const unsigned NumTextures = 1024;
+// Textures which are replaced in the heap every frame.
+static const unsigned NumStreamedTextures = 16;
+static const unsigned NumDraws = 50000;
+static const unsigned NumFrames = 16;
+
+static void begin_render_pass(Vulkan::Device &device, Vulkan::CommandBuffer &cmd)
+{
+	Vulkan::RenderPassInfo rp;
+	rp.num_color_attachments = 1;
+	rp.color_attachments[0] = &device.get_transient_attachment(64, 64, VK_FORMAT_R8G8B8A8_UNORM);
+	rp.clear_attachments = 1 << 0;
+	cmd.begin_render_pass(rp);
+	cmd.set_opaque_state();
+}
+
+int main()
+{
+	// See sample 01.
+	if (!Vulkan::Context::init_loader(nullptr))
+	{
+		LOGE("Failed to create loader!\n");
+		return 1;
+	}
+
+	Vulkan::Context context;
+	if (!context.init_instance_and_device(nullptr, 0, nullptr, 0))
+	{
+		LOGE("Failed to create VkInstance and VkDevice.\n");
+		return 1;
+	}
+
+	Vulkan::Device device;
+	device.set_context(context);
+	////
+
+	Vulkan::Program *legacy_prog = device.request_program(
+			device.request_shader(gbuffer_vert, sizeof(gbuffer_vert)),
+			device.request_shader(texture_frag, sizeof(texture_frag)));
+
+	Vulkan::Program *bindless_prog = device.request_program(
+			device.request_shader(gbuffer_vert, sizeof(gbuffer_vert)),
+			device.request_shader(bindless_frag, sizeof(bindless_frag)));
+
+	// Unregistered slots are held back until the GPU is done with them, so leave room for a few frames of churn.
+	BindlessHeap heap(device, NumTextures + NumStreamedTextures * NumFrames, NumTextures);
+	if (!heap.init())
+	{
+		LOGE("Bindless is not supported on this device.\n");
+		return 1;
+	}
+
+	std::vector<Vulkan::ImageHandle> textures;
+	std::vector<uint32_t> texture_indices;
+	std::vector<uint32_t> buffer_indices;
+	for (unsigned i = 0; i < NumTextures; i++)
+	{
+		textures.push_back(create_texture(device, 0xff000000u | (i * 0x10101u)));
+		texture_indices.push_back(heap.register_texture(textures.back()));
+
+		// Per-object data, e.g. material parameters.
+		float color_mod[4] = { 1.0f, float(i) / NumTextures, 1.0f, 1.0f };
+		buffer_indices.push_back(heap.register_buffer(color_mod, sizeof(color_mod)));
+	}
+
+	double legacy_ns = 0.0;
+	double bindless_ns = 0.0;
+	double update_ns = 0.0;
+
+	for (unsigned frame = 0; frame < NumFrames; frame++)
+	{
+		// Set/binding model. Every draw binds a different texture to set 2, so the set is re-hashed on every draw.
+		// Once the descriptor set allocator has seen every texture, these are all hashmap hits (see sample 05),
+		// but we still pay for hashing and lookup.
+		{
+			auto cmd = device.request_command_buffer();
+			begin_render_pass(device, *cmd);
+			cmd->set_program(legacy_prog);
+
+			auto start = std::chrono::steady_clock::now();
+			for (unsigned draw = 0; draw < NumDraws; draw++)
+			{
+				cmd->set_texture(2, 0, textures[draw % NumTextures]->get_view(), Vulkan::StockSampler::LinearClamp);
+				cmd->draw(3);
+			}
+			auto end = std::chrono::steady_clock::now();
+
+			cmd->end_render_pass();
+			device.submit(cmd);
+
+			// The first frames are warming up the descriptor set caches, don't count them.
+			if (frame >= NumFrames / 2)
+				legacy_ns += std::chrono::duration<double, std::nano>(end - start).count();
+		}
+
+		// Textures come and go while the heap is in use, like they would with texture streaming.
+		// Each change is a single descriptor write, no matter how large the heap is.
+		{
+			auto start = std::chrono::steady_clock::now();
+			for (unsigned i = 0; i < NumStreamedTextures; i++)
+			{
+				unsigned slot = (frame * NumStreamedTextures + i) % NumTextures;
+				heap.unregister_texture(texture_indices[slot]);
+				texture_indices[slot] = heap.register_texture(textures[slot]);
+				if (texture_indices[slot] == BindlessHeap::InvalidIndex)
+				{
+					LOGE("Bindless heap is full.\n");
+					return 1;
+				}
+			}
+			auto end = std::chrono::steady_clock::now();
+			update_ns += std::chrono::duration<double, std::nano>(end - start).count();
+		}
+
+		// Bindless. The heap is bound once, and every draw only updates a push constant.
+		{
+			auto cmd = device.request_command_buffer();
+			begin_render_pass(device, *cmd);
+			cmd->set_program(bindless_prog);
+			cmd->set_sampler(0, 0, Vulkan::StockSampler::LinearClamp);
+			cmd->set_bindless(1, heap.get_descriptor_set());
+			cmd->set_storage_buffer(2, 0, heap.get_buffer());
+
+			auto start = std::chrono::steady_clock::now();
+			for (unsigned draw = 0; draw < NumDraws; draw++)
+			{
+				// See shaders/bindless.frag.
+				uint32_t indices[2] = { texture_indices[draw % NumTextures], buffer_indices[draw % NumTextures] };
+				cmd->push_constants(indices, 0, sizeof(indices));
+				cmd->draw(3);
+			}
+			auto end = std::chrono::steady_clock::now();
+
+			cmd->end_render_pass();
+			Vulkan::Fence fence;
+			device.submit(cmd, &fence);
+			heap.retire(fence);
+
+			if (frame >= NumFrames / 2)
+				bindless_ns += std::chrono::duration<double, std::nano>(end - start).count();
+		}
+
+		device.next_frame_context();
+	}
+
+	unsigned measured_draws = NumDraws * (NumFrames - NumFrames / 2);
+	LOGI("Set/binding model: %.1f ns / draw.\n", legacy_ns / measured_draws);
+	LOGI("Bindless: %.1f ns / draw.\n", bindless_ns / measured_draws);
+	LOGI("Bindless heap updates: %.1f ns / texture.\n", update_ns / (NumStreamedTextures * NumFrames));
+}
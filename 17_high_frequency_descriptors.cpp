@@ -0,0 +1,726 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "vulkan.hpp"
+#include "device.hpp"
+#include "util.hpp"
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <string.h>
+
+// Sample 05 recommends putting per-draw uniforms in set 3.
+// A set which changes on every draw is the worst case for the descriptor set allocator.
+// If the set has not been seen before, we have to allocate a VkDescriptorSet and call vkUpdateDescriptorSets.
+// If it has been seen, we still have to hash the bindings and look up the set, once per draw.
+
+// Granite already has a fast path for this, which is the reason per-draw uniforms should come from the linear allocator (sample 07).
+// Uniform buffers are always bound as UNIFORM_BUFFER_DYNAMIC. The offset is not part of the descriptor set hash,
+// it is passed in as a dynamic offset to vkCmdBindDescriptorSets instead.
+// When the same buffer is bound again with a new offset, the command buffer notices that only the dynamic offsets changed,
+// and just rebinds the set it already has. There's no hashing, no lookup and no descriptor update.
+// Since every allocation from the linear allocator comes out of the same large VkBuffer,
+// this is the case for almost every draw.
+
+// The other case is where the churn comes from binding new VkBuffers (or images) every draw.
+// Vulkan has two tools for that, which we use directly with raw Vulkan calls here, since Granite does not expose them:
+// - VkDescriptorUpdateTemplate: One template per descriptor set layout, which describes where the descriptors
+//   live in an application struct. vkUpdateDescriptorSetWithTemplate() then updates the whole set in one go,
+//   without building VkWriteDescriptorSet arrays.
+// - VK_KHR_push_descriptor: The descriptors are pushed straight into the command buffer for high-frequency sets.
+//   There is no VkDescriptorSet, no pool and no allocation at all.
+
+// This sample measures CPU time per draw for five ways of feeding per-draw uniforms:
+// - Fresh buffers: A new VkBuffer for every draw, through Granite. Every draw is a new descriptor set.
+// - Persistent buffers: A pool of VkBuffers which are reused every frame, through Granite. Every draw is a hashmap hit.
+// - Linear allocator: Through Granite. Only the dynamic offset changes.
+// - Update template: A new VkBuffer for every draw. A set is allocated from a pool and updated with a template.
+// - Push descriptors: A new VkBuffer for every draw. The descriptors are pushed with vkCmdPushDescriptorSetKHR.
+
+// To see what actually happens, we count the Vulkan calls which are made.
+// Granite does not call the global vk* functions for device-level calls. It dispatches through the VolkDeviceTable
+// which the Context loads when it creates the VkDevice, and the Device keeps a pointer to that table.
+// We replace entries in the table with counting functions before handing the Context to the Device,
+// and the raw Vulkan code below calls through the same table so it's counted too.
+// If a Granite revision ever dispatches some other way, the counters stay at 0, so we check for that, see run_strategy().
+struct VulkanCallCounters
+{
+	unsigned allocate_descriptor_sets = 0;
+	unsigned update_descriptor_sets = 0;
+	unsigned descriptor_writes = 0;
+	unsigned update_descriptor_set_with_template = 0;
+	unsigned bind_descriptor_sets = 0;
+	unsigned push_descriptor_set = 0;
+};
+
+static VulkanCallCounters call_counters;
+static PFN_vkAllocateDescriptorSets real_vkAllocateDescriptorSets;
+static PFN_vkUpdateDescriptorSets real_vkUpdateDescriptorSets;
+static PFN_vkUpdateDescriptorSetWithTemplate real_vkUpdateDescriptorSetWithTemplate;
+static PFN_vkCmdBindDescriptorSets real_vkCmdBindDescriptorSets;
+static PFN_vkCmdPushDescriptorSetKHR real_vkCmdPushDescriptorSetKHR;
+
+static VKAPI_ATTR VkResult VKAPI_CALL counting_vkAllocateDescriptorSets(
+		VkDevice device, const VkDescriptorSetAllocateInfo *info, VkDescriptorSet *sets)
+{
+	call_counters.allocate_descriptor_sets++;
+	return real_vkAllocateDescriptorSets(device, info, sets);
+}
+
+static VKAPI_ATTR void VKAPI_CALL counting_vkUpdateDescriptorSets(
+		VkDevice device, uint32_t write_count, const VkWriteDescriptorSet *writes,
+		uint32_t copy_count, const VkCopyDescriptorSet *copies)
+{
+	call_counters.update_descriptor_sets++;
+	call_counters.descriptor_writes += write_count;
+	real_vkUpdateDescriptorSets(device, write_count, writes, copy_count, copies);
+}
+
+static VKAPI_ATTR void VKAPI_CALL counting_vkUpdateDescriptorSetWithTemplate(
+		VkDevice device, VkDescriptorSet set, VkDescriptorUpdateTemplate update_template, const void *data)
+{
+	call_counters.update_descriptor_set_with_template++;
+	real_vkUpdateDescriptorSetWithTemplate(device, set, update_template, data);
+}
+
+static VKAPI_ATTR void VKAPI_CALL counting_vkCmdBindDescriptorSets(
+		VkCommandBuffer cmd, VkPipelineBindPoint bind_point, VkPipelineLayout layout,
+		uint32_t first_set, uint32_t set_count, const VkDescriptorSet *sets,
+		uint32_t dynamic_offset_count, const uint32_t *dynamic_offsets)
+{
+	call_counters.bind_descriptor_sets++;
+	real_vkCmdBindDescriptorSets(cmd, bind_point, layout, first_set, set_count, sets, dynamic_offset_count, dynamic_offsets);
+}
+
+static VKAPI_ATTR void VKAPI_CALL counting_vkCmdPushDescriptorSetKHR(
+		VkCommandBuffer cmd, VkPipelineBindPoint bind_point, VkPipelineLayout layout,
+		uint32_t set, uint32_t write_count, const VkWriteDescriptorSet *writes)
+{
+	call_counters.push_descriptor_set++;
+	real_vkCmdPushDescriptorSetKHR(cmd, bind_point, layout, set, write_count, writes);
+}
+
+// Must be called after the VkDevice is created, and before Device::set_context().
+static void install_call_counters(VolkDeviceTable &table)
+{
+	real_vkAllocateDescriptorSets = table.vkAllocateDescriptorSets;
+	table.vkAllocateDescriptorSets = counting_vkAllocateDescriptorSets;
+	real_vkUpdateDescriptorSets = table.vkUpdateDescriptorSets;
+	table.vkUpdateDescriptorSets = counting_vkUpdateDescriptorSets;
+	real_vkCmdBindDescriptorSets = table.vkCmdBindDescriptorSets;
+	table.vkCmdBindDescriptorSets = counting_vkCmdBindDescriptorSets;
+
+	// These are only there if the device supports them.
+	if (table.vkUpdateDescriptorSetWithTemplate)
+	{
+		real_vkUpdateDescriptorSetWithTemplate = table.vkUpdateDescriptorSetWithTemplate;
+		table.vkUpdateDescriptorSetWithTemplate = counting_vkUpdateDescriptorSetWithTemplate;
+	}
+
+	if (table.vkCmdPushDescriptorSetKHR)
+	{
+		real_vkCmdPushDescriptorSetKHR = table.vkCmdPushDescriptorSetKHR;
+		table.vkCmdPushDescriptorSetKHR = counting_vkCmdPushDescriptorSetKHR;
+	}
+}
+
+static void log_call_counters(const char *tag, unsigned frame, const VulkanCallCounters &before)
+{
+	LOGI("%s, frame %u: %u vkAllocateDescriptorSets, %u vkUpdateDescriptorSets (%u writes), "
+	     "%u vkUpdateDescriptorSetWithTemplate, %u vkCmdBindDescriptorSets, %u vkCmdPushDescriptorSetKHR.\n",
+	     tag, frame,
+	     call_counters.allocate_descriptor_sets - before.allocate_descriptor_sets,
+	     call_counters.update_descriptor_sets - before.update_descriptor_sets,
+	     call_counters.descriptor_writes - before.descriptor_writes,
+	     call_counters.update_descriptor_set_with_template - before.update_descriptor_set_with_template,
+	     call_counters.bind_descriptor_sets - before.bind_descriptor_sets,
+	     call_counters.push_descriptor_set - before.push_descriptor_set);
+}
+
+static const uint32_t triangle_vert[] =
+#include "shaders/triangle.vert.inc"
+;
+
+static const uint32_t triangle_frag[] =
+#include "shaders/triangle.frag.inc"
+;
+
+// See shaders/triangle.vert and shaders/triangle.frag.
+struct VertexUBO
+{
+	float offset[2];
+	float scale[2];
+};
+
+struct FragmentUBO
+{
+	float color_mod[4];
+};
+
+static const float positions[3 * 2] = {
+	-0.5f, -0.5f,
+	-0.5f, +0.5f,
+	+0.5f, -0.5f,
+};
+
+static const float colors[3 * 4] = {
+	1.0f, 0.0f, 0.0f, 1.0f,
+	0.0f, 1.0f, 0.0f, 1.0f,
+	0.0f, 0.0f, 1.0f, 1.0f,
+};
+
+// minUniformBufferOffsetAlignment is at most 256 bytes.
+static const VkDeviceSize FragmentUBOOffset = 256;
+static const VkDeviceSize UBOBufferSize = 512;
+
+static const unsigned NumDraws = 4096;
+// The linear allocator is cheap enough that we can also try it with a lot more draws.
+static const unsigned NumDrawsLinear = 100000;
+static const unsigned NumFrames = 16;
+// The raw paths keep one descriptor pool per frame in flight.
+static const unsigned NumFramesInFlight = 2;
+static const VkFormat RenderTargetFormat = VK_FORMAT_R8G8B8A8_UNORM;
+static const uint32_t RenderTargetSize = 64;
+
+enum class Strategy
+{
+	FreshBuffers,
+	PersistentBuffers,
+	LinearAllocator,
+	UpdateTemplate,
+	PushDescriptors
+};
+
+static const char *strategy_to_string(Strategy strategy)
+{
+	switch (strategy)
+	{
+	case Strategy::FreshBuffers:
+		return "Fresh buffers";
+	case Strategy::PersistentBuffers:
+		return "Persistent buffers";
+	case Strategy::LinearAllocator:
+		return "Linear allocator";
+	case Strategy::UpdateTemplate:
+		return "Update template";
+	case Strategy::PushDescriptors:
+		return "Push descriptors";
+	default:
+		return "?";
+	}
+}
+
+// The Vulkan objects for drawing the triangle without Granite's descriptor management.
+// The pipeline is created against the compatible VkRenderPass which Granite itself uses for the RenderPassInfo,
+// so it can be used inside cmd->begin_render_pass(). Building our own VkRenderPass would not be guaranteed to be compatible,
+// since compatibility also covers things like the subpass dependencies Granite adds.
+class RawPipeline
+{
+public:
+	explicit RawPipeline(Vulkan::Device &device_)
+		: device(device_), table(device_.get_device_table())
+	{
+	}
+
+	~RawPipeline()
+	{
+		VkDevice vk_device = device.get_device();
+		for (auto pool : pools)
+			table.vkDestroyDescriptorPool(vk_device, pool, nullptr);
+		if (update_template != VK_NULL_HANDLE)
+			table.vkDestroyDescriptorUpdateTemplate(vk_device, update_template, nullptr);
+		table.vkDestroyPipeline(vk_device, pipeline, nullptr);
+		table.vkDestroyPipelineLayout(vk_device, pipeline_layout, nullptr);
+		table.vkDestroyDescriptorSetLayout(vk_device, set_layout, nullptr);
+	}
+
+	bool init(const Vulkan::RenderPassInfo &rp, bool push_descriptors)
+	{
+		VkDevice vk_device = device.get_device();
+
+		VkDescriptorSetLayoutBinding bindings[2] = {};
+		bindings[0].binding = 0;
+		bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		bindings[0].descriptorCount = 1;
+		bindings[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+		bindings[1].binding = 1;
+		bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		bindings[1].descriptorCount = 1;
+		bindings[1].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+		VkDescriptorSetLayoutCreateInfo set_layout_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO };
+		set_layout_info.bindingCount = 2;
+		set_layout_info.pBindings = bindings;
+		if (push_descriptors)
+			set_layout_info.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR;
+		if (table.vkCreateDescriptorSetLayout(vk_device, &set_layout_info, nullptr, &set_layout) != VK_SUCCESS)
+			return false;
+
+		VkPipelineLayoutCreateInfo layout_info = { VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
+		layout_info.setLayoutCount = 1;
+		layout_info.pSetLayouts = &set_layout;
+		if (table.vkCreatePipelineLayout(vk_device, &layout_info, nullptr, &pipeline_layout) != VK_SUCCESS)
+			return false;
+
+		// One template per set layout. It reads the two VkDescriptorBufferInfos straight out of a DrawDescriptors struct.
+		if (!push_descriptors)
+		{
+			VkDescriptorUpdateTemplateEntry entries[2] = {};
+			for (unsigned i = 0; i < 2; i++)
+			{
+				entries[i].dstBinding = i;
+				entries[i].descriptorCount = 1;
+				entries[i].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+				entries[i].offset = i * sizeof(VkDescriptorBufferInfo);
+				entries[i].stride = sizeof(VkDescriptorBufferInfo);
+			}
+
+			VkDescriptorUpdateTemplateCreateInfo template_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_UPDATE_TEMPLATE_CREATE_INFO };
+			template_info.descriptorUpdateEntryCount = 2;
+			template_info.pDescriptorUpdateEntries = entries;
+			template_info.templateType = VK_DESCRIPTOR_UPDATE_TEMPLATE_TYPE_DESCRIPTOR_SET;
+			template_info.descriptorSetLayout = set_layout;
+			if (table.vkCreateDescriptorUpdateTemplate(vk_device, &template_info, nullptr, &update_template) != VK_SUCCESS)
+				return false;
+
+			VkDescriptorPoolSize pool_size = { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2 * NumDraws };
+			VkDescriptorPoolCreateInfo pool_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO };
+			pool_info.maxSets = NumDraws;
+			pool_info.poolSizeCount = 1;
+			pool_info.pPoolSizes = &pool_size;
+			for (auto &pool : pools)
+				if (table.vkCreateDescriptorPool(vk_device, &pool_info, nullptr, &pool) != VK_SUCCESS)
+					return false;
+		}
+
+		// The render pass belongs to Granite's render pass cache, so we don't destroy it.
+		render_pass = device.request_render_pass(rp, true).get_render_pass();
+
+		return create_pipeline();
+	}
+
+	// The per-draw descriptors, laid out the way the update template expects.
+	struct DrawDescriptors
+	{
+		VkDescriptorBufferInfo vertex_ubo;
+		VkDescriptorBufferInfo fragment_ubo;
+	};
+
+	void begin(Vulkan::CommandBuffer &cmd, const Vulkan::Buffer &vertex_buffer, unsigned frame)
+	{
+		vk_cmd = cmd.get_command_buffer();
+
+		// The GPU is done with this pool, see run_strategy().
+		pool = pools[frame % NumFramesInFlight];
+		if (pool != VK_NULL_HANDLE)
+			table.vkResetDescriptorPool(device.get_device(), pool, 0);
+
+		table.vkCmdBindPipeline(vk_cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+		VkViewport viewport = { 0.0f, 0.0f, float(RenderTargetSize), float(RenderTargetSize), 0.0f, 1.0f };
+		VkRect2D scissor = { { 0, 0 }, { RenderTargetSize, RenderTargetSize } };
+		table.vkCmdSetViewport(vk_cmd, 0, 1, &viewport);
+		table.vkCmdSetScissor(vk_cmd, 0, 1, &scissor);
+
+		VkBuffer buffers[2] = { vertex_buffer.get_buffer(), vertex_buffer.get_buffer() };
+		VkDeviceSize offsets[2] = { 0, sizeof(positions) };
+		table.vkCmdBindVertexBuffers(vk_cmd, 0, 2, buffers, offsets);
+	}
+
+	// Allocate, update with the template and bind.
+	void draw_with_template(const DrawDescriptors &descriptors)
+	{
+		VkDescriptorSetAllocateInfo alloc_info = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
+		alloc_info.descriptorPool = pool;
+		alloc_info.descriptorSetCount = 1;
+		alloc_info.pSetLayouts = &set_layout;
+		VkDescriptorSet set;
+		if (table.vkAllocateDescriptorSets(device.get_device(), &alloc_info, &set) != VK_SUCCESS)
+			return;
+
+		table.vkUpdateDescriptorSetWithTemplate(device.get_device(), set, update_template, &descriptors);
+		table.vkCmdBindDescriptorSets(vk_cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 0, 1, &set, 0, nullptr);
+		table.vkCmdDraw(vk_cmd, 3, 1, 0, 0);
+	}
+
+	// No set, no pool. The descriptors go straight into the command buffer.
+	void draw_with_push_descriptors(const DrawDescriptors &descriptors)
+	{
+		VkWriteDescriptorSet writes[2] = {};
+		for (unsigned i = 0; i < 2; i++)
+		{
+			writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			writes[i].dstBinding = i;
+			writes[i].descriptorCount = 1;
+			writes[i].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		}
+		writes[0].pBufferInfo = &descriptors.vertex_ubo;
+		writes[1].pBufferInfo = &descriptors.fragment_ubo;
+
+		table.vkCmdPushDescriptorSetKHR(vk_cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 0, 2, writes);
+		table.vkCmdDraw(vk_cmd, 3, 1, 0, 0);
+	}
+
+private:
+	Vulkan::Device &device;
+	const VolkDeviceTable &table;
+	VkDescriptorSetLayout set_layout = VK_NULL_HANDLE;
+	VkPipelineLayout pipeline_layout = VK_NULL_HANDLE;
+	VkDescriptorUpdateTemplate update_template = VK_NULL_HANDLE;
+	VkRenderPass render_pass = VK_NULL_HANDLE;
+	VkPipeline pipeline = VK_NULL_HANDLE;
+	VkDescriptorPool pools[NumFramesInFlight] = {};
+	VkDescriptorPool pool = VK_NULL_HANDLE;
+	VkCommandBuffer vk_cmd = VK_NULL_HANDLE;
+
+	bool create_pipeline()
+	{
+		VkDevice vk_device = device.get_device();
+
+		VkShaderModuleCreateInfo module_info = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
+		VkShaderModule vert, frag;
+		module_info.codeSize = sizeof(triangle_vert);
+		module_info.pCode = triangle_vert;
+		if (table.vkCreateShaderModule(vk_device, &module_info, nullptr, &vert) != VK_SUCCESS)
+			return false;
+		module_info.codeSize = sizeof(triangle_frag);
+		module_info.pCode = triangle_frag;
+		if (table.vkCreateShaderModule(vk_device, &module_info, nullptr, &frag) != VK_SUCCESS)
+		{
+			table.vkDestroyShaderModule(vk_device, vert, nullptr);
+			return false;
+		}
+
+		VkPipelineShaderStageCreateInfo stages[2] = {};
+		stages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+		stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+		stages[0].module = vert;
+		stages[0].pName = "main";
+		stages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+		stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+		stages[1].module = frag;
+		stages[1].pName = "main";
+
+		// Same vertex layout as the Granite path, see run_strategy().
+		VkVertexInputBindingDescription vertex_bindings[2] = {
+			{ 0, 2 * sizeof(float), VK_VERTEX_INPUT_RATE_VERTEX },
+			{ 1, 4 * sizeof(float), VK_VERTEX_INPUT_RATE_VERTEX },
+		};
+		VkVertexInputAttributeDescription attributes[2] = {
+			{ 0, 0, VK_FORMAT_R32G32_SFLOAT, 0 },
+			{ 1, 1, VK_FORMAT_R32G32B32A32_SFLOAT, 0 },
+		};
+		VkPipelineVertexInputStateCreateInfo vertex_input = { VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO };
+		vertex_input.vertexBindingDescriptionCount = 2;
+		vertex_input.pVertexBindingDescriptions = vertex_bindings;
+		vertex_input.vertexAttributeDescriptionCount = 2;
+		vertex_input.pVertexAttributeDescriptions = attributes;
+
+		VkPipelineInputAssemblyStateCreateInfo input_assembly = { VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO };
+		input_assembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+		VkPipelineViewportStateCreateInfo viewport = { VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO };
+		viewport.viewportCount = 1;
+		viewport.scissorCount = 1;
+
+		VkPipelineRasterizationStateCreateInfo raster = { VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO };
+		raster.polygonMode = VK_POLYGON_MODE_FILL;
+		raster.cullMode = VK_CULL_MODE_NONE;
+		raster.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+		raster.lineWidth = 1.0f;
+
+		VkPipelineMultisampleStateCreateInfo multisample = { VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO };
+		multisample.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+		VkPipelineColorBlendAttachmentState blend_attachment = {};
+		blend_attachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
+		                                  VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+		VkPipelineColorBlendStateCreateInfo blend = { VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO };
+		blend.attachmentCount = 1;
+		blend.pAttachments = &blend_attachment;
+
+		VkDynamicState dynamic_states[2] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+		VkPipelineDynamicStateCreateInfo dynamic = { VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO };
+		dynamic.dynamicStateCount = 2;
+		dynamic.pDynamicStates = dynamic_states;
+
+		VkGraphicsPipelineCreateInfo info = { VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO };
+		info.stageCount = 2;
+		info.pStages = stages;
+		info.pVertexInputState = &vertex_input;
+		info.pInputAssemblyState = &input_assembly;
+		info.pViewportState = &viewport;
+		info.pRasterizationState = &raster;
+		info.pMultisampleState = &multisample;
+		info.pColorBlendState = &blend;
+		info.pDynamicState = &dynamic;
+		info.layout = pipeline_layout;
+		info.renderPass = render_pass;
+		info.subpass = 0;
+
+		VkResult result = table.vkCreateGraphicsPipelines(vk_device, VK_NULL_HANDLE, 1, &info, nullptr, &pipeline);
+		table.vkDestroyShaderModule(vk_device, vert, nullptr);
+		table.vkDestroyShaderModule(vk_device, frag, nullptr);
+		return result == VK_SUCCESS;
+	}
+};
+
+static void get_draw_uniforms(unsigned draw, unsigned num_draws, VertexUBO &vert, FragmentUBO &frag)
+{
+	float f = float(draw) / float(num_draws);
+	vert.offset[0] = f - 0.5f;
+	vert.offset[1] = 0.5f - f;
+	vert.scale[0] = 0.1f;
+	vert.scale[1] = 0.1f;
+	frag.color_mod[0] = f;
+	frag.color_mod[1] = 1.0f - f;
+	frag.color_mod[2] = 0.5f;
+	frag.color_mod[3] = 1.0f;
+}
+
+static Vulkan::BufferHandle create_ubo(Vulkan::Device &device, unsigned draw, unsigned num_draws)
+{
+	uint8_t data[UBOBufferSize] = {};
+	VertexUBO vert;
+	FragmentUBO frag;
+	get_draw_uniforms(draw, num_draws, vert, frag);
+	memcpy(data, &vert, sizeof(vert));
+	memcpy(data + FragmentUBOOffset, &frag, sizeof(frag));
+
+	Vulkan::BufferCreateInfo info;
+	info.size = UBOBufferSize;
+	info.domain = Vulkan::BufferDomain::Host;
+	info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+	return device.create_buffer(info, data);
+}
+
+static Vulkan::RenderPassInfo get_render_pass_info(Vulkan::Device &device)
+{
+	Vulkan::RenderPassInfo rp;
+	rp.num_color_attachments = 1;
+	rp.color_attachments[0] = &device.get_transient_attachment(RenderTargetSize, RenderTargetSize, RenderTargetFormat);
+	rp.clear_attachments = 1 << 0;
+	return rp;
+}
+
+static double run_strategy(Vulkan::Device &device, Vulkan::Program *prog, RawPipeline *raw,
+                           const Vulkan::Buffer &vertex_buffer, Strategy strategy, unsigned num_draws)
+{
+	std::vector<Vulkan::BufferHandle> buffers;
+	Vulkan::Fence fences[NumFramesInFlight];
+	double total_ns = 0.0;
+
+	bool fresh_buffers = strategy == Strategy::FreshBuffers ||
+	                     strategy == Strategy::UpdateTemplate ||
+	                     strategy == Strategy::PushDescriptors;
+
+	if (strategy == Strategy::PersistentBuffers)
+		for (unsigned draw = 0; draw < num_draws; draw++)
+			buffers.push_back(create_ubo(device, draw, num_draws));
+
+	for (unsigned frame = 0; frame < NumFrames; frame++)
+	{
+		// Buffer creation is not what we're measuring here, so do that up front.
+		if (fresh_buffers)
+		{
+			buffers.clear();
+			for (unsigned draw = 0; draw < num_draws; draw++)
+				buffers.push_back(create_ubo(device, draw, num_draws));
+		}
+
+		// The raw paths reuse a descriptor pool every NumFramesInFlight frames.
+		auto &fence = fences[frame % NumFramesInFlight];
+		if (fence)
+		{
+			fence->wait();
+			fence.reset();
+		}
+
+		VulkanCallCounters before = call_counters;
+
+		auto cmd = device.request_command_buffer();
+
+		cmd->begin_render_pass(get_render_pass_info(device));
+
+		if (raw)
+			raw->begin(*cmd, vertex_buffer, frame);
+		else
+		{
+			cmd->set_program(prog);
+			cmd->set_opaque_state();
+
+			// See sample 07.
+			memcpy(cmd->allocate_vertex_data(0, sizeof(positions), 2 * sizeof(float)), positions, sizeof(positions));
+			memcpy(cmd->allocate_vertex_data(1, sizeof(colors), 4 * sizeof(float)), colors, sizeof(colors));
+			cmd->set_vertex_attrib(0, 0, VK_FORMAT_R32G32_SFLOAT, 0);
+			cmd->set_vertex_attrib(1, 1, VK_FORMAT_R32G32B32A32_SFLOAT, 0);
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		for (unsigned draw = 0; draw < num_draws; draw++)
+		{
+			if (strategy == Strategy::LinearAllocator)
+			{
+				auto *vert = cmd->allocate_typed_constant_data<VertexUBO>(0, 0, 1);
+				auto *frag = cmd->allocate_typed_constant_data<FragmentUBO>(0, 1, 1);
+				get_draw_uniforms(draw, num_draws, *vert, *frag);
+				cmd->draw(3);
+			}
+			else if (raw)
+			{
+				VkBuffer buffer = buffers[draw]->get_buffer();
+				RawPipeline::DrawDescriptors descriptors = {
+					{ buffer, 0, sizeof(VertexUBO) },
+					{ buffer, FragmentUBOOffset, sizeof(FragmentUBO) },
+				};
+
+				if (strategy == Strategy::UpdateTemplate)
+					raw->draw_with_template(descriptors);
+				else
+					raw->draw_with_push_descriptors(descriptors);
+			}
+			else
+			{
+				auto &buffer = *buffers[draw];
+				cmd->set_uniform_buffer(0, 0, buffer, 0, sizeof(VertexUBO));
+				cmd->set_uniform_buffer(0, 1, buffer, FragmentUBOOffset, sizeof(FragmentUBO));
+				cmd->draw(3);
+			}
+		}
+		auto end = std::chrono::steady_clock::now();
+
+		cmd->end_render_pass();
+		device.submit(cmd, &fence);
+		device.next_frame_context();
+
+		// The first frame is where the persistent sets are created, so don't count it.
+		if (frame != 0)
+			total_ns += std::chrono::duration<double, std::nano>(end - start).count();
+
+		if (frame == 0 || frame + 1 == NumFrames)
+			log_call_counters(strategy_to_string(strategy), frame, before);
+
+		// Every strategy binds or pushes descriptors at least once per frame.
+		// If nothing was counted, the counters are not hooked into the dispatch of this Granite revision.
+		if (frame == 0 &&
+		    call_counters.bind_descriptor_sets == before.bind_descriptor_sets &&
+		    call_counters.push_descriptor_set == before.push_descriptor_set)
+		{
+			LOGE("No descriptor calls were counted in the first frame, the counters above are not valid.\n");
+		}
+	}
+
+	device.wait_idle();
+	return total_ns / (double(num_draws) * (NumFrames - 1));
+}
+
+int main()
+{
+	// See sample 01.
+	if (!Vulkan::Context::init_loader(nullptr))
+	{
+		LOGE("Failed to create loader!\n");
+		return 1;
+	}
+
+	// Push descriptors are an extension. If the device does not support it, we skip that path.
+	const char *push_descriptor_ext = VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME;
+	std::unique_ptr<Vulkan::Context> context(new Vulkan::Context);
+	bool has_push_descriptors = true;
+	if (!context->init_instance_and_device(nullptr, 0, &push_descriptor_ext, 1))
+	{
+		has_push_descriptors = false;
+		context.reset(new Vulkan::Context);
+		if (!context->init_instance_and_device(nullptr, 0, nullptr, 0))
+		{
+			LOGE("Failed to create VkInstance and VkDevice.\n");
+			return 1;
+		}
+	}
+
+	// The Context owns the table, so it's fine to modify it through the const reference.
+	install_call_counters(const_cast<VolkDeviceTable &>(context->get_device_table()));
+
+	Vulkan::Device device;
+	device.set_context(*context);
+	////
+
+	Vulkan::Program *prog = device.request_program(
+			device.request_shader(triangle_vert, sizeof(triangle_vert)),
+			device.request_shader(triangle_frag, sizeof(triangle_frag)));
+
+	// The raw paths use a plain vertex buffer with positions followed by colors.
+	Vulkan::BufferCreateInfo vertex_info;
+	vertex_info.size = sizeof(positions) + sizeof(colors);
+	vertex_info.domain = Vulkan::BufferDomain::Device;
+	vertex_info.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+	uint8_t vertex_data[sizeof(positions) + sizeof(colors)];
+	memcpy(vertex_data, positions, sizeof(positions));
+	memcpy(vertex_data + sizeof(positions), colors, sizeof(colors));
+	auto vertex_buffer = device.create_buffer(vertex_info, vertex_data);
+
+	for (auto strategy : { Strategy::FreshBuffers, Strategy::PersistentBuffers, Strategy::LinearAllocator })
+	{
+		double ns_per_draw = run_strategy(device, prog, nullptr, *vertex_buffer, strategy, NumDraws);
+		LOGI("%s: %.1f ns / draw.\n", strategy_to_string(strategy), ns_per_draw);
+	}
+
+	auto &table = device.get_device_table();
+	if (table.vkCreateDescriptorUpdateTemplate && table.vkUpdateDescriptorSetWithTemplate)
+	{
+		RawPipeline raw(device);
+		if (raw.init(get_render_pass_info(device), false))
+		{
+			double ns_per_draw = run_strategy(device, nullptr, &raw, *vertex_buffer, Strategy::UpdateTemplate, NumDraws);
+			LOGI("%s: %.1f ns / draw.\n", strategy_to_string(Strategy::UpdateTemplate), ns_per_draw);
+		}
+		else
+			LOGE("Failed to create objects for update templates.\n");
+	}
+	else
+		LOGI("Descriptor update templates are not supported, skipping.\n");
+
+	if (has_push_descriptors && table.vkCmdPushDescriptorSetKHR)
+	{
+		RawPipeline raw(device);
+		if (raw.init(get_render_pass_info(device), true))
+		{
+			double ns_per_draw = run_strategy(device, nullptr, &raw, *vertex_buffer, Strategy::PushDescriptors, NumDraws);
+			LOGI("%s: %.1f ns / draw.\n", strategy_to_string(Strategy::PushDescriptors), ns_per_draw);
+		}
+		else
+			LOGE("Failed to create objects for push descriptors.\n");
+	}
+	else
+		LOGI("VK_KHR_push_descriptor is not supported, skipping.\n");
+
+	// 100k draws, each with a fresh UBO allocation. Per-draw cost should stay the same as with 4096 draws,
+	// and the counters should show that descriptor sets are only allocated and updated when the linear allocator
+	// moves to a new block. Every other draw is just a vkCmdBindDescriptorSets with new dynamic offsets.
+	VulkanCallCounters before = call_counters;
+	double ns_per_draw = run_strategy(device, prog, nullptr, *vertex_buffer, Strategy::LinearAllocator, NumDrawsLinear);
+	LOGI("%s, %u draws: %.1f ns / draw, %.3f ms / frame.\n", strategy_to_string(Strategy::LinearAllocator),
+	     NumDrawsLinear, ns_per_draw, ns_per_draw * NumDrawsLinear * 1e-6);
+	LOGI("%s, %u draws x %u frames: %u vkUpdateDescriptorSets, %u vkCmdBindDescriptorSets in total.\n",
+	     strategy_to_string(Strategy::LinearAllocator), NumDrawsLinear, NumFrames,
+	     call_counters.update_descriptor_sets - before.update_descriptor_sets,
+	     call_counters.bind_descriptor_sets - before.bind_descriptor_sets);
+}
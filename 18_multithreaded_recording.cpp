@@ -0,0 +1,289 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "vulkan.hpp"
+#include "device.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <string.h>
+
+// The WSI samples call wsi.init(1), i.e. only one thread is allowed to record command buffers.
+// The backend is built with GRANITE_VULKAN_MT though, and recording in parallel is fully supported.
+// Here we split one large render pass across worker threads.
+// - Every recording thread has its own thread index. Command pools and linear allocators (sample 07)
+//   are per thread index, so requesting command buffers and allocating vertex and uniform data is lock-free.
+// - The main thread begins the render pass with VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS.
+// - Workers request secondary command buffers which inherit the render pass, and record their share of draws.
+// - The main thread then executes the secondary command buffers in order and ends the render pass.
+// As long as draw order matters, secondary command buffers must be stitched together in a deterministic order,
+// so each worker is assigned a contiguous range of draws up front.
+
+static const uint32_t triangle_vert[] =
+#include "shaders/triangle.vert.inc"
+;
+
+static const uint32_t triangle_frag[] =
+#include "shaders/triangle.frag.inc"
+;
+
+// See shaders/triangle.vert and shaders/triangle.frag.
+struct VertexUBO
+{
+	float offset[2];
+	float scale[2];
+};
+
+struct FragmentUBO
+{
+	float color_mod[4];
+};
+
+static const unsigned NumDraws = 100000;
+static const unsigned NumFrames = 8;
+static const unsigned MaxThreads = 16;
+
+// Creating threads is far from free, and doing it every frame would end up in the numbers we're trying to measure.
+// The workers are started once, and every frame just wakes up the ones it needs.
+class RecordingWorkers
+{
+public:
+	using Task = std::function<void (unsigned worker_index)>;
+
+	explicit RecordingWorkers(unsigned num_workers)
+	{
+		for (unsigned i = 0; i < num_workers; i++)
+			workers.emplace_back(&RecordingWorkers::worker_loop, this, i);
+	}
+
+	~RecordingWorkers()
+	{
+		{
+			std::lock_guard<std::mutex> holder{lock};
+			dead = true;
+		}
+		cond.notify_all();
+		for (auto &worker : workers)
+			worker.join();
+	}
+
+	// Runs task on workers [0, num_active), and blocks until all of them are done.
+	void run(unsigned num_active, const Task &task)
+	{
+		std::unique_lock<std::mutex> holder{lock};
+		current_task = &task;
+		active = num_active;
+		remaining = num_active;
+		generation++;
+		cond.notify_all();
+		idle_cond.wait(holder, [this]() { return remaining == 0; });
+		current_task = nullptr;
+	}
+
+private:
+	std::vector<std::thread> workers;
+	std::mutex lock;
+	std::condition_variable cond;
+	std::condition_variable idle_cond;
+	const Task *current_task = nullptr;
+	uint64_t generation = 0;
+	unsigned active = 0;
+	unsigned remaining = 0;
+	bool dead = false;
+
+	void worker_loop(unsigned index)
+	{
+		uint64_t seen_generation = 0;
+		for (;;)
+		{
+			const Task *task;
+			{
+				std::unique_lock<std::mutex> holder{lock};
+				cond.wait(holder, [&]() { return dead || (generation != seen_generation && index < active); });
+				if (dead)
+					return;
+				seen_generation = generation;
+				task = current_task;
+			}
+
+			(*task)(index);
+
+			bool done;
+			{
+				std::lock_guard<std::mutex> holder{lock};
+				done = --remaining == 0;
+			}
+			if (done)
+				idle_cond.notify_one();
+		}
+	}
+};
+
+static void record_draws(Vulkan::CommandBuffer &cmd, Vulkan::Program *prog, unsigned first_draw, unsigned num_draws)
+{
+	// A secondary command buffer starts out with no state, so everything must be set up again.
+	cmd.set_program(prog);
+	cmd.set_opaque_state();
+
+	// See sample 07. Every draw allocates its own vertex and uniform data.
+	for (unsigned i = 0; i < num_draws; i++)
+	{
+		float f = float(first_draw + i) / float(NumDraws);
+
+		auto *positions = static_cast<float *>(cmd.allocate_vertex_data(0, 3 * 2 * sizeof(float), 2 * sizeof(float)));
+		positions[0] = -0.5f;
+		positions[1] = -0.5f;
+		positions[2] = -0.5f;
+		positions[3] = +0.5f;
+		positions[4] = +0.5f;
+		positions[5] = -0.5f;
+
+		auto *colors = static_cast<float *>(cmd.allocate_vertex_data(1, 3 * 4 * sizeof(float), 4 * sizeof(float)));
+		for (unsigned v = 0; v < 3; v++)
+		{
+			colors[4 * v + 0] = f;
+			colors[4 * v + 1] = 1.0f - f;
+			colors[4 * v + 2] = float(v) / 2.0f;
+			colors[4 * v + 3] = 1.0f;
+		}
+
+		cmd.set_vertex_attrib(0, 0, VK_FORMAT_R32G32_SFLOAT, 0);
+		cmd.set_vertex_attrib(1, 1, VK_FORMAT_R32G32B32A32_SFLOAT, 0);
+
+		auto *vert = cmd.allocate_typed_constant_data<VertexUBO>(0, 0, 1);
+		vert->offset[0] = f - 0.5f;
+		vert->offset[1] = 0.5f - f;
+		vert->scale[0] = 0.05f;
+		vert->scale[1] = 0.05f;
+
+		auto *frag = cmd.allocate_typed_constant_data<FragmentUBO>(0, 1, 1);
+		frag->color_mod[0] = 1.0f;
+		frag->color_mod[1] = 1.0f;
+		frag->color_mod[2] = 1.0f;
+		frag->color_mod[3] = 1.0f;
+
+		cmd.draw(3);
+	}
+}
+
+static double run_frame(Vulkan::Device &device, Vulkan::Program *prog, RecordingWorkers &workers, unsigned num_threads)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	// Thread index 0 is the main thread.
+	auto cmd = device.request_command_buffer();
+
+	Vulkan::RenderPassInfo rp;
+	rp.num_color_attachments = 1;
+	rp.color_attachments[0] = &device.get_transient_attachment(256, 256, VK_FORMAT_R8G8B8A8_UNORM);
+	rp.clear_attachments = 1 << 0;
+	cmd->begin_render_pass(rp, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+
+	std::vector<Vulkan::CommandBufferHandle> secondaries(num_threads);
+
+	workers.run(num_threads, [&](unsigned i) {
+		unsigned first_draw = (NumDraws * i) / num_threads;
+		unsigned end_draw = (NumDraws * (i + 1)) / num_threads;
+
+		// Workers use thread indices [1, num_threads].
+		auto secondary = cmd->request_secondary_command_buffer(i + 1, 0 /*subpass*/);
+		record_draws(*secondary, prog, first_draw, end_draw - first_draw);
+		secondaries[i] = std::move(secondary);
+	});
+
+	// Ends the secondary command buffers and executes them in the primary command buffer.
+	for (auto &secondary : secondaries)
+		cmd->submit_secondary(std::move(secondary));
+
+	cmd->end_render_pass();
+	device.submit(cmd);
+
+	auto end = std::chrono::steady_clock::now();
+
+	// Linear allocator blocks and command pools for every thread index are recycled here.
+	device.next_frame_context();
+
+	return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+int main()
+{
+	// See sample 01.
+	if (!Vulkan::Context::init_loader(nullptr))
+	{
+		LOGE("Failed to create loader!\n");
+		return 1;
+	}
+
+	// We always go all the way up to MaxThreads. With fewer cores than that, the last few runs are oversubscribed,
+	// which is useful to see too, since it shows what happens when the recording threads compete for cores.
+	unsigned num_cores = std::max(1u, std::thread::hardware_concurrency());
+	unsigned max_threads = MaxThreads;
+	if (max_threads > num_cores)
+		LOGI("%u cores, runs with more than %u threads are oversubscribed.\n", num_cores, num_cores);
+
+	Vulkan::Context context;
+	// One thread index for the main thread, and one for each worker.
+	context.set_num_thread_indices(1 + max_threads);
+	if (!context.init_instance_and_device(nullptr, 0, nullptr, 0))
+	{
+		LOGE("Failed to create VkInstance and VkDevice.\n");
+		return 1;
+	}
+
+	Vulkan::Device device;
+	device.set_context(context);
+	////
+
+	Vulkan::Program *prog = device.request_program(
+			device.request_shader(triangle_vert, sizeof(triangle_vert)),
+			device.request_shader(triangle_frag, sizeof(triangle_frag)));
+
+	// The workers are started here, before anything is timed.
+	RecordingWorkers workers(max_threads);
+
+	// Make sure the pipeline exists before we start timing.
+	run_frame(device, prog, workers, 1);
+
+	double single_thread_ms = 0.0;
+	for (unsigned num_threads = 1; num_threads <= max_threads; num_threads *= 2)
+	{
+		double total_ms = 0.0;
+		for (unsigned frame = 0; frame < NumFrames; frame++)
+			total_ms += run_frame(device, prog, workers, num_threads);
+
+		double ms = total_ms / NumFrames;
+		if (num_threads == 1)
+			single_thread_ms = ms;
+
+		LOGI("%2u threads: %8.3f ms / frame for %u draws (%.2fx)%s.\n",
+		     num_threads, ms, NumDraws, single_thread_ms / ms,
+		     num_threads > num_cores ? ", oversubscribed" : "");
+	}
+
+	device.wait_idle();
+}
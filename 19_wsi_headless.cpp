@@ -0,0 +1,363 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "vulkan.hpp"
+#include "device.hpp"
+#include "wsi.hpp"
+#include "util.hpp"
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+// Samples 06 to 10 need SDL2 and a window system. Here we run the same WSI frame loop without either,
+// so begin_frame()/end_frame() pacing and the acquire/release semaphore logic can be exercised and benchmarked
+// on machines without a GPU or display, e.g. with a software Vulkan driver.
+
+// As mentioned in sample 06, Vulkan::WSI can be used with externally created images (WSI::init_external_swapchain).
+// We play the role of the presentation engine ourselves:
+// - The "swapchain" is a ring of offscreen images.
+// - Acquire: Before a frame starts, we tell WSI which image to render to with set_external_frame(),
+//   and which semaphore to wait for before rendering to it.
+// - Present: After end_frame(), we take the release semaphore, copy the image to a readback buffer,
+//   and signal a new semaphore which becomes the acquire semaphore the next time the image is used.
+
+// The platform does not have a surface, so most of this is trivial.
+struct HeadlessPlatform : Vulkan::WSIPlatform
+{
+	HeadlessPlatform(unsigned width_, unsigned height_)
+		: width(width_), height(height_)
+	{
+	}
+
+	VkSurfaceKHR create_surface(VkInstance, VkPhysicalDevice) override
+	{
+		return VK_NULL_HANDLE;
+	}
+
+	std::vector<const char *> get_instance_extensions() override
+	{
+		return {};
+	}
+
+	uint32_t get_surface_width() override
+	{
+		return width;
+	}
+
+	uint32_t get_surface_height() override
+	{
+		return height;
+	}
+
+	bool alive(Vulkan::WSI &) override
+	{
+		return true;
+	}
+
+	// There are no events to poll.
+	void poll_input() override
+	{
+	}
+
+	unsigned width;
+	unsigned height;
+};
+
+class HeadlessSwapchain
+{
+public:
+	HeadlessSwapchain(Vulkan::WSI &wsi_, unsigned width_, unsigned height_, unsigned num_images, const char *dump_dir_)
+		: wsi(wsi_), device(wsi_.get_device()), width(width_), height(height_), dump_dir(dump_dir_)
+	{
+		auto info = Vulkan::ImageCreateInfo::render_target(width, height, VK_FORMAT_R8G8B8A8_SRGB);
+		info.usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+
+		Vulkan::BufferCreateInfo readback_info;
+		readback_info.size = width * height * sizeof(uint32_t);
+		readback_info.domain = Vulkan::BufferDomain::CachedHost;
+		readback_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+
+		std::vector<Vulkan::ImageHandle> images;
+		for (unsigned i = 0; i < num_images; i++)
+		{
+			auto image = device.create_image(info);
+			images.push_back(image);
+
+			Slot slot;
+			slot.image = image;
+			slot.readback = device.create_buffer(readback_info);
+			slots.push_back(std::move(slot));
+		}
+
+		wsi.init_external_swapchain(std::move(images));
+	}
+
+	~HeadlessSwapchain()
+	{
+		for (auto &slot : slots)
+			complete(slot);
+	}
+
+	// Our equivalent of vkAcquireNextImageKHR. Call before wsi.begin_frame().
+	void acquire(double frame_time)
+	{
+		auto &slot = slots[index];
+
+		// Like a real swapchain with FIFO, we block if the image is still being presented.
+		// With three images, this means the CPU can run at most two frames ahead.
+		auto start = std::chrono::steady_clock::now();
+		complete(slot);
+		auto end = std::chrono::steady_clock::now();
+		stall_ms += std::chrono::duration<double, std::milli>(end - start).count();
+
+		// The first time an image is used, there is nothing to wait for.
+		wsi.set_external_frame(index, std::move(slot.acquire), frame_time);
+		slot.acquire.reset();
+	}
+
+	// Our equivalent of vkQueuePresentKHR. Call after wsi.end_frame().
+	void present()
+	{
+		auto &slot = slots[index];
+
+		// If the swapchain image was not rendered to this frame, there is no release semaphore.
+		auto release = wsi.consume_external_release_semaphore();
+		if (release)
+		{
+			device.add_wait_semaphore(Vulkan::CommandBuffer::Type::Generic, release, VK_PIPELINE_STAGE_TRANSFER_BIT, true);
+
+			// The source stage must be part of the semaphore wait's stage mask, or the layout transition
+			// does not chain with the wait, and can happen before rendering to the image has finished.
+			auto cmd = device.request_command_buffer();
+			cmd->image_barrier(*slot.image, slot.image->get_swapchain_layout(), VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+			                   VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+			                   VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+			cmd->copy_image_to_buffer(*slot.readback, *slot.image, 0, {}, { width, height, 1 }, 0, 0,
+			                          { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 });
+			cmd->image_barrier(*slot.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, slot.image->get_swapchain_layout(),
+			                   VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+			                   VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0);
+			cmd->barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+			             VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+
+			// The fence tells us when the readback buffer is ready,
+			// the semaphore orders the next rendering to this image after the copy.
+			device.submit(cmd, &slot.fence, 1, &slot.acquire);
+			slot.frame_index = presented_frames;
+			slot.pending = true;
+		}
+
+		presented_frames++;
+		index = (index + 1) % unsigned(slots.size());
+	}
+
+	double get_stall_ms() const
+	{
+		return stall_ms;
+	}
+
+private:
+	struct Slot
+	{
+		Vulkan::ImageHandle image;
+		Vulkan::BufferHandle readback;
+		Vulkan::Fence fence;
+		Vulkan::Semaphore acquire;
+		unsigned frame_index = 0;
+		bool pending = false;
+	};
+
+	Vulkan::WSI &wsi;
+	Vulkan::Device &device;
+	unsigned width;
+	unsigned height;
+	const char *dump_dir;
+	std::vector<Slot> slots;
+	unsigned index = 0;
+	unsigned presented_frames = 0;
+	double stall_ms = 0.0;
+
+	void complete(Slot &slot)
+	{
+		if (!slot.pending)
+			return;
+
+		slot.fence->wait();
+		slot.fence.reset();
+		slot.pending = false;
+
+		if (dump_dir)
+			dump(slot);
+	}
+
+	// Raw RGBA8 dumps. They can be viewed with e.g. ImageMagick:
+	// convert -size WxH -depth 8 rgba:frame_0000.raw frame_0000.png
+	void dump(Slot &slot)
+	{
+		char path[64];
+		snprintf(path, sizeof(path), "/frame_%04u.raw", slot.frame_index);
+		std::string full_path = std::string(dump_dir) + path;
+
+		FILE *file = fopen(full_path.c_str(), "wb");
+		if (!file)
+		{
+			LOGE("Failed to open %s for writing.\n", full_path.c_str());
+			return;
+		}
+
+		const void *ptr = device.map_host_buffer(*slot.readback, Vulkan::MEMORY_ACCESS_READ_BIT);
+		if (fwrite(ptr, sizeof(uint32_t), width * height, file) != width * height)
+			LOGE("Failed to write %s.\n", full_path.c_str());
+		device.unmap_host_buffer(*slot.readback, Vulkan::MEMORY_ACCESS_READ_BIT);
+		fclose(file);
+	}
+};
+
+static const uint32_t triangle_vert[] =
+#include "shaders/triangle.vert.inc"
+;
+
+static const uint32_t triangle_frag[] =
+#include "shaders/triangle.frag.inc"
+;
+
+static const unsigned Width = 640;
+static const unsigned Height = 360;
+static const unsigned NumSwapchainImages = 3;
+
+int main(int argc, char **argv)
+{
+	// Usage: 19-wsi-headless [num frames] [dump directory]
+	unsigned num_frames = argc > 1 ? unsigned(strtoul(argv[1], nullptr, 0)) : 1000;
+	const char *dump_dir = argc > 2 ? argv[2] : nullptr;
+
+	// See sample 01.
+	if (!Vulkan::Context::init_loader(nullptr))
+	{
+		LOGE("Failed to create loader!\n");
+		return 1;
+	}
+
+	// Since there is no surface, we create the context ourselves and hand it over to WSI.
+	std::unique_ptr<Vulkan::Context> context(new Vulkan::Context);
+	if (!context->init_instance_and_device(nullptr, 0, nullptr, 0))
+	{
+		LOGE("Failed to create VkInstance and VkDevice.\n");
+		return 1;
+	}
+
+	HeadlessPlatform platform(Width, Height);
+	Vulkan::WSI wsi;
+	wsi.set_platform(&platform);
+	if (!wsi.init_external_context(std::move(context)))
+	{
+		LOGE("Failed to initialize WSI.\n");
+		return 1;
+	}
+
+	Vulkan::Device &device = wsi.get_device();
+	HeadlessSwapchain swapchain(wsi, Width, Height, NumSwapchainImages, dump_dir);
+
+	Vulkan::Program *prog = device.request_program(
+			device.request_shader(triangle_vert, sizeof(triangle_vert)),
+			device.request_shader(triangle_frag, sizeof(triangle_frag)));
+
+	double begin_frame_ms = 0.0;
+	double end_frame_ms = 0.0;
+	auto start_time = std::chrono::steady_clock::now();
+
+	for (unsigned frame = 0; frame < num_frames; frame++)
+	{
+		double frame_time = frame / 60.0;
+		swapchain.acquire(frame_time);
+
+		auto t0 = std::chrono::steady_clock::now();
+		wsi.begin_frame();
+		auto t1 = std::chrono::steady_clock::now();
+
+		{
+			// Pretty much sample 07.
+			auto cmd = device.request_command_buffer();
+			Vulkan::RenderPassInfo rp = device.get_swapchain_render_pass(Vulkan::SwapchainRenderPass::ColorOnly);
+			rp.clear_color[0].float32[0] = 0.1f;
+			rp.clear_color[0].float32[1] = 0.2f;
+			rp.clear_color[0].float32[2] = 0.3f;
+			cmd->begin_render_pass(rp);
+
+			static const float positions[3 * 2] = {
+				-0.5f, -0.5f,
+				-0.5f, +0.5f,
+				+0.5f, -0.5f,
+			};
+			static const float colors[3 * 4] = {
+				1.0f, 0.0f, 0.0f, 1.0f,
+				0.0f, 1.0f, 0.0f, 1.0f,
+				0.0f, 0.0f, 1.0f, 1.0f,
+			};
+			memcpy(cmd->allocate_vertex_data(0, sizeof(positions), 2 * sizeof(float)), positions, sizeof(positions));
+			memcpy(cmd->allocate_vertex_data(1, sizeof(colors), 4 * sizeof(float)), colors, sizeof(colors));
+			cmd->set_vertex_attrib(0, 0, VK_FORMAT_R32G32_SFLOAT, 0);
+			cmd->set_vertex_attrib(1, 1, VK_FORMAT_R32G32B32A32_SFLOAT, 0);
+
+			float *vert_ubo = static_cast<float *>(cmd->allocate_constant_data(0, 0, 4 * sizeof(float)));
+			vert_ubo[0] = 0.5f * float(frame % 120) / 120.0f;
+			vert_ubo[1] = 0.0f;
+			vert_ubo[2] = 1.0f;
+			vert_ubo[3] = 1.0f;
+
+			float *frag_ubo = static_cast<float *>(cmd->allocate_constant_data(0, 1, 4 * sizeof(float)));
+			for (unsigned i = 0; i < 4; i++)
+				frag_ubo[i] = 1.0f;
+
+			cmd->set_program(prog);
+			cmd->set_opaque_state();
+			cmd->draw(3);
+			cmd->end_render_pass();
+			device.submit(cmd);
+		}
+
+		auto t2 = std::chrono::steady_clock::now();
+		wsi.end_frame();
+		auto t3 = std::chrono::steady_clock::now();
+
+		swapchain.present();
+
+		begin_frame_ms += std::chrono::duration<double, std::milli>(t1 - t0).count();
+		end_frame_ms += std::chrono::duration<double, std::milli>(t3 - t2).count();
+	}
+
+	device.wait_idle();
+	auto end_time = std::chrono::steady_clock::now();
+
+	if (num_frames != 0)
+	{
+		double total_ms = std::chrono::duration<double, std::milli>(end_time - start_time).count();
+		LOGI("%u frames in %.3f ms (%.3f ms / frame).\n", num_frames, total_ms, total_ms / num_frames);
+		LOGI("  begin_frame: %.3f ms / frame.\n", begin_frame_ms / num_frames);
+		LOGI("  end_frame: %.3f ms / frame.\n", end_frame_ms / num_frames);
+		LOGI("  Waiting for swapchain images: %.3f ms / frame.\n", swapchain.get_stall_ms() / num_frames);
+	}
+}
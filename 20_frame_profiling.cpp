@@ -0,0 +1,481 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "vulkan.hpp"
+#include "device.hpp"
+#include "util.hpp"
+#include <vector>
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+// Sample 03 introduced frame contexts, which is where CPU and GPU overlap.
+// When diagnosing latency, the first questions are usually:
+// - How long did we block at the start of the frame, waiting for the frame context's fences (and with WSI, for acquire)?
+// - How long did we spend recording and submitting?
+// - How long did the GPU spend executing our command buffers?
+// Here we build a small profiler which answers these questions per frame.
+// CPU phases are measured with scoped timers.
+// GPU time is measured with timestamp queries which are written at the start and end of every command buffer
+// we submit. To make sure nothing slips through untimed, command buffers are requested and submitted through the profiler,
+// and each one is identified by its frame index and submission number within the frame.
+// Timings can be queried per frame, and the whole capture can be dumped as a Chrome trace,
+// which can be loaded in chrome://tracing or https://ui.perfetto.dev.
+
+enum class CPUPhase
+{
+	BeginFrame,
+	Record,
+	Submit,
+	Count
+};
+
+static const char *cpu_phase_to_string(CPUPhase phase)
+{
+	switch (phase)
+	{
+	case CPUPhase::BeginFrame:
+		return "Begin frame";
+	case CPUPhase::Record:
+		return "Record";
+	case CPUPhase::Submit:
+		return "Submit";
+	default:
+		return "?";
+	}
+}
+
+struct FrameTimings
+{
+	unsigned frame_index = 0;
+
+	// All times are in microseconds, relative to when the profiler was created.
+	double cpu_begin_us = 0.0;
+	double cpu_end_us = 0.0;
+	double cpu_phase_us[unsigned(CPUPhase::Count)] = {};
+
+	// Accumulated over every command buffer in the frame.
+	double gpu_us = 0.0;
+	unsigned num_command_buffers = 0;
+	unsigned num_resolved_command_buffers = 0;
+
+	bool gpu_resolved() const
+	{
+		return num_resolved_command_buffers == num_command_buffers;
+	}
+};
+
+class FrameProfiler
+{
+public:
+	explicit FrameProfiler(Vulkan::Device &device_)
+		: device(device_), epoch(std::chrono::steady_clock::now())
+	{
+		// Number of nanoseconds per timestamp tick.
+		timestamp_period = device.get_gpu_properties().limits.timestampPeriod;
+	}
+
+	class ScopedPhase
+	{
+	public:
+		ScopedPhase(FrameProfiler &profiler_, CPUPhase phase_)
+			: profiler(profiler_), phase(phase_), start_us(profiler_.now_us())
+		{
+		}
+
+		~ScopedPhase()
+		{
+			double end_us = profiler.now_us();
+			profiler.add_cpu_event(phase, start_us, end_us);
+		}
+
+	private:
+		FrameProfiler &profiler;
+		CPUPhase phase;
+		double start_us;
+	};
+
+	void begin_frame()
+	{
+		FrameTimings timings;
+		timings.frame_index = unsigned(frames.size());
+		timings.cpu_begin_us = now_us();
+		frames.push_back(timings);
+	}
+
+	// Identifies a command buffer for as long as it is being profiled.
+	// Unlike the CommandBuffer pointer, this stays unique after the command buffer has been recycled.
+	struct SubmissionKey
+	{
+		unsigned frame_index;
+		unsigned submission_index;
+	};
+
+	struct ProfiledCommandBuffer
+	{
+		Vulkan::CommandBufferHandle cmd;
+		SubmissionKey key;
+
+		Vulkan::CommandBuffer *operator->()
+		{
+			return cmd.get();
+		}
+
+		Vulkan::CommandBuffer &operator*()
+		{
+			return *cmd;
+		}
+	};
+
+	void end_frame()
+	{
+		frames.back().cpu_end_us = now_us();
+
+		// Results of timestamp queries become visible once the frame context they were submitted in
+		// has been waited for in next_frame_context(), so they trickle in a frame or two late.
+		resolve_queries();
+	}
+
+	// Same as Device::request_command_buffer(), but the command buffer starts with a timestamp.
+	ProfiledCommandBuffer request_command_buffer(Vulkan::CommandBuffer::Type type = Vulkan::CommandBuffer::Type::Generic)
+	{
+		auto &frame = frames.back();
+
+		ProfiledCommandBuffer profiled;
+		profiled.cmd = device.request_command_buffer(type);
+		profiled.key = { frame.frame_index, frame.num_command_buffers++ };
+
+		PendingQuery query;
+		query.key = profiled.key;
+		query.start = profiled->write_timestamp(VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT);
+		pending.push_back(std::move(query));
+		return profiled;
+	}
+
+	// Same as Device::submit(), but the command buffer ends with a timestamp.
+	void submit(ProfiledCommandBuffer &profiled)
+	{
+		ScopedPhase phase(*this, CPUPhase::Submit);
+
+		auto *query = find_pending(profiled.key);
+		if (query)
+		{
+			query->end = profiled->write_timestamp(VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+			query->submit_us = now_us();
+		}
+		else
+			LOGE("Command buffer %u in frame %u was already submitted.\n",
+			     profiled.key.submission_index, profiled.key.frame_index);
+
+		device.submit(profiled.cmd);
+	}
+
+	const FrameTimings *get_frame(unsigned frame_index) const
+	{
+		return frame_index < frames.size() ? &frames[frame_index] : nullptr;
+	}
+
+	unsigned get_num_frames() const
+	{
+		return unsigned(frames.size());
+	}
+
+	// Call after Device::wait_idle() to make sure every query has been resolved.
+	void flush()
+	{
+		resolve_queries();
+	}
+
+	bool dump_chrome_trace(const char *path) const
+	{
+		FILE *file = fopen(path, "w");
+		if (!file)
+			return false;
+
+		fprintf(file, "{\"traceEvents\":[\n");
+		bool first = true;
+
+		auto write_event = [&](const char *name, unsigned tid, double start_us, double duration_us, unsigned frame_index) {
+			fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%u}}",
+			        first ? "" : ",\n", name, tid, start_us, duration_us, frame_index);
+			first = false;
+		};
+
+		char gpu_name[64];
+
+		for (auto &frame : frames)
+			write_event("Frame", 0, frame.cpu_begin_us, frame.cpu_end_us - frame.cpu_begin_us, frame.frame_index);
+		for (auto &event : cpu_events)
+			write_event(cpu_phase_to_string(event.phase), 0, event.start_us, event.end_us - event.start_us, event.frame_index);
+		for (auto &event : gpu_events)
+		{
+			snprintf(gpu_name, sizeof(gpu_name), "GPU submission %u", event.key.submission_index);
+			write_event(gpu_name, 1, event.start_us, event.end_us - event.start_us, event.key.frame_index);
+		}
+
+		fprintf(file, "\n],\n\"displayTimeUnit\":\"ms\"}\n");
+		fclose(file);
+		return true;
+	}
+
+private:
+	Vulkan::Device &device;
+	std::chrono::steady_clock::time_point epoch;
+	double timestamp_period;
+
+	struct PendingQuery
+	{
+		SubmissionKey key;
+		Vulkan::QueryPoolHandle start;
+		Vulkan::QueryPoolHandle end;
+		double submit_us = 0.0;
+	};
+
+	struct CPUEvent
+	{
+		CPUPhase phase;
+		unsigned frame_index;
+		double start_us;
+		double end_us;
+	};
+
+	struct GPUEvent
+	{
+		SubmissionKey key;
+		double start_us;
+		double end_us;
+	};
+
+	std::vector<FrameTimings> frames;
+	std::vector<PendingQuery> pending;
+	std::vector<CPUEvent> cpu_events;
+	std::vector<GPUEvent> gpu_events;
+
+	// The GPU clock is not calibrated against the CPU clock (VK_EXT_calibrated_timestamps would let us do that).
+	// Instead, we anchor the first GPU timestamp to the time it was submitted on the CPU,
+	// and place later GPU events relative to that. This gets the GPU timeline right relative to itself,
+	// and roughly right relative to the CPU timeline, which is good enough to spot bubbles.
+	uint64_t anchor_ticks = 0;
+	double anchor_us = 0.0;
+	bool has_anchor = false;
+
+	double now_us() const
+	{
+		return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - epoch).count();
+	}
+
+	void add_cpu_event(CPUPhase phase, double start_us, double end_us)
+	{
+		auto &frame = frames.back();
+		frame.cpu_phase_us[unsigned(phase)] += end_us - start_us;
+		cpu_events.push_back({ phase, frame.frame_index, start_us, end_us });
+	}
+
+	// Only command buffers which have been requested, but not submitted yet.
+	PendingQuery *find_pending(const SubmissionKey &key)
+	{
+		for (auto &query : pending)
+			if (!query.end && query.key.frame_index == key.frame_index && query.key.submission_index == key.submission_index)
+				return &query;
+		return nullptr;
+	}
+
+	double ticks_to_us(uint64_t ticks) const
+	{
+		return double(ticks) * timestamp_period * 1e-3;
+	}
+
+	void resolve_queries()
+	{
+		auto itr = pending.begin();
+		while (itr != pending.end())
+		{
+			if (!itr->end || !itr->start->is_signalled() || !itr->end->is_signalled())
+			{
+				++itr;
+				continue;
+			}
+
+			uint64_t start_ticks = itr->start->get_timestamp();
+			uint64_t end_ticks = itr->end->get_timestamp();
+
+			if (!has_anchor)
+			{
+				anchor_ticks = start_ticks;
+				anchor_us = itr->submit_us;
+				has_anchor = true;
+			}
+
+			double start_us = anchor_us + (double(int64_t(start_ticks - anchor_ticks)) * timestamp_period * 1e-3);
+			double duration_us = ticks_to_us(end_ticks - start_ticks);
+
+			auto &frame = frames[itr->key.frame_index];
+			frame.gpu_us += duration_us;
+			frame.num_resolved_command_buffers++;
+			gpu_events.push_back({ itr->key, start_us, start_us + duration_us });
+
+			itr = pending.erase(itr);
+		}
+	}
+};
+
+static const uint32_t triangle_vert[] =
+#include "shaders/triangle.vert.inc"
+;
+
+static const uint32_t triangle_frag[] =
+#include "shaders/triangle.frag.inc"
+;
+
+static void record_frame(Vulkan::Device &device, Vulkan::CommandBuffer &cmd, Vulkan::Program *prog, unsigned num_draws)
+{
+	Vulkan::RenderPassInfo rp;
+	rp.num_color_attachments = 1;
+	rp.color_attachments[0] = &device.get_transient_attachment(1024, 1024, VK_FORMAT_R8G8B8A8_UNORM);
+	rp.clear_attachments = 1 << 0;
+	cmd.begin_render_pass(rp);
+
+	cmd.set_program(prog);
+	cmd.set_opaque_state();
+
+	// See sample 07.
+	static const float positions[3 * 2] = {
+		-1.0f, -1.0f,
+		-1.0f, +3.0f,
+		+3.0f, -1.0f,
+	};
+	static const float colors[3 * 4] = {
+		1.0f, 0.0f, 0.0f, 1.0f,
+		0.0f, 1.0f, 0.0f, 1.0f,
+		0.0f, 0.0f, 1.0f, 1.0f,
+	};
+	memcpy(cmd.allocate_vertex_data(0, sizeof(positions), 2 * sizeof(float)), positions, sizeof(positions));
+	memcpy(cmd.allocate_vertex_data(1, sizeof(colors), 4 * sizeof(float)), colors, sizeof(colors));
+	cmd.set_vertex_attrib(0, 0, VK_FORMAT_R32G32_SFLOAT, 0);
+	cmd.set_vertex_attrib(1, 1, VK_FORMAT_R32G32B32A32_SFLOAT, 0);
+
+	// Full-screen triangles with blending, so the GPU time scales with the number of draws.
+	cmd.set_blend_enable(true);
+	cmd.set_blend_factors(VK_BLEND_FACTOR_ONE, VK_BLEND_FACTOR_ONE, VK_BLEND_FACTOR_ONE, VK_BLEND_FACTOR_ONE);
+	cmd.set_blend_op(VK_BLEND_OP_ADD);
+
+	for (unsigned i = 0; i < num_draws; i++)
+	{
+		float *vert_ubo = static_cast<float *>(cmd.allocate_constant_data(0, 0, 4 * sizeof(float)));
+		vert_ubo[0] = 0.0f;
+		vert_ubo[1] = 0.0f;
+		vert_ubo[2] = 1.0f;
+		vert_ubo[3] = 1.0f;
+
+		float *frag_ubo = static_cast<float *>(cmd.allocate_constant_data(0, 1, 4 * sizeof(float)));
+		for (unsigned c = 0; c < 4; c++)
+			frag_ubo[c] = 1.0f / float(num_draws);
+
+		cmd.draw(3);
+	}
+
+	cmd.end_render_pass();
+}
+
+static const unsigned NumFrames = 300;
+
+int main(int argc, char **argv)
+{
+	const char *trace_path = argc > 1 ? argv[1] : "20_frame_profiling.json";
+
+	// See sample 01.
+	if (!Vulkan::Context::init_loader(nullptr))
+	{
+		LOGE("Failed to create loader!\n");
+		return 1;
+	}
+
+	Vulkan::Context context;
+	if (!context.init_instance_and_device(nullptr, 0, nullptr, 0))
+	{
+		LOGE("Failed to create VkInstance and VkDevice.\n");
+		return 1;
+	}
+
+	Vulkan::Device device;
+	device.set_context(context);
+	////
+
+	Vulkan::Program *prog = device.request_program(
+			device.request_shader(triangle_vert, sizeof(triangle_vert)),
+			device.request_shader(triangle_frag, sizeof(triangle_frag)));
+
+	FrameProfiler profiler(device);
+
+	for (unsigned frame = 0; frame < NumFrames; frame++)
+	{
+		profiler.begin_frame();
+
+		// This is where we block if the GPU is falling behind.
+		// With a swapchain, this would be wsi.begin_frame(), which calls next_frame_context() and then
+		// acquires the next image, so the time spent waiting for the presentation engine ends up here as well.
+		{
+			FrameProfiler::ScopedPhase phase(profiler, CPUPhase::BeginFrame);
+			device.next_frame_context();
+		}
+
+		// Vary the load a bit so there's something to look at in the trace.
+		unsigned num_draws = 200 + unsigned(150.0 * sin(0.05 * frame));
+
+		// Split the frame in two command buffers, just to show that every command buffer gets its own GPU event.
+		for (unsigned i = 0; i < 2; i++)
+		{
+			auto cmd = profiler.request_command_buffer();
+			{
+				FrameProfiler::ScopedPhase phase(profiler, CPUPhase::Record);
+				record_frame(device, *cmd, prog, num_draws);
+			}
+			profiler.submit(cmd);
+		}
+
+		profiler.end_frame();
+
+		// The GPU results for a frame are available a couple of frames later.
+		if (frame >= 2 && (frame % 50) == 0)
+		{
+			auto *timings = profiler.get_frame(frame - 2);
+			if (timings && timings->gpu_resolved())
+			{
+				LOGI("Frame %u: begin frame %.3f ms, record %.3f ms, submit %.3f ms, GPU %.3f ms (%u command buffers).\n",
+				     timings->frame_index,
+				     timings->cpu_phase_us[unsigned(CPUPhase::BeginFrame)] * 1e-3,
+				     timings->cpu_phase_us[unsigned(CPUPhase::Record)] * 1e-3,
+				     timings->cpu_phase_us[unsigned(CPUPhase::Submit)] * 1e-3,
+				     timings->gpu_us * 1e-3, timings->num_command_buffers);
+			}
+		}
+	}
+
+	device.wait_idle();
+	profiler.flush();
+
+	if (profiler.dump_chrome_trace(trace_path))
+		LOGI("Wrote Chrome trace to %s.\n", trace_path);
+	else
+		LOGE("Failed to write Chrome trace to %s.\n", trace_path);
+}
@@ -0,0 +1,283 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "vulkan.hpp"
+#include "device.hpp"
+#include "util.hpp"
+#include <vector>
+#include <chrono>
+
+// Sample 03 explains that destroyed objects are held on to until their frame context comes around again.
+// That is fine for real-time rendering where frames are short, but consider a long offline render job which
+// allocates and frees gigabytes of scratch memory in what is conceptually a single frame.
+// Nothing is reclaimed until next_frame_context() or wait_idle() is called, and we run out of memory.
+// Sprinkling wait_idle() around works, but it drains the GPU completely every time, and we lose all CPU/GPU overlap.
+
+// The better option is to treat next_frame_context() as a memory reclamation point.
+// next_frame_context() only waits for the fences of the frame context we rotate into,
+// i.e. work which was submitted one or more frame contexts ago. Work submitted in the current frame context keeps running.
+// If we keep track of how many bytes are pending destruction in each frame context,
+// we can rotate early whenever the current frame context exceeds a budget.
+// Memory is not reclaimed as soon as the submissions it was retired under have completed though.
+// Granite destroys it when the Device rotates back into the frame context it was retired in, i.e. N rotations later
+// with N frame contexts. Every frame context can hold up to a budget, plus the last object which pushed it over,
+// so the peak is N * (budget + largest retired object), not budget. Pick the budget with that in mind.
+// In return, the GPU always has the other frame contexts worth of work queued up while we wait.
+// Keeping handles alive per fence and dropping them once the fence has signalled does not help here:
+// dropping the handle only hands the object to Granite's current frame context, which brings us back to the same rotation.
+
+// The budget has to know which frame context the Device is in, and the Device does not tell us.
+// We keep our own index, and check it against fences: submissions go through the budget, which keeps the fence
+// of the last submission made in each frame context. When next_frame_context() rotates into a frame context,
+// the Device has waited for all of its fences, so that fence must have signalled.
+// If it hasn't, something rotated the Device behind our back, and our accounting is wrong.
+// For the same reason, wait_idle() must also go through the budget.
+
+class DestructionBudget
+{
+public:
+	DestructionBudget(Vulkan::Device &device_, unsigned num_frame_contexts, VkDeviceSize budget_)
+		: device(device_), pending_bytes(num_frame_contexts), last_fences(num_frame_contexts), budget(budget_)
+	{
+	}
+
+	// Call instead of Device::submit().
+	void submit(Vulkan::CommandBufferHandle &cmd)
+	{
+		// Submissions to a queue complete in order, so the last fence is all we need.
+		Vulkan::Fence fence;
+		device.submit(cmd, &fence);
+		last_fences[current] = std::move(fence);
+	}
+
+	// Drops the handle, and accounts for its memory in the current frame context.
+	// If this was the last reference, the memory is reclaimed once the frame context is recycled.
+	void retire(Vulkan::BufferHandle &buffer)
+	{
+		VkMemoryRequirements reqs;
+		vkGetBufferMemoryRequirements(device.get_device(), buffer->get_buffer(), &reqs);
+		buffer.reset();
+		add_pending(reqs.size);
+	}
+
+	void retire(Vulkan::ImageHandle &image)
+	{
+		VkMemoryRequirements reqs;
+		vkGetImageMemoryRequirements(device.get_device(), image->get_image(), &reqs);
+		image.reset();
+		add_pending(reqs.size);
+	}
+
+	// Call instead of Device::next_frame_context().
+	// Like next_frame_context(), it must only be called when all command buffers have been submitted.
+	void next_frame_context()
+	{
+		auto start = std::chrono::steady_clock::now();
+		device.next_frame_context();
+		auto end = std::chrono::steady_clock::now();
+		stats.wait_ms += std::chrono::duration<double, std::milli>(end - start).count();
+
+		// We're now in the frame context we last visited N frames ago, and its deferred destructions have been carried out.
+		current = (current + 1) % unsigned(pending_bytes.size());
+		auto &fence = last_fences[current];
+		if (fence && !fence->wait_timeout(0))
+		{
+			LOGE("Frame context %u has not completed after next_frame_context(), the Device was rotated behind our back.\n",
+			     current);
+			stats.out_of_sync = true;
+		}
+		fence.reset();
+
+		total_pending_bytes -= pending_bytes[current];
+		pending_bytes[current] = 0;
+	}
+
+	// Call instead of Device::wait_idle(). Everything is reclaimed, but the frame context does not change.
+	void wait_idle()
+	{
+		device.wait_idle();
+		for (auto &fence : last_fences)
+			fence.reset();
+		for (auto &bytes : pending_bytes)
+			bytes = 0;
+		total_pending_bytes = 0;
+	}
+
+	// Call at a point where all command buffers have been submitted.
+	// Rotates the frame context early if the current frame context has retired more memory than the budget allows.
+	// This bounds what a single frame context holds on to. See above for what it means for the total.
+	bool reclaim_if_over_budget()
+	{
+		if (pending_bytes[current] < budget)
+			return false;
+
+		next_frame_context();
+		stats.early_rotations++;
+		return true;
+	}
+
+	struct Stats
+	{
+		VkDeviceSize peak_pending_bytes = 0;
+		VkDeviceSize largest_retired_bytes = 0;
+		unsigned early_rotations = 0;
+		double wait_ms = 0.0;
+		bool out_of_sync = false;
+	};
+
+	const Stats &get_stats() const
+	{
+		return stats;
+	}
+
+	VkDeviceSize get_pending_bytes() const
+	{
+		return total_pending_bytes;
+	}
+
+private:
+	Vulkan::Device &device;
+	std::vector<VkDeviceSize> pending_bytes;
+	std::vector<Vulkan::Fence> last_fences;
+	VkDeviceSize total_pending_bytes = 0;
+	VkDeviceSize budget;
+	unsigned current = 0;
+	Stats stats;
+
+	void add_pending(VkDeviceSize size)
+	{
+		pending_bytes[current] += size;
+		total_pending_bytes += size;
+		if (size > stats.largest_retired_bytes)
+			stats.largest_retired_bytes = size;
+		if (total_pending_bytes > stats.peak_pending_bytes)
+			stats.peak_pending_bytes = total_pending_bytes;
+	}
+};
+
+static const unsigned NumFrameContexts = 2;
+static const unsigned NumJobs = 256;
+static const VkDeviceSize ScratchSize = 16 * 1024 * 1024;
+static const VkDeviceSize Budget = 64 * 1024 * 1024;
+static const unsigned WaitIdleInterval = 8;
+
+// A pretend render job which needs a large scratch buffer.
+// The budgeted version submits through the budget, so it can check that it agrees with the Device.
+static Vulkan::BufferHandle run_job(Vulkan::Device &device, DestructionBudget *budget, unsigned job)
+{
+	Vulkan::BufferCreateInfo info;
+	info.size = ScratchSize;
+	info.domain = Vulkan::BufferDomain::Device;
+	info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+	auto scratch = device.create_buffer(info);
+
+	auto cmd = device.request_command_buffer();
+	cmd->fill_buffer(*scratch, job);
+	if (budget)
+		budget->submit(cmd);
+	else
+		device.submit(cmd);
+	return scratch;
+}
+
+int main()
+{
+	// See sample 01.
+	if (!Vulkan::Context::init_loader(nullptr))
+	{
+		LOGE("Failed to create loader!\n");
+		return 1;
+	}
+
+	Vulkan::Context context;
+	if (!context.init_instance_and_device(nullptr, 0, nullptr, 0))
+	{
+		LOGE("Failed to create VkInstance and VkDevice.\n");
+		return 1;
+	}
+
+	Vulkan::Device device;
+	device.set_context(context);
+	////
+
+	// We need to know how many frame contexts there are to track them.
+	device.init_frame_contexts(NumFrameContexts);
+
+	// The old way. Every few jobs, drain the GPU so memory is reclaimed.
+	// Without this, NumJobs * ScratchSize bytes would be pending destruction by the end.
+	{
+		VkDeviceSize pending = 0;
+		VkDeviceSize peak_pending = 0;
+
+		auto start = std::chrono::steady_clock::now();
+		for (unsigned job = 0; job < NumJobs; job++)
+		{
+			auto scratch = run_job(device, nullptr, job);
+			scratch.reset();
+			pending += ScratchSize;
+			if (pending > peak_pending)
+				peak_pending = pending;
+
+			if ((job + 1) % WaitIdleInterval == 0)
+			{
+				device.wait_idle();
+				pending = 0;
+			}
+		}
+		device.wait_idle();
+		auto end = std::chrono::steady_clock::now();
+
+		LOGI("wait_idle() every %u jobs: %.3f ms, peak pending destruction: %llu MiB.\n",
+		     WaitIdleInterval,
+		     std::chrono::duration<double, std::milli>(end - start).count(),
+		     static_cast<unsigned long long>(peak_pending >> 20));
+	}
+
+	// Budgeted. The frame context is rotated whenever the budget is exceeded.
+	{
+		DestructionBudget budget(device, NumFrameContexts, Budget);
+
+		auto start = std::chrono::steady_clock::now();
+		for (unsigned job = 0; job < NumJobs; job++)
+		{
+			auto scratch = run_job(device, &budget, job);
+			budget.retire(scratch);
+			budget.reclaim_if_over_budget();
+		}
+		budget.wait_idle();
+		auto end = std::chrono::steady_clock::now();
+
+		auto &stats = budget.get_stats();
+		VkDeviceSize bound = NumFrameContexts * (Budget + stats.largest_retired_bytes);
+		LOGI("Budget of %llu MiB: %.3f ms, peak pending destruction: %llu MiB, %u early rotations, %.3f ms waiting for fences.\n",
+		     static_cast<unsigned long long>(Budget >> 20),
+		     std::chrono::duration<double, std::milli>(end - start).count(),
+		     static_cast<unsigned long long>(stats.peak_pending_bytes >> 20),
+		     stats.early_rotations, stats.wait_ms);
+		LOGI("The peak is bounded by %u frame contexts * (budget + largest retired object) = %llu MiB.\n",
+		     NumFrameContexts, static_cast<unsigned long long>(bound >> 20));
+		if (stats.peak_pending_bytes > bound)
+			LOGE("Peak pending destruction exceeded the bound.\n");
+		if (stats.out_of_sync)
+			LOGE("The budget's frame context index did not agree with the Device, the numbers above are wrong.\n");
+	}
+}
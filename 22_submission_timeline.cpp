@@ -0,0 +1,470 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "vulkan.hpp"
+#include "device.hpp"
+#include "util.hpp"
+#include <deque>
+#include <vector>
+#include <chrono>
+
+// Sample 09 uses Fences and Semaphores for synchronization. These are binary objects:
+// - A Semaphore can be waited for exactly once.
+// - Every Fence or Semaphore we ask for in Device::submit() forces a vkQueueSubmit right away,
+//   rather than letting Granite batch up command buffers.
+// VK_KHR_timeline_semaphore replaces both with a single monotonically increasing 64-bit counter.
+// Here we create one timeline semaphore per queue, which lives as long as the device.
+// - Submissions are grouped, and every group signals the next value on its queue's timeline.
+//   Granite's batched command buffers are flushed, and the signal is an empty vkQueueSubmit on the same queue.
+//   A semaphore signal operation covers all work submitted to the queue before it, so this covers the whole group.
+// - Another queue can wait for a value on the GPU, through VkTimelineSemaphoreSubmitInfo. Unlike a binary Semaphore,
+//   the same value can be waited for by any number of submissions. Here, two graphics submissions consume the
+//   transfer queue's value, without the CPU ever blocking in the middle of a frame.
+// - The CPU can wait for, or poll, any value as many times as it wants with vkWaitSemaphores and vkGetSemaphoreCounterValue.
+// - vkWaitSemaphores takes any number of semaphores, so the CPU can wait on values from several queues in one call.
+// - Frame contexts and deferred destruction are keyed on values instead of on fences.
+// Granite owns the queues, and we call vkQueueSubmit on them ourselves. That is fine here since only the main thread
+// submits anything. In a multithreaded application, the raw submissions would have to be serialized with Granite's.
+// Raw calls go through Granite's VolkDeviceTable, which is where the device functions are loaded (see sample 17).
+
+// Timeline semaphore entry points come either from Vulkan 1.2 or from the extension. Pick whichever is loaded.
+static PFN_vkWaitSemaphores wait_semaphores;
+static PFN_vkGetSemaphoreCounterValue get_semaphore_counter_value;
+
+class QueueTimeline;
+
+// A point on one queue's timeline.
+struct TimelinePoint
+{
+	const QueueTimeline *timeline;
+	uint64_t value;
+};
+
+class QueueTimeline
+{
+public:
+	QueueTimeline(Vulkan::Device &device_, VkQueue queue_)
+		: device(device_), table(device_.get_device_table()), queue(queue_)
+	{
+		VkSemaphoreTypeCreateInfoKHR type_info = { VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR };
+		type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR;
+		type_info.initialValue = 0;
+
+		VkSemaphoreCreateInfo info = { VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO };
+		info.pNext = &type_info;
+		if (table.vkCreateSemaphore(device.get_device(), &info, nullptr, &semaphore) != VK_SUCCESS)
+			LOGE("Failed to create timeline semaphore.\n");
+	}
+
+	// The device must be idle, a timeline semaphore can't be destroyed while a signal is pending.
+	~QueueTimeline()
+	{
+		table.vkDestroySemaphore(device.get_device(), semaphore, nullptr);
+	}
+
+	QueueTimeline(const QueueTimeline &) = delete;
+	void operator=(const QueueTimeline &) = delete;
+
+	// Closes the current group of submissions on this queue, and returns its value.
+	// Command buffers which are submitted later belong to the next value.
+	uint64_t signal()
+	{
+		// Granite holds on to submissions until it has a reason to flush. Make sure they are on the queue first.
+		device.flush_frame();
+
+		uint64_t value = ++last_signalled_value;
+
+		VkTimelineSemaphoreSubmitInfoKHR timeline_info = { VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR };
+		timeline_info.signalSemaphoreValueCount = 1;
+		timeline_info.pSignalSemaphoreValues = &value;
+
+		VkSubmitInfo submit = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
+		submit.pNext = &timeline_info;
+		submit.signalSemaphoreCount = 1;
+		submit.pSignalSemaphores = &semaphore;
+		if (table.vkQueueSubmit(queue, 1, &submit, VK_NULL_HANDLE) != VK_SUCCESS)
+			LOGE("Failed to signal timeline value %llu.\n", static_cast<unsigned long long>(value));
+
+		return value;
+	}
+
+	// Submits a command buffer to this queue which does not start its stages until a point, usually on another queue,
+	// has been reached. The wait happens on the GPU, and only holds back this submission, so it has to carry the work
+	// which depends on the point. An empty submission which waits would not hold back anything submitted after it.
+	void submit(VkCommandBuffer cmd, const TimelinePoint &wait, VkPipelineStageFlags stages)
+	{
+		// Keep queue order with what Granite has batched up so far.
+		device.flush_frame();
+
+		VkSemaphore wait_semaphore = wait.timeline->get_semaphore();
+
+		VkTimelineSemaphoreSubmitInfoKHR timeline_info = { VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR };
+		timeline_info.waitSemaphoreValueCount = 1;
+		timeline_info.pWaitSemaphoreValues = &wait.value;
+
+		VkSubmitInfo submit = { VK_STRUCTURE_TYPE_SUBMIT_INFO };
+		submit.pNext = &timeline_info;
+		submit.waitSemaphoreCount = 1;
+		submit.pWaitSemaphores = &wait_semaphore;
+		submit.pWaitDstStageMask = &stages;
+		submit.commandBufferCount = 1;
+		submit.pCommandBuffers = &cmd;
+		if (table.vkQueueSubmit(queue, 1, &submit, VK_NULL_HANDLE) != VK_SUCCESS)
+			LOGE("Failed to submit a command buffer waiting for timeline value %llu.\n",
+			     static_cast<unsigned long long>(wait.value));
+	}
+
+	// Non-blocking. The counter never goes backwards.
+	uint64_t get_completed_value() const
+	{
+		uint64_t value = 0;
+		get_semaphore_counter_value(device.get_device(), semaphore, &value);
+		return value;
+	}
+
+	// Unlike a binary Semaphore, a value can be waited for any number of times.
+	void wait(uint64_t value) const
+	{
+		VkSemaphoreWaitInfoKHR info = { VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR };
+		info.semaphoreCount = 1;
+		info.pSemaphores = &semaphore;
+		info.pValues = &value;
+		wait_semaphores(device.get_device(), &info, UINT64_MAX);
+	}
+
+	VkSemaphore get_semaphore() const
+	{
+		return semaphore;
+	}
+
+	uint64_t get_last_signalled_value() const
+	{
+		return last_signalled_value;
+	}
+
+private:
+	Vulkan::Device &device;
+	const VolkDeviceTable &table;
+	VkQueue queue;
+	VkSemaphore semaphore = VK_NULL_HANDLE;
+	uint64_t last_signalled_value = 0;
+};
+
+// Waits for several points at once, typically on different queues.
+// With VK_SEMAPHORE_WAIT_ANY_BIT, we wake up as soon as one of them is reached instead.
+static void wait_for_points(Vulkan::Device &device, const TimelinePoint *points, unsigned count, bool any = false)
+{
+	std::vector<VkSemaphore> semaphores;
+	std::vector<uint64_t> values;
+	for (unsigned i = 0; i < count; i++)
+	{
+		// Value 0 is where every timeline starts, so there's nothing to wait for.
+		if (points[i].value == 0)
+			continue;
+		semaphores.push_back(points[i].timeline->get_semaphore());
+		values.push_back(points[i].value);
+	}
+
+	if (semaphores.empty())
+		return;
+
+	VkSemaphoreWaitInfoKHR info = { VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR };
+	info.flags = any ? VK_SEMAPHORE_WAIT_ANY_BIT_KHR : 0;
+	info.semaphoreCount = uint32_t(semaphores.size());
+	info.pSemaphores = semaphores.data();
+	info.pValues = values.data();
+	wait_semaphores(device.get_device(), &info, UINT64_MAX);
+}
+
+// Deferred release keyed on timeline values rather than on frame contexts.
+// Our reference is dropped as soon as the point it was retired under has been reached, which can be well before
+// our own frame context comes around again. This is not the same as destroying the VkBuffer though.
+// Dropping the last BufferHandle hands the buffer to Granite, which destroys it when its current frame context
+// is recycled, and that still waits on Granite's fences in next_frame_context(). So the VkBuffer lives until
+// Granite's frame context is done with it either way. What the timeline saves is the CPU side bookkeeping,
+// one value per group rather than one Fence per submission, and it is what makes the release possible at all
+// for objects which outlive Granite's frame contexts.
+class TimelineDeleter
+{
+public:
+	void retire(Vulkan::BufferHandle buffer, const TimelinePoint &point)
+	{
+		retired.push_back({ std::move(buffer), point });
+	}
+
+	// Non-blocking. Points on the same timeline complete in order, but the deleter can be fed from several timelines,
+	// so look at every entry.
+	unsigned collect()
+	{
+		unsigned num_released = 0;
+		auto itr = retired.begin();
+		while (itr != retired.end())
+		{
+			if (itr->point.timeline->get_completed_value() >= itr->point.value)
+			{
+				itr = retired.erase(itr);
+				num_released++;
+			}
+			else
+				++itr;
+		}
+		return num_released;
+	}
+
+private:
+	struct Retired
+	{
+		Vulkan::BufferHandle buffer;
+		TimelinePoint point;
+	};
+	std::deque<Retired> retired;
+};
+
+static const unsigned NumFrames = 64;
+static const unsigned SubmissionsPerFrame = 64;
+static const unsigned NumFramesInFlight = 2;
+
+static Vulkan::CommandBufferHandle record_work(Vulkan::Device &device, Vulkan::Buffer &buffer, unsigned index,
+                                               Vulkan::CommandBuffer::Type type = Vulkan::CommandBuffer::Type::Generic)
+{
+	auto cmd = device.request_command_buffer(type);
+	cmd->fill_buffer(buffer, index);
+	return cmd;
+}
+
+static Vulkan::BufferHandle create_buffer(Vulkan::Device &device)
+{
+	Vulkan::BufferCreateInfo info;
+	info.size = 64 * 1024;
+	info.domain = Vulkan::BufferDomain::Device;
+	info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	return device.create_buffer(info);
+}
+
+// Granite's command buffers are submitted through Device::submit(), which can't wait for a timeline value,
+// so the graphics work which consumes the transfer queue's output is recorded here, from our own command pool.
+// Copies a quarter of the source into the destination, at the given quarter.
+static void record_consumer(const VolkDeviceTable &table, VkCommandBuffer cmd,
+                            const Vulkan::Buffer &src, const Vulkan::Buffer &dst, unsigned quarter)
+{
+	VkCommandBufferBeginInfo begin_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+	begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	table.vkBeginCommandBuffer(cmd, &begin_info);
+
+	// The semaphore wait makes the transfer queue's writes visible, but the destination was written
+	// earlier on this queue as well.
+	VkMemoryBarrier barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	table.vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+	                           1, &barrier, 0, nullptr, 0, nullptr);
+
+	VkBufferCopy region = {};
+	region.size = src.get_create_info().size / 4;
+	region.srcOffset = quarter * region.size;
+	region.dstOffset = quarter * region.size;
+	table.vkCmdCopyBuffer(cmd, src.get_buffer(), dst.get_buffer(), 1, &region);
+
+	table.vkEndCommandBuffer(cmd);
+}
+
+int main()
+{
+	// See sample 01.
+	if (!Vulkan::Context::init_loader(nullptr))
+	{
+		LOGE("Failed to create loader!\n");
+		return 1;
+	}
+
+	Vulkan::Context context;
+	if (!context.init_instance_and_device(nullptr, 0, nullptr, 0))
+	{
+		LOGE("Failed to create VkInstance and VkDevice.\n");
+		return 1;
+	}
+
+	Vulkan::Device device;
+	device.set_context(context);
+	////
+
+	// Granite enables VK_KHR_timeline_semaphore (or the Vulkan 1.2 feature) when the device supports it.
+	if (!device.get_device_features().timeline_semaphore_features.timelineSemaphore)
+	{
+		LOGE("Timeline semaphores are not supported.\n");
+		return 1;
+	}
+
+	auto &table = device.get_device_table();
+	wait_semaphores = table.vkWaitSemaphoresKHR ? table.vkWaitSemaphoresKHR : table.vkWaitSemaphores;
+	get_semaphore_counter_value = table.vkGetSemaphoreCounterValueKHR ?
+	                              table.vkGetSemaphoreCounterValueKHR : table.vkGetSemaphoreCounterValue;
+
+	auto buffer = create_buffer(device);
+	auto transfer_buffer = create_buffer(device);
+
+	// Every submission wants to know when it has completed, so we ask for a fence every time.
+	// Each of these is a vkQueueSubmit.
+	{
+		unsigned num_fences = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (unsigned frame = 0; frame < NumFrames; frame++)
+		{
+			std::deque<Vulkan::Fence> fences;
+			for (unsigned i = 0; i < SubmissionsPerFrame; i++)
+			{
+				auto cmd = record_work(device, *buffer, i);
+				Vulkan::Fence fence;
+				device.submit(cmd, &fence);
+				fences.push_back(std::move(fence));
+				num_fences++;
+			}
+
+			// Some consumer wants to know if the first half of the frame is done. It does not block on it.
+			fences[SubmissionsPerFrame / 2 - 1]->wait_timeout(0);
+			device.next_frame_context();
+		}
+		device.wait_idle();
+		auto end = std::chrono::steady_clock::now();
+
+		LOGI("Fence per submission: %.3f ms, %u fences.\n",
+		     std::chrono::duration<double, std::milli>(end - start).count(), num_fences);
+	}
+
+	// Submissions are grouped into values. Consumers only care about values.
+	{
+		auto &queues = context.get_queue_info().queues;
+		QueueTimeline graphics(device, queues[Vulkan::QUEUE_INDEX_GRAPHICS]);
+		QueueTimeline transfer(device, queues[Vulkan::QUEUE_INDEX_TRANSFER]);
+		TimelineDeleter deleter;
+
+		// One command pool per frame context, reset when the frame context is reused, like Granite does.
+		// Each frame records two consumers of the transfer queue's output.
+		VkCommandPool pools[NumFramesInFlight] = {};
+		VkCommandBuffer consumers[NumFramesInFlight][2] = {};
+		for (unsigned i = 0; i < NumFramesInFlight; i++)
+		{
+			VkCommandPoolCreateInfo pool_info = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO };
+			pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+			pool_info.queueFamilyIndex = context.get_queue_info().family_indices[Vulkan::QUEUE_INDEX_GRAPHICS];
+			table.vkCreateCommandPool(device.get_device(), &pool_info, nullptr, &pools[i]);
+
+			VkCommandBufferAllocateInfo alloc_info = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
+			alloc_info.commandPool = pools[i];
+			alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+			alloc_info.commandBufferCount = 2;
+			table.vkAllocateCommandBuffers(device.get_device(), &alloc_info, consumers[i]);
+		}
+
+		// Our own frame contexts. Each remembers the values it signalled on both queues.
+		TimelinePoint frame_points[NumFramesInFlight][2] = {};
+		for (auto &points : frame_points)
+		{
+			points[0] = { &graphics, 0 };
+			points[1] = { &transfer, 0 };
+		}
+
+		uint64_t last_completed = 0;
+		unsigned num_released = 0;
+		unsigned num_first_half_done = 0;
+		auto start = std::chrono::steady_clock::now();
+
+		for (unsigned frame = 0; frame < NumFrames; frame++)
+		{
+			// Before reusing a frame context, both queues must be done with it. One vkWaitSemaphores covers both.
+			// This is the only place the CPU blocks.
+			unsigned context_index = frame % NumFramesInFlight;
+			auto *points = frame_points[context_index];
+			wait_for_points(device, points, 2);
+			table.vkResetCommandPool(device.get_device(), pools[context_index], 0);
+			num_released += deleter.collect();
+
+			// Some per-frame scratch memory which the transfer queue fills in.
+			auto scratch = create_buffer(device);
+			auto transfer_cmd = record_work(device, *scratch, frame, Vulkan::CommandBuffer::Type::AsyncTransfer);
+			device.submit(transfer_cmd);
+			transfer_cmd = record_work(device, *transfer_buffer, frame, Vulkan::CommandBuffer::Type::AsyncTransfer);
+			device.submit(transfer_cmd);
+			points[1] = { &transfer, transfer.signal() };
+
+			// Both halves of the graphics work consume the scratch buffer, and both wait on the GPU for the same
+			// transfer value. With binary semaphores, that would take one semaphore and one signal per consumer.
+			uint64_t first_half = 0;
+			for (unsigned i = 0; i < SubmissionsPerFrame; i++)
+			{
+				auto cmd = record_work(device, *buffer, i);
+				device.submit(cmd);
+
+				if (i == SubmissionsPerFrame / 2 - 1 || i == SubmissionsPerFrame - 1)
+				{
+					unsigned half = i == SubmissionsPerFrame - 1 ? 1 : 0;
+					VkCommandBuffer consumer = consumers[context_index][half];
+					record_consumer(table, consumer, *scratch, *buffer, half);
+					graphics.submit(consumer, points[1], VK_PIPELINE_STAGE_TRANSFER_BIT);
+				}
+
+				if (i == SubmissionsPerFrame / 2 - 1)
+					first_half = graphics.signal();
+			}
+			points[0] = { &graphics, graphics.signal() };
+
+			// The graphics queue is the last to read the scratch buffer, so it's retired under the graphics value.
+			deleter.retire(std::move(scratch), points[0]);
+
+			// Polling is cheap, and does not block. Values are monotonic for the lifetime of the device,
+			// not just within a frame.
+			uint64_t completed = graphics.get_completed_value();
+			if (completed < last_completed)
+				LOGE("Timeline went backwards!\n");
+			if (completed >= first_half)
+				num_first_half_done++;
+			last_completed = completed;
+
+			// Granite still recycles its own command pools and such per frame context.
+			device.next_frame_context();
+		}
+
+		// Wait for whichever queue is done first, then for everything.
+		TimelinePoint last[2] = {
+			{ &graphics, graphics.get_last_signalled_value() },
+			{ &transfer, transfer.get_last_signalled_value() },
+		};
+		wait_for_points(device, last, 2, true);
+		wait_for_points(device, last, 2);
+		num_released += deleter.collect();
+		auto end = std::chrono::steady_clock::now();
+
+		LOGI("Submission timeline: %.3f ms, %llu graphics values, %llu transfer values, %u cross-queue waits.\n",
+		     std::chrono::duration<double, std::milli>(end - start).count(),
+		     static_cast<unsigned long long>(graphics.get_last_signalled_value()),
+		     static_cast<unsigned long long>(transfer.get_last_signalled_value()),
+		     2 * NumFrames);
+		LOGI("First half of the frame was already done %u / %u times when polled.\n", num_first_half_done, NumFrames);
+		// See TimelineDeleter, the VkBuffers are still destroyed with Granite's frame contexts.
+		LOGI("%u scratch buffers handed back to Granite by value.\n", num_released);
+
+		// The timeline semaphores and command pools can't be destroyed while they're in use.
+		device.wait_idle();
+		for (auto pool : pools)
+			table.vkDestroyCommandPool(device.get_device(), pool, nullptr);
+	}
+}
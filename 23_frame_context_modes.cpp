@@ -0,0 +1,306 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "vulkan.hpp"
+#include "device.hpp"
+#include "util.hpp"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <string.h>
+
+// Sample 03 sets up 2 frame contexts, which is what Device::set_context() does by default on desktop.
+// The number of frame contexts is the number of frames the CPU can run ahead of the GPU.
+// More frame contexts means more throughput, since neither CPU nor GPU needs to wait for the other,
+// but also more latency, since the frame we record now is displayed further into the future.
+// - Interactive applications care about input-to-present latency.
+// - Offline batch rendering only cares about throughput, and 3 or 4 frames in flight can help to smooth out spikes.
+
+// init_frame_contexts() can be called at any time, not just at startup.
+// It waits for the device to go idle and recreates the frame contexts, the device itself is untouched,
+// so it's fine to switch modes when an application goes from interactive to batch rendering and back.
+
+// On top of the frame context count, we can trade throughput for latency with a low-latency mode.
+// Here, we wait for the previous frame to complete on the GPU before we sample input for the next frame.
+// The CPU and GPU no longer overlap, but the input we sample is as fresh as it can be.
+
+enum class LatencyMode
+{
+	Throughput,
+	LowLatency
+};
+
+class FramePacer
+{
+public:
+	FramePacer(Vulkan::Device &device_, unsigned num_frame_contexts, LatencyMode mode_)
+		: device(device_), mode(mode_)
+	{
+		device.init_frame_contexts(num_frame_contexts);
+	}
+
+	// Call before sampling input.
+	void begin_frame()
+	{
+		if (mode == LatencyMode::LowLatency && last_frame_fence)
+			last_frame_fence->wait();
+		last_frame_fence.reset();
+	}
+
+	// Submits the last command buffer of the frame, and moves on to the next frame context.
+	Vulkan::Fence end_frame(Vulkan::CommandBufferHandle &cmd)
+	{
+		Vulkan::Fence fence;
+		device.submit(cmd, &fence);
+		device.next_frame_context();
+		last_frame_fence = fence;
+		return fence;
+	}
+
+private:
+	Vulkan::Device &device;
+	LatencyMode mode;
+	Vulkan::Fence last_frame_fence;
+};
+
+// There's no display here, so "present" is when the GPU has completed the frame.
+// A thread waits for frames in order and records the latency from when input was sampled.
+class LatencyMonitor
+{
+public:
+	LatencyMonitor()
+	{
+		thread = std::thread(&LatencyMonitor::thread_loop, this);
+	}
+
+	~LatencyMonitor()
+	{
+		{
+			std::lock_guard<std::mutex> holder{lock};
+			dead = true;
+		}
+		cond.notify_one();
+		thread.join();
+	}
+
+	void add_frame(std::chrono::steady_clock::time_point input_time, Vulkan::Fence fence)
+	{
+		{
+			std::lock_guard<std::mutex> holder{lock};
+			frames.push_back({ input_time, std::move(fence) });
+		}
+		cond.notify_one();
+	}
+
+	// Blocks until all frames have completed.
+	double get_average_latency_ms()
+	{
+		std::unique_lock<std::mutex> holder{lock};
+		idle_cond.wait(holder, [this]() { return frames.empty() && !busy; });
+		return num_latencies ? total_latency_ms / num_latencies : 0.0;
+	}
+
+private:
+	struct Frame
+	{
+		std::chrono::steady_clock::time_point input_time;
+		Vulkan::Fence fence;
+	};
+
+	std::thread thread;
+	std::mutex lock;
+	std::condition_variable cond;
+	std::condition_variable idle_cond;
+	std::deque<Frame> frames;
+	double total_latency_ms = 0.0;
+	unsigned num_latencies = 0;
+	bool busy = false;
+	bool dead = false;
+
+	void thread_loop()
+	{
+		for (;;)
+		{
+			Frame frame;
+			{
+				std::unique_lock<std::mutex> holder{lock};
+				cond.wait(holder, [this]() { return dead || !frames.empty(); });
+				if (frames.empty())
+					return;
+				frame = std::move(frames.front());
+				frames.pop_front();
+				busy = true;
+			}
+
+			frame.fence->wait();
+			auto done = std::chrono::steady_clock::now();
+			frame.fence.reset();
+
+			{
+				std::lock_guard<std::mutex> holder{lock};
+				total_latency_ms += std::chrono::duration<double, std::milli>(done - frame.input_time).count();
+				num_latencies++;
+				busy = false;
+			}
+			idle_cond.notify_all();
+		}
+	}
+};
+
+static const uint32_t triangle_vert[] =
+#include "shaders/triangle.vert.inc"
+;
+
+static const uint32_t triangle_frag[] =
+#include "shaders/triangle.frag.inc"
+;
+
+static const unsigned NumFrames = 200;
+static const unsigned NumDraws = 100;
+
+// Pretend we're doing a few milliseconds of game logic.
+static void simulate_cpu_work()
+{
+	auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(2);
+	while (std::chrono::steady_clock::now() < end)
+		std::this_thread::yield();
+}
+
+static void record_frame(Vulkan::Device &device, Vulkan::CommandBuffer &cmd, Vulkan::Program *prog, float input)
+{
+	Vulkan::RenderPassInfo rp;
+	rp.num_color_attachments = 1;
+	rp.color_attachments[0] = &device.get_transient_attachment(1024, 1024, VK_FORMAT_R8G8B8A8_UNORM);
+	rp.clear_attachments = 1 << 0;
+	cmd.begin_render_pass(rp);
+
+	cmd.set_program(prog);
+	cmd.set_opaque_state();
+	cmd.set_blend_enable(true);
+	cmd.set_blend_factors(VK_BLEND_FACTOR_ONE, VK_BLEND_FACTOR_ONE, VK_BLEND_FACTOR_ONE, VK_BLEND_FACTOR_ONE);
+	cmd.set_blend_op(VK_BLEND_OP_ADD);
+
+	// See sample 07.
+	static const float positions[3 * 2] = {
+		-1.0f, -1.0f,
+		-1.0f, +3.0f,
+		+3.0f, -1.0f,
+	};
+	static const float colors[3 * 4] = {
+		1.0f, 0.0f, 0.0f, 1.0f,
+		0.0f, 1.0f, 0.0f, 1.0f,
+		0.0f, 0.0f, 1.0f, 1.0f,
+	};
+	memcpy(cmd.allocate_vertex_data(0, sizeof(positions), 2 * sizeof(float)), positions, sizeof(positions));
+	memcpy(cmd.allocate_vertex_data(1, sizeof(colors), 4 * sizeof(float)), colors, sizeof(colors));
+	cmd.set_vertex_attrib(0, 0, VK_FORMAT_R32G32_SFLOAT, 0);
+	cmd.set_vertex_attrib(1, 1, VK_FORMAT_R32G32B32A32_SFLOAT, 0);
+
+	// Full-screen triangles with blending, so there is a decent amount of GPU work.
+	for (unsigned i = 0; i < NumDraws; i++)
+	{
+		float *vert_ubo = static_cast<float *>(cmd.allocate_constant_data(0, 0, 4 * sizeof(float)));
+		vert_ubo[0] = input;
+		vert_ubo[1] = 0.0f;
+		vert_ubo[2] = 1.0f;
+		vert_ubo[3] = 1.0f;
+
+		float *frag_ubo = static_cast<float *>(cmd.allocate_constant_data(0, 1, 4 * sizeof(float)));
+		for (unsigned c = 0; c < 4; c++)
+			frag_ubo[c] = 1.0f / float(NumDraws);
+
+		cmd.draw(3);
+	}
+
+	cmd.end_render_pass();
+}
+
+int main()
+{
+	// See sample 01.
+	if (!Vulkan::Context::init_loader(nullptr))
+	{
+		LOGE("Failed to create loader!\n");
+		return 1;
+	}
+
+	Vulkan::Context context;
+	if (!context.init_instance_and_device(nullptr, 0, nullptr, 0))
+	{
+		LOGE("Failed to create VkInstance and VkDevice.\n");
+		return 1;
+	}
+
+	Vulkan::Device device;
+	device.set_context(context);
+	////
+
+	Vulkan::Program *prog = device.request_program(
+			device.request_shader(triangle_vert, sizeof(triangle_vert)),
+			device.request_shader(triangle_frag, sizeof(triangle_frag)));
+
+	struct Setting
+	{
+		const char *name;
+		unsigned num_frame_contexts;
+		LatencyMode mode;
+	};
+
+	static const Setting settings[] = {
+		{ "Low latency", 2, LatencyMode::LowLatency },
+		{ "Default", 2, LatencyMode::Throughput },
+		{ "Throughput", 3, LatencyMode::Throughput },
+		{ "Throughput", 4, LatencyMode::Throughput },
+	};
+
+	for (auto &setting : settings)
+	{
+		FramePacer pacer(device, setting.num_frame_contexts, setting.mode);
+		LatencyMonitor monitor;
+
+		auto start = std::chrono::steady_clock::now();
+		for (unsigned frame = 0; frame < NumFrames; frame++)
+		{
+			pacer.begin_frame();
+
+			// This is where we would poll input.
+			auto input_time = std::chrono::steady_clock::now();
+			simulate_cpu_work();
+
+			auto cmd = device.request_command_buffer();
+			record_frame(device, *cmd, prog, float(frame % 64) / 64.0f);
+			monitor.add_frame(input_time, pacer.end_frame(cmd));
+		}
+
+		double latency_ms = monitor.get_average_latency_ms();
+		auto end = std::chrono::steady_clock::now();
+		double total_ms = std::chrono::duration<double, std::milli>(end - start).count();
+
+		LOGI("%s, %u frame contexts: %.1f frames / s, %.3f ms input-to-present latency.\n",
+		     setting.name, setting.num_frame_contexts, 1000.0 * NumFrames / total_ms, latency_ms);
+	}
+
+	// Back to the default.
+	device.init_frame_contexts(2);
+}
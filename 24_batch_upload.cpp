@@ -0,0 +1,332 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "vulkan.hpp"
+#include "device.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <vector>
+#include <chrono>
+#include <string.h>
+
+// Sample 02 mentions that initial data passed to create_buffer() or create_image() is uploaded separately for every resource.
+// Each of those uploads is its own staging buffer, command buffer, barriers and submission.
+// That's perfectly fine for a handful of resources, but a scene with tens of thousands of small meshes will spend
+// most of its load time on per-resource overhead.
+// Here we batch everything up instead:
+// - Resources are created without initial data. The data is copied into large, shared staging buffers.
+// - All copies are recorded into one command buffer on the transfer queue.
+// - Image layout transitions are batched into one pipeline barrier before and one after the copies.
+// - One submission signals a fence for the CPU, and a semaphore which the graphics queue waits for.
+
+class BatchUploader
+{
+public:
+	BatchUploader(Vulkan::Device &device_, VkDeviceSize staging_block_size_ = 16 * 1024 * 1024)
+		: device(device_), staging_block_size(staging_block_size_)
+	{
+	}
+
+	~BatchUploader()
+	{
+		if (!buffer_copies.empty() || !image_copies.empty())
+			flush(nullptr, nullptr);
+	}
+
+	// Same as Device::create_buffer(), but the data is uploaded in flush().
+	Vulkan::BufferHandle create_buffer(const Vulkan::BufferCreateInfo &info, const void *data)
+	{
+		Vulkan::BufferCreateInfo buffer_info = info;
+		buffer_info.usage |= VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+		auto buffer = device.create_buffer(buffer_info);
+
+		BufferCopy copy;
+		copy.buffer = buffer;
+		copy.staging = allocate_staging(info.size, copy.staging_offset, data);
+		buffer_copies.push_back(std::move(copy));
+		return buffer;
+	}
+
+	// Same as Device::create_image(), but only the first mip level is uploaded, in flush().
+	// The image is in info.initial_layout once the upload has completed.
+	Vulkan::ImageHandle create_image(const Vulkan::ImageCreateInfo &info, const void *data, VkDeviceSize size)
+	{
+		Vulkan::ImageCreateInfo image_info = info;
+		image_info.usage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+		image_info.initial_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+		// The image is written on the transfer queue and read on the graphics queue.
+		image_info.misc |= Vulkan::IMAGE_MISC_CONCURRENT_QUEUE_GRAPHICS_BIT |
+		                   Vulkan::IMAGE_MISC_CONCURRENT_QUEUE_ASYNC_TRANSFER_BIT;
+		auto image = device.create_image(image_info);
+
+		ImageCopy copy;
+		copy.image = image;
+		copy.final_layout = info.initial_layout != VK_IMAGE_LAYOUT_UNDEFINED ?
+		                    info.initial_layout : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		copy.staging = allocate_staging(size, copy.staging_offset, data);
+		image_copies.push_back(std::move(copy));
+		return image;
+	}
+
+	// Records and submits all pending uploads.
+	// The graphics queue waits for the semaphore before it can use the resources, unless a semaphore is passed in,
+	// in which case the caller is responsible for waiting.
+	void flush(Vulkan::Fence *fence, Vulkan::Semaphore *semaphore)
+	{
+		auto cmd = device.request_command_buffer(Vulkan::CommandBuffer::Type::AsyncTransfer);
+
+		std::vector<VkImageMemoryBarrier> barriers;
+		barriers.reserve(image_copies.size());
+
+		for (auto &copy : image_copies)
+		{
+			VkImageMemoryBarrier barrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
+			barrier.srcAccessMask = 0;
+			barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+			barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+			barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+			barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+			barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+			barrier.image = copy.image->get_image();
+			barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+			barriers.push_back(barrier);
+		}
+
+		// One barrier for all the images, rather than one per image.
+		if (!barriers.empty())
+		{
+			cmd->barrier(VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+			             0, nullptr, 0, nullptr, unsigned(barriers.size()), barriers.data());
+		}
+
+		for (auto &copy : buffer_copies)
+			cmd->copy_buffer(*copy.buffer, 0, *copy.staging, copy.staging_offset, copy.buffer->get_create_info().size);
+
+		for (auto &copy : image_copies)
+		{
+			auto &info = copy.image->get_create_info();
+			cmd->copy_buffer_to_image(*copy.image, *copy.staging, copy.staging_offset, {},
+			                          { info.width, info.height, 1 }, 0, 0,
+			                          { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 });
+		}
+
+		for (unsigned i = 0; i < barriers.size(); i++)
+		{
+			auto &barrier = barriers[i];
+			barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+			// Visibility on the graphics queue is handled by the semaphore.
+			barrier.dstAccessMask = 0;
+			barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+			barrier.newLayout = image_copies[i].final_layout;
+		}
+
+		if (!barriers.empty())
+		{
+			cmd->barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+			             0, nullptr, 0, nullptr, unsigned(barriers.size()), barriers.data());
+		}
+
+		for (auto &block : staging_blocks)
+			device.unmap_host_buffer(*block.buffer, Vulkan::MEMORY_ACCESS_WRITE_BIT);
+
+		Vulkan::Semaphore sem;
+		device.submit(cmd, fence, 1, semaphore ? semaphore : &sem);
+		if (!semaphore)
+		{
+			device.add_wait_semaphore(Vulkan::CommandBuffer::Type::Generic, sem,
+			                          VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+			                          VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+			                          VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT |
+			                          VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			                          true);
+		}
+
+		// The staging buffers are released through the frame context like any other object.
+		buffer_copies.clear();
+		image_copies.clear();
+		staging_blocks.clear();
+	}
+
+private:
+	Vulkan::Device &device;
+	VkDeviceSize staging_block_size;
+
+	struct StagingBlock
+	{
+		Vulkan::BufferHandle buffer;
+		uint8_t *mapped;
+		VkDeviceSize offset;
+		VkDeviceSize size;
+	};
+
+	struct BufferCopy
+	{
+		Vulkan::BufferHandle buffer;
+		Vulkan::BufferHandle staging;
+		VkDeviceSize staging_offset = 0;
+	};
+
+	struct ImageCopy
+	{
+		Vulkan::ImageHandle image;
+		Vulkan::BufferHandle staging;
+		VkDeviceSize staging_offset = 0;
+		VkImageLayout final_layout;
+	};
+
+	std::vector<StagingBlock> staging_blocks;
+	std::vector<BufferCopy> buffer_copies;
+	std::vector<ImageCopy> image_copies;
+
+	Vulkan::BufferHandle allocate_staging(VkDeviceSize size, VkDeviceSize &offset, const void *data)
+	{
+		// 16 bytes covers the alignment requirements for buffer to image copies of any uncompressed format.
+		VkDeviceSize aligned_size = (size + 15) & ~VkDeviceSize(15);
+
+		StagingBlock *block = nullptr;
+		if (!staging_blocks.empty())
+		{
+			auto &last = staging_blocks.back();
+			if (last.offset + aligned_size <= last.size)
+				block = &last;
+		}
+
+		// Start a new block if the current one is full.
+		// Allocations which are larger than a block get a block to themselves.
+		if (!block)
+		{
+			Vulkan::BufferCreateInfo info;
+			info.size = std::max(staging_block_size, aligned_size);
+			info.domain = Vulkan::BufferDomain::Host;
+			info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+
+			StagingBlock new_block;
+			new_block.buffer = device.create_buffer(info);
+			new_block.mapped = static_cast<uint8_t *>(device.map_host_buffer(*new_block.buffer, Vulkan::MEMORY_ACCESS_WRITE_BIT));
+			new_block.offset = 0;
+			new_block.size = info.size;
+			staging_blocks.push_back(std::move(new_block));
+			block = &staging_blocks.back();
+		}
+
+		offset = block->offset;
+		memcpy(block->mapped + offset, data, size);
+		block->offset += aligned_size;
+		return block->buffer;
+	}
+};
+
+static const unsigned NumMeshes = 20000;
+static const unsigned NumTextures = 256;
+static const unsigned VerticesPerMesh = 24;
+static const unsigned TextureSize = 64;
+
+struct Vertex
+{
+	float position[4];
+	float color[4];
+};
+
+int main()
+{
+	// See sample 01.
+	if (!Vulkan::Context::init_loader(nullptr))
+	{
+		LOGE("Failed to create loader!\n");
+		return 1;
+	}
+
+	Vulkan::Context context;
+	if (!context.init_instance_and_device(nullptr, 0, nullptr, 0))
+	{
+		LOGE("Failed to create VkInstance and VkDevice.\n");
+		return 1;
+	}
+
+	Vulkan::Device device;
+	device.set_context(context);
+	////
+
+	std::vector<Vertex> vertices(VerticesPerMesh);
+	for (unsigned i = 0; i < VerticesPerMesh; i++)
+	{
+		float f = float(i) / VerticesPerMesh;
+		vertices[i] = { { f, 1.0f - f, 0.0f, 1.0f }, { f, f, f, 1.0f } };
+	}
+
+	std::vector<uint32_t> texels(TextureSize * TextureSize);
+	for (unsigned i = 0; i < texels.size(); i++)
+		texels[i] = (i & 1) ? ~0u : 0xff000000u;
+
+	Vulkan::BufferCreateInfo mesh_info;
+	mesh_info.size = VerticesPerMesh * sizeof(Vertex);
+	mesh_info.domain = Vulkan::BufferDomain::Device;
+	mesh_info.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+
+	Vulkan::ImageCreateInfo texture_info = Vulkan::ImageCreateInfo::immutable_2d_image(TextureSize, TextureSize, VK_FORMAT_R8G8B8A8_UNORM);
+	texture_info.initial_layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+	// One upload per resource, like sample 02.
+	{
+		std::vector<Vulkan::BufferHandle> meshes;
+		std::vector<Vulkan::ImageHandle> textures;
+
+		auto start = std::chrono::steady_clock::now();
+		for (unsigned i = 0; i < NumMeshes; i++)
+			meshes.push_back(device.create_buffer(mesh_info, vertices.data()));
+
+		Vulkan::ImageInitialData initial_data = {};
+		initial_data.data = texels.data();
+		for (unsigned i = 0; i < NumTextures; i++)
+			textures.push_back(device.create_image(texture_info, &initial_data));
+
+		device.wait_idle();
+		auto end = std::chrono::steady_clock::now();
+
+		LOGI("Separate uploads: %u meshes and %u textures in %.3f ms.\n", NumMeshes, NumTextures,
+		     std::chrono::duration<double, std::milli>(end - start).count());
+	}
+
+	// Batched.
+	{
+		std::vector<Vulkan::BufferHandle> meshes;
+		std::vector<Vulkan::ImageHandle> textures;
+
+		auto start = std::chrono::steady_clock::now();
+		BatchUploader uploader(device);
+		for (unsigned i = 0; i < NumMeshes; i++)
+			meshes.push_back(uploader.create_buffer(mesh_info, vertices.data()));
+		for (unsigned i = 0; i < NumTextures; i++)
+			textures.push_back(uploader.create_image(texture_info, texels.data(), texels.size() * sizeof(uint32_t)));
+
+		Vulkan::Fence fence;
+		uploader.flush(&fence, nullptr);
+		fence->wait();
+		auto end = std::chrono::steady_clock::now();
+
+		LOGI("Batched uploads: %u meshes and %u textures in %.3f ms.\n", NumMeshes, NumTextures,
+		     std::chrono::duration<double, std::milli>(end - start).count());
+
+		// The meshes and textures can be used on the graphics queue right away, the semaphore takes care of that.
+		device.wait_idle();
+	}
+}
@@ -0,0 +1,649 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "vulkan.hpp"
+#include "device.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <stdio.h>
+
+// Sample 02 uploads images in one go with ImageInitialData.
+// When we have gigabytes of texture data, we cannot afford to stall for all of it, and we cannot afford frame spikes either.
+// Instead we stream textures in over many frames:
+// - Worker threads read image data from disk straight into a persistently mapped staging ring.
+// - Every frame, the main thread submits copies for the data which has arrived on the async transfer queue,
+//   up to a bandwidth budget, so frame times stay stable while loading.
+// - Mip levels are streamed from the smallest to the largest. A texture is usable as soon as its smallest mips are resident,
+//   and gets sharper as more data arrives.
+// - Staging ring space is reclaimed when the fence for the copies which read it has signalled.
+
+// A ring buffer in a persistently mapped host buffer.
+// Offsets are virtual and increase monotonically, the physical offset is the virtual offset modulo the ring size.
+class StagingRing
+{
+public:
+	StagingRing(Vulkan::Device &device_, VkDeviceSize size_)
+		: device(device_), size(size_)
+	{
+		Vulkan::BufferCreateInfo info;
+		info.size = size;
+		info.domain = Vulkan::BufferDomain::Host;
+		info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+		buffer = device.create_buffer(info);
+		mapped = static_cast<uint8_t *>(device.map_host_buffer(*buffer, Vulkan::MEMORY_ACCESS_WRITE_BIT));
+	}
+
+	~StagingRing()
+	{
+		device.unmap_host_buffer(*buffer, Vulkan::MEMORY_ACCESS_WRITE_BIT);
+	}
+
+	// Returns false if there is not enough space right now.
+	// The returned handle identifies the allocation in set_fence().
+	bool allocate(VkDeviceSize alloc_size, VkDeviceSize &offset, VkDeviceSize &handle)
+	{
+		alloc_size = (alloc_size + 15) & ~VkDeviceSize(15);
+		if (alloc_size > size)
+			return false;
+
+		// Allocations do not straddle the end of the ring. Skip to the start instead.
+		VkDeviceSize physical = write_pos % size;
+		VkDeviceSize padding = physical + alloc_size > size ? size - physical : 0;
+
+		if (write_pos + padding + alloc_size - read_pos > size)
+			return false;
+
+		offset = (write_pos + padding) % size;
+		write_pos += padding + alloc_size;
+		handle = write_pos;
+		allocations.push_back({ write_pos, {}, false });
+		return true;
+	}
+
+	// The allocation is released once the fence signals.
+	void set_fence(VkDeviceSize handle, const Vulkan::Fence &fence)
+	{
+		for (auto &allocation : allocations)
+		{
+			if (allocation.end == handle)
+			{
+				allocation.fence = fence;
+				break;
+			}
+		}
+	}
+
+	// The allocation is released without the GPU ever reading it, e.g. because the read failed.
+	void release(VkDeviceSize handle)
+	{
+		for (auto &allocation : allocations)
+		{
+			if (allocation.end == handle)
+			{
+				allocation.released = true;
+				break;
+			}
+		}
+	}
+
+	// Allocations are released in order, so an allocation which is waiting for its data
+	// holds back everything which was allocated after it.
+	void reclaim()
+	{
+		while (!allocations.empty() &&
+		       (allocations.front().released ||
+		        (allocations.front().fence && allocations.front().fence->wait_timeout(0))))
+		{
+			read_pos = allocations.front().end;
+			allocations.pop_front();
+		}
+	}
+
+	uint8_t *get_mapped() const
+	{
+		return mapped;
+	}
+
+	const Vulkan::Buffer &get_buffer() const
+	{
+		return *buffer;
+	}
+
+private:
+	Vulkan::Device &device;
+	Vulkan::BufferHandle buffer;
+	uint8_t *mapped;
+	VkDeviceSize size;
+	VkDeviceSize write_pos = 0;
+	VkDeviceSize read_pos = 0;
+
+	struct Allocation
+	{
+		VkDeviceSize end;
+		Vulkan::Fence fence;
+		bool released;
+	};
+	std::deque<Allocation> allocations;
+};
+
+struct StreamedTexture
+{
+	Vulkan::ImageHandle image;
+	std::vector<VkDeviceSize> level_offsets;
+	std::vector<VkDeviceSize> level_sizes;
+
+	// A view of the resident levels. Empty until the smallest level is resident.
+	Vulkan::ImageViewHandle view;
+
+	// Levels [resident_level, levels) are resident and can be sampled.
+	unsigned resident_level = 0;
+	// Levels [requested_level, levels) have been requested.
+	unsigned requested_level = 0;
+	// Reads complete out of order, so a larger level can land before a smaller one.
+	uint32_t completed_levels = 0;
+	// A level could not be read. The texture stays at whatever levels are resident.
+	bool failed = false;
+};
+
+// fseek() takes a long, which is 32 bits on Windows and 32-bit Linux, so archives larger than 2 GiB need the 64-bit variants.
+// On 32-bit Linux, off_t is only 64 bits with _FILE_OFFSET_BITS=64.
+static bool seek_file(FILE *file, uint64_t offset)
+{
+#ifdef _WIN32
+	return _fseeki64(file, int64_t(offset), SEEK_SET) == 0;
+#else
+	return fseeko(file, off_t(offset), SEEK_SET) == 0;
+#endif
+}
+
+class TextureStreamer
+{
+public:
+	TextureStreamer(Vulkan::Device &device_, const char *path_, VkDeviceSize ring_size, unsigned num_threads)
+		: device(device_), ring(device_, ring_size), path(path_)
+	{
+		for (unsigned i = 0; i < num_threads; i++)
+			workers.emplace_back(&TextureStreamer::worker_loop, this);
+	}
+
+	~TextureStreamer()
+	{
+		{
+			std::lock_guard<std::mutex> holder{lock};
+			dead = true;
+		}
+		cond.notify_all();
+		for (auto &worker : workers)
+			worker.join();
+	}
+
+	unsigned add_texture(StreamedTexture texture)
+	{
+		texture.resident_level = texture.image->get_create_info().levels;
+		texture.requested_level = texture.resident_level;
+		textures.push_back(std::move(texture));
+		return unsigned(textures.size() - 1);
+	}
+
+	const StreamedTexture &get_texture(unsigned index) const
+	{
+		return textures[index];
+	}
+
+	// Textures which failed to stream count as done, they will not get any further.
+	bool is_complete() const
+	{
+		return std::all_of(textures.begin(), textures.end(), [](const StreamedTexture &texture) {
+			return texture.resident_level == 0 || texture.failed;
+		});
+	}
+
+	// Call once per frame.
+	void update(VkDeviceSize budget)
+	{
+		ring.reclaim();
+		retire_batches();
+		submit_completed_reads();
+		issue_reads(budget);
+	}
+
+private:
+	Vulkan::Device &device;
+	StagingRing ring;
+	const char *path;
+	std::vector<StreamedTexture> textures;
+
+	struct Job
+	{
+		unsigned texture;
+		unsigned level;
+		VkDeviceSize file_offset;
+		VkDeviceSize size;
+		VkDeviceSize staging_offset;
+		VkDeviceSize staging_handle;
+		unsigned attempts;
+		bool ok;
+	};
+
+	// Reads can fail transiently, e.g. on network drives. Try a few times before giving up on the texture.
+	enum { MaxReadAttempts = 3 };
+
+	std::vector<std::thread> workers;
+	std::mutex lock;
+	std::condition_variable cond;
+	std::deque<Job> queued_reads;
+	std::vector<Job> completed_reads;
+	bool dead = false;
+
+	struct Batch
+	{
+		Vulkan::Fence fence;
+		std::vector<Job> jobs;
+	};
+	std::deque<Batch> pending_batches;
+
+	void worker_loop()
+	{
+		// Every worker has its own file handle, so reads don't serialize on a shared file position.
+		// With memory mapped files, this would be a memcpy from the mapping instead.
+		FILE *file = fopen(path, "rb");
+
+		for (;;)
+		{
+			Job job;
+			{
+				std::unique_lock<std::mutex> holder{lock};
+				cond.wait(holder, [this]() { return dead || !queued_reads.empty(); });
+				if (dead)
+					break;
+				job = queued_reads.front();
+				queued_reads.pop_front();
+			}
+
+			job.attempts++;
+			job.ok = file &&
+			         seek_file(file, job.file_offset) &&
+			         fread(ring.get_mapped() + job.staging_offset, 1, job.size, file) == job.size;
+
+			std::lock_guard<std::mutex> holder{lock};
+			completed_reads.push_back(job);
+		}
+
+		if (file)
+			fclose(file);
+	}
+
+	// Reads are issued smallest mip level first, round-robin across textures,
+	// so every texture becomes usable at low resolution before any texture gets its full resolution.
+	void issue_reads(VkDeviceSize budget)
+	{
+		VkDeviceSize issued = 0;
+		bool progress = true;
+
+		while (progress && issued < budget)
+		{
+			progress = false;
+
+			// Pick the texture which is the furthest behind.
+			StreamedTexture *best = nullptr;
+			unsigned best_index = 0;
+			for (unsigned i = 0; i < textures.size(); i++)
+			{
+				auto &texture = textures[i];
+				if (texture.requested_level == 0 || texture.failed)
+					continue;
+				if (!best || texture.requested_level > best->requested_level)
+				{
+					best = &texture;
+					best_index = i;
+				}
+			}
+
+			if (!best)
+				break;
+
+			unsigned level = best->requested_level - 1;
+			Job job = {};
+			job.texture = best_index;
+			job.level = level;
+			job.file_offset = best->level_offsets[level];
+			job.size = best->level_sizes[level];
+
+			if (!ring.allocate(job.size, job.staging_offset, job.staging_handle))
+				break;
+
+			{
+				std::lock_guard<std::mutex> holder{lock};
+				queued_reads.push_back(job);
+			}
+			cond.notify_one();
+
+			best->requested_level = level;
+			issued += job.size;
+			progress = true;
+		}
+	}
+
+	void submit_completed_reads()
+	{
+		std::vector<Job> completed;
+		{
+			std::lock_guard<std::mutex> holder{lock};
+			completed.swap(completed_reads);
+		}
+
+		// Failed reads never get copied, or their levels would be marked resident with garbage in them.
+		std::vector<Job> jobs;
+		for (auto &job : completed)
+		{
+			if (job.ok)
+			{
+				jobs.push_back(job);
+			}
+			else if (job.attempts < MaxReadAttempts)
+			{
+				// The staging space is still ours, so just read into it again.
+				{
+					std::lock_guard<std::mutex> holder{lock};
+					queued_reads.push_back(job);
+				}
+				cond.notify_one();
+			}
+			else
+			{
+				LOGE("Failed to read level %u of texture %u after %u attempts, giving up on it.\n",
+				     job.level, job.texture, job.attempts);
+				ring.release(job.staging_handle);
+				textures[job.texture].failed = true;
+			}
+		}
+
+		if (jobs.empty())
+			return;
+
+		auto cmd = device.request_command_buffer(Vulkan::CommandBuffer::Type::AsyncTransfer);
+
+		// Same idea as sample 24, one barrier before and one after all the copies.
+		std::vector<VkImageMemoryBarrier> barriers;
+		for (auto &job : jobs)
+		{
+			VkImageMemoryBarrier barrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
+			barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+			barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+			barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+			barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+			barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+			barrier.image = textures[job.texture].image->get_image();
+			barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, job.level, 1, 0, 1 };
+			barriers.push_back(barrier);
+		}
+
+		cmd->barrier(VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+		             0, nullptr, 0, nullptr, unsigned(barriers.size()), barriers.data());
+
+		for (auto &job : jobs)
+		{
+			auto &image = *textures[job.texture].image;
+			auto &info = image.get_create_info();
+			cmd->copy_buffer_to_image(image, ring.get_buffer(), job.staging_offset, {},
+			                          { std::max(info.width >> job.level, 1u), std::max(info.height >> job.level, 1u), 1 },
+			                          0, 0, { VK_IMAGE_ASPECT_COLOR_BIT, job.level, 0, 1 });
+		}
+
+		for (auto &barrier : barriers)
+		{
+			barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+			barrier.dstAccessMask = 0;
+			barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+			barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		}
+
+		cmd->barrier(VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+		             0, nullptr, 0, nullptr, unsigned(barriers.size()), barriers.data());
+
+		Batch batch;
+		Vulkan::Semaphore sem;
+		device.submit(cmd, &batch.fence, 1, &sem);
+		device.add_wait_semaphore(Vulkan::CommandBuffer::Type::Generic, sem, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, true);
+
+		for (auto &job : jobs)
+			ring.set_fence(job.staging_handle, batch.fence);
+		batch.jobs = std::move(jobs);
+		pending_batches.push_back(std::move(batch));
+	}
+
+	// Once the copies have completed, the levels can be sampled.
+	void retire_batches()
+	{
+		while (!pending_batches.empty() && pending_batches.front().fence->wait_timeout(0))
+		{
+			for (auto &job : pending_batches.front().jobs)
+			{
+				auto &texture = textures[job.texture];
+				texture.completed_levels |= 1u << job.level;
+
+				unsigned resident_level = texture.resident_level;
+				while (resident_level > 0 && (texture.completed_levels & (1u << (resident_level - 1))))
+					resident_level--;
+
+				if (resident_level != texture.resident_level)
+				{
+					texture.resident_level = resident_level;
+
+					// Sampling is clamped to the resident levels with a view.
+					// A real renderer could also use minLod in the sampler, or pass the resident level to the shader.
+					Vulkan::ImageViewCreateInfo view_info;
+					view_info.image = texture.image.get();
+					view_info.format = texture.image->get_create_info().format;
+					view_info.base_level = resident_level;
+					view_info.levels = texture.image->get_create_info().levels - resident_level;
+					view_info.base_layer = 0;
+					view_info.layers = 1;
+					texture.view = device.create_image_view(view_info);
+				}
+			}
+			pending_batches.pop_front();
+		}
+	}
+};
+
+static const uint32_t gbuffer_vert[] =
+#include "shaders/gbuffer.vert.inc"
+;
+
+static const uint32_t texture_frag[] =
+#include "shaders/texture.frag.inc"
+;
+
+static const unsigned NumTextures = 32;
+static const unsigned TextureSize = 1024;
+static const unsigned NumLevels = 11;
+static const VkDeviceSize RingSize = 32 * 1024 * 1024;
+static const VkDeviceSize BudgetPerFrame = 4 * 1024 * 1024;
+
+static VkDeviceSize level_size(unsigned level)
+{
+	unsigned dim = std::max(TextureSize >> level, 1u);
+	return VkDeviceSize(dim) * dim * sizeof(uint32_t);
+}
+
+// Stand-in for a real texture archive. Every level of every texture gets its own color.
+static bool generate_texture_file(const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	if (file)
+	{
+		fclose(file);
+		return true;
+	}
+
+	LOGI("Generating %s ...\n", path);
+	file = fopen(path, "wb");
+	if (!file)
+		return false;
+
+	std::vector<uint32_t> texels(TextureSize * TextureSize);
+	for (unsigned texture = 0; texture < NumTextures; texture++)
+	{
+		for (unsigned level = 0; level < NumLevels; level++)
+		{
+			uint32_t color = 0xff000000u | ((texture * 8u) << 16) | ((level * 24u) << 8) | (255u - level * 24u);
+			size_t count = size_t(level_size(level) / sizeof(uint32_t));
+			std::fill(texels.begin(), texels.begin() + count, color);
+			if (fwrite(texels.data(), sizeof(uint32_t), count, file) != count)
+			{
+				fclose(file);
+				return false;
+			}
+		}
+	}
+
+	fclose(file);
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = argc > 1 ? argv[1] : "25_texture_streaming.bin";
+	if (!generate_texture_file(path))
+	{
+		LOGE("Failed to generate %s.\n", path);
+		return 1;
+	}
+
+	// See sample 01.
+	if (!Vulkan::Context::init_loader(nullptr))
+	{
+		LOGE("Failed to create loader!\n");
+		return 1;
+	}
+
+	Vulkan::Context context;
+	if (!context.init_instance_and_device(nullptr, 0, nullptr, 0))
+	{
+		LOGE("Failed to create VkInstance and VkDevice.\n");
+		return 1;
+	}
+
+	Vulkan::Device device;
+	device.set_context(context);
+	////
+
+	Vulkan::Program *prog = device.request_program(
+			device.request_shader(gbuffer_vert, sizeof(gbuffer_vert)),
+			device.request_shader(texture_frag, sizeof(texture_frag)));
+
+	unsigned num_threads = std::max(1u, std::min(std::thread::hardware_concurrency(), 4u));
+	TextureStreamer streamer(device, path, RingSize, num_threads);
+
+	Vulkan::ImageCreateInfo info = Vulkan::ImageCreateInfo::immutable_2d_image(TextureSize, TextureSize, VK_FORMAT_R8G8B8A8_UNORM);
+	info.levels = NumLevels;
+	info.initial_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+	// Written on the transfer queue and read on the graphics queue, see sample 24.
+	info.misc = Vulkan::IMAGE_MISC_CONCURRENT_QUEUE_GRAPHICS_BIT | Vulkan::IMAGE_MISC_CONCURRENT_QUEUE_ASYNC_TRANSFER_BIT;
+
+	VkDeviceSize file_offset = 0;
+	std::vector<unsigned> textures;
+	for (unsigned i = 0; i < NumTextures; i++)
+	{
+		StreamedTexture texture;
+		texture.image = device.create_image(info);
+		for (unsigned level = 0; level < NumLevels; level++)
+		{
+			texture.level_offsets.push_back(file_offset);
+			texture.level_sizes.push_back(level_size(level));
+			file_offset += level_size(level);
+		}
+		textures.push_back(streamer.add_texture(std::move(texture)));
+	}
+
+	double total_frame_ms = 0.0;
+	double max_frame_ms = 0.0;
+	unsigned frame = 0;
+	auto start = std::chrono::steady_clock::now();
+
+	while (!streamer.is_complete())
+	{
+		auto frame_start = std::chrono::steady_clock::now();
+
+		streamer.update(BudgetPerFrame);
+
+		auto cmd = device.request_command_buffer();
+		Vulkan::RenderPassInfo rp;
+		rp.num_color_attachments = 1;
+		rp.color_attachments[0] = &device.get_transient_attachment(256, 256, VK_FORMAT_R8G8B8A8_UNORM);
+		rp.clear_attachments = 1 << 0;
+		cmd->begin_render_pass(rp);
+		cmd->set_program(prog);
+		cmd->set_opaque_state();
+
+		// Textures are drawn with whatever levels are resident.
+		for (auto index : textures)
+		{
+			auto &texture = streamer.get_texture(index);
+			if (texture.view)
+			{
+				cmd->set_texture(2, 0, *texture.view, Vulkan::StockSampler::TrilinearClamp);
+				cmd->draw(3);
+			}
+		}
+
+		cmd->end_render_pass();
+		device.submit(cmd);
+		device.next_frame_context();
+
+		auto frame_end = std::chrono::steady_clock::now();
+		double frame_ms = std::chrono::duration<double, std::milli>(frame_end - frame_start).count();
+		total_frame_ms += frame_ms;
+		max_frame_ms = std::max(max_frame_ms, frame_ms);
+
+		if ((++frame % 64) == 0)
+		{
+			unsigned complete = 0;
+			for (auto index : textures)
+				if (streamer.get_texture(index).resident_level == 0)
+					complete++;
+			LOGI("Frame %u: %u / %u textures at full resolution.\n", frame, complete, NumTextures);
+		}
+	}
+
+	auto end = std::chrono::steady_clock::now();
+	LOGI("Streamed %llu MiB in %u frames, %.3f ms.\n",
+	     static_cast<unsigned long long>(file_offset >> 20), frame,
+	     std::chrono::duration<double, std::milli>(end - start).count());
+	LOGI("Frame time: %.3f ms average, %.3f ms worst.\n", total_frame_ms / std::max(frame, 1u), max_frame_ms);
+
+	unsigned num_failed = 0;
+	for (auto index : textures)
+		if (streamer.get_texture(index).failed)
+			num_failed++;
+	if (num_failed)
+		LOGE("%u / %u textures failed to stream in completely.\n", num_failed, NumTextures);
+
+	device.wait_idle();
+}
@@ -0,0 +1,422 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "vulkan.hpp"
+#include "device.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <vector>
+#include <chrono>
+
+// Sample 02 creates an image with IMAGE_MISC_GENERATE_MIPS_BIT.
+// Mips are then generated with a chain of blits, one level at a time, with a pipeline barrier between every level.
+// For a single image that's fine, but when loading hundreds of textures, we end up with hundreds of tiny
+// command buffers, each with a barrier per level, and the GPU spends most of its time waiting on barriers.
+
+// Here we batch mip generation for many images into one command buffer.
+// - Blit path: Level N is blitted for every image, then one barrier covers all the images, then level N + 1, and so on.
+//   The number of barriers depends on the number of levels, not the number of images.
+// - Compute path: A compute shader (shaders/mipgen.comp) generates three levels per dispatch,
+//   using shared memory to reduce within a workgroup. This cuts the number of barriers by another 3x.
+//   The image needs to support storage, which most UNORM formats do, but SRGB formats don't,
+//   so the path can be selected per image.
+
+enum class MipMethod
+{
+	Blit,
+	Compute
+};
+
+static const uint32_t mipgen_comp[] =
+#include "shaders/mipgen.comp.inc"
+;
+
+class MipGenerator
+{
+public:
+	explicit MipGenerator(Vulkan::Device &device_)
+		: device(device_)
+	{
+		program = device.request_program(device.request_shader(mipgen_comp, sizeof(mipgen_comp)));
+	}
+
+	// The image must be created with initial layout UNDEFINED.
+	// Level 0 is copied from the staging buffer, and the rest of the levels are generated.
+	// Usage must include TRANSFER_DST, and TRANSFER_SRC or STORAGE depending on the method.
+	// Once the command buffer has executed, the image is in SHADER_READ_ONLY_OPTIMAL.
+	void add_image(Vulkan::ImageHandle image, Vulkan::BufferHandle staging, VkDeviceSize staging_offset, MipMethod method)
+	{
+		if (method == MipMethod::Compute && !supports_compute(image->get_create_info()))
+			method = MipMethod::Blit;
+
+		Entry entry;
+		entry.image = std::move(image);
+		entry.staging = std::move(staging);
+		entry.staging_offset = staging_offset;
+		entry.method = method;
+		entries.push_back(std::move(entry));
+	}
+
+	// Returns the number of pipeline barriers recorded.
+	unsigned record(Vulkan::CommandBuffer &cmd)
+	{
+		unsigned num_barriers = 0;
+		unsigned max_levels = 0;
+		for (auto &entry : entries)
+			max_levels = std::max(max_levels, entry.image->get_create_info().levels);
+
+		std::vector<VkImageMemoryBarrier> barriers;
+
+		// Every level of every image goes to TRANSFER_DST, so we can copy level 0, and blit into the other levels.
+		for (auto &entry : entries)
+			barriers.push_back(image_barrier(*entry.image, 0, entry.image->get_create_info().levels,
+			                                 VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+			                                 0, VK_ACCESS_TRANSFER_WRITE_BIT));
+		flush_barriers(cmd, barriers, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, num_barriers);
+
+		for (auto &entry : entries)
+		{
+			auto &info = entry.image->get_create_info();
+			cmd.copy_buffer_to_image(*entry.image, *entry.staging, entry.staging_offset, {},
+			                         { info.width, info.height, 1 }, 0, 0, { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 });
+		}
+
+		// Blit images read from level 0 with a blit, compute images sample level 0 and write the rest as storage images.
+		for (auto &entry : entries)
+		{
+			if (entry.method == MipMethod::Blit)
+			{
+				barriers.push_back(image_barrier(*entry.image, 0, 1,
+				                                 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+				                                 VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT));
+			}
+			else
+			{
+				barriers.push_back(image_barrier(*entry.image, 0, entry.image->get_create_info().levels,
+				                                 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL,
+				                                 VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT));
+			}
+		}
+		flush_barriers(cmd, barriers, VK_PIPELINE_STAGE_TRANSFER_BIT,
+		               VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, num_barriers);
+
+		record_blits(cmd, max_levels, barriers, num_barriers);
+		record_compute(cmd, max_levels, num_barriers);
+
+		// Everything goes to SHADER_READ_ONLY_OPTIMAL in one go.
+		for (auto &entry : entries)
+		{
+			unsigned levels = entry.image->get_create_info().levels;
+			if (entry.method == MipMethod::Blit)
+			{
+				// The last level was never blitted from, so it's still in TRANSFER_DST,
+				// unless there is only one level.
+				if (levels > 1)
+				{
+					barriers.push_back(image_barrier(*entry.image, 0, levels - 1,
+					                                 VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+					                                 0, VK_ACCESS_SHADER_READ_BIT));
+				}
+				barriers.push_back(image_barrier(*entry.image, levels - 1, 1,
+				                                 levels > 1 ? VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL : VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+				                                 VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+				                                 VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT));
+			}
+			else
+			{
+				barriers.push_back(image_barrier(*entry.image, 0, levels,
+				                                 VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+				                                 VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT));
+			}
+		}
+		flush_barriers(cmd, barriers, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		               VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, num_barriers);
+
+		entries.clear();
+		return num_barriers;
+	}
+
+private:
+	Vulkan::Device &device;
+	Vulkan::Program *program;
+
+	struct Entry
+	{
+		Vulkan::ImageHandle image;
+		Vulkan::BufferHandle staging;
+		VkDeviceSize staging_offset;
+		MipMethod method;
+	};
+	std::vector<Entry> entries;
+
+	bool supports_compute(const Vulkan::ImageCreateInfo &info) const
+	{
+		if ((info.usage & VK_IMAGE_USAGE_STORAGE_BIT) == 0)
+			return false;
+
+		// The shader declares rgba8 for the storage images.
+		if (info.format != VK_FORMAT_R8G8B8A8_UNORM)
+			return false;
+
+		VkFormatProperties props;
+		vkGetPhysicalDeviceFormatProperties(device.get_physical_device(), info.format, &props);
+		return (props.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT) != 0;
+	}
+
+	static VkImageMemoryBarrier image_barrier(const Vulkan::Image &image, unsigned base_level, unsigned levels,
+	                                          VkImageLayout old_layout, VkImageLayout new_layout,
+	                                          VkAccessFlags src_access, VkAccessFlags dst_access)
+	{
+		VkImageMemoryBarrier barrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
+		barrier.srcAccessMask = src_access;
+		barrier.dstAccessMask = dst_access;
+		barrier.oldLayout = old_layout;
+		barrier.newLayout = new_layout;
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.image = image.get_image();
+		barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, base_level, levels, 0, 1 };
+		return barrier;
+	}
+
+	static void flush_barriers(Vulkan::CommandBuffer &cmd, std::vector<VkImageMemoryBarrier> &barriers,
+	                           VkPipelineStageFlags src_stages, VkPipelineStageFlags dst_stages, unsigned &num_barriers)
+	{
+		if (barriers.empty())
+			return;
+
+		cmd.barrier(src_stages, dst_stages, 0, nullptr, 0, nullptr, unsigned(barriers.size()), barriers.data());
+		barriers.clear();
+		num_barriers++;
+	}
+
+	void record_blits(Vulkan::CommandBuffer &cmd, unsigned max_levels,
+	                  std::vector<VkImageMemoryBarrier> &barriers, unsigned &num_barriers)
+	{
+		for (unsigned level = 1; level < max_levels; level++)
+		{
+			for (auto &entry : entries)
+			{
+				auto &info = entry.image->get_create_info();
+				if (entry.method != MipMethod::Blit || level >= info.levels)
+					continue;
+
+				VkOffset3D src_size = { int(std::max(info.width >> (level - 1), 1u)), int(std::max(info.height >> (level - 1), 1u)), 1 };
+				VkOffset3D dst_size = { int(std::max(info.width >> level, 1u)), int(std::max(info.height >> level, 1u)), 1 };
+				cmd.blit_image(*entry.image, *entry.image, {}, dst_size, {}, src_size, level, level - 1);
+
+				// The last level is never read from, the final barrier takes care of it.
+				if (level + 1 < info.levels)
+				{
+					barriers.push_back(image_barrier(*entry.image, level, 1,
+					                                 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+					                                 VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT));
+				}
+			}
+
+			// One barrier for this level of every image.
+			flush_barriers(cmd, barriers, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, num_barriers);
+		}
+	}
+
+	void record_compute(Vulkan::CommandBuffer &cmd, unsigned max_levels, unsigned &num_barriers)
+	{
+		struct Views
+		{
+			Vulkan::Image *image;
+			std::vector<Vulkan::ImageViewHandle> levels;
+		};
+		std::vector<Views> views;
+
+		for (auto &entry : entries)
+		{
+			if (entry.method != MipMethod::Compute)
+				continue;
+
+			// We're sampling and writing to the image in GENERAL layout, so tell the command buffer about it.
+			entry.image->set_layout(Vulkan::Layout::General);
+
+			Views image_views;
+			image_views.image = entry.image.get();
+			auto &info = entry.image->get_create_info();
+			for (unsigned level = 0; level < info.levels; level++)
+			{
+				Vulkan::ImageViewCreateInfo view_info;
+				view_info.image = entry.image.get();
+				view_info.format = info.format;
+				view_info.base_level = level;
+				view_info.levels = 1;
+				view_info.base_layer = 0;
+				view_info.layers = 1;
+				image_views.levels.push_back(device.create_image_view(view_info));
+			}
+			views.push_back(std::move(image_views));
+		}
+
+		if (views.empty())
+			return;
+
+		cmd.set_program(program);
+
+		// Each pass reads input_level and writes the three levels below it.
+		for (unsigned input_level = 0; input_level + 1 < max_levels; input_level += 3)
+		{
+			for (auto &image_views : views)
+			{
+				auto &info = image_views.image->get_create_info();
+				if (input_level + 1 >= info.levels)
+					continue;
+
+				struct Registers
+				{
+					uint32_t output_size[2];
+					uint32_t num_levels;
+				} registers;
+
+				registers.output_size[0] = std::max(info.width >> (input_level + 1), 1u);
+				registers.output_size[1] = std::max(info.height >> (input_level + 1), 1u);
+				registers.num_levels = std::min(3u, info.levels - (input_level + 1));
+
+				cmd.set_texture(0, 0, *image_views.levels[input_level], Vulkan::StockSampler::LinearClamp);
+				for (unsigned i = 0; i < 3; i++)
+				{
+					// Unused outputs still need a valid descriptor, but they are never written to.
+					unsigned output_level = input_level + 1 + std::min(i, registers.num_levels - 1);
+					cmd.set_storage_texture(0, 1 + i, *image_views.levels[output_level]);
+				}
+
+				cmd.push_constants(&registers, 0, sizeof(registers));
+				cmd.dispatch((registers.output_size[0] + 7) / 8, (registers.output_size[1] + 7) / 8, 1);
+			}
+
+			// One barrier for this pass of every image.
+			// The final barrier takes care of the last pass.
+			if (input_level + 4 < max_levels)
+			{
+				cmd.barrier(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+				            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+				num_barriers++;
+			}
+		}
+
+		for (auto &image_views : views)
+			image_views.image->set_layout(Vulkan::Layout::Optimal);
+	}
+};
+
+static const unsigned NumImages = 128;
+static const unsigned ImageSize = 512;
+static const unsigned NumLevels = 10;
+
+int main()
+{
+	// See sample 01.
+	if (!Vulkan::Context::init_loader(nullptr))
+	{
+		LOGE("Failed to create loader!\n");
+		return 1;
+	}
+
+	Vulkan::Context context;
+	if (!context.init_instance_and_device(nullptr, 0, nullptr, 0))
+	{
+		LOGE("Failed to create VkInstance and VkDevice.\n");
+		return 1;
+	}
+
+	Vulkan::Device device;
+	device.set_context(context);
+	////
+
+	std::vector<uint32_t> texels(ImageSize * ImageSize);
+	for (unsigned y = 0; y < ImageSize; y++)
+		for (unsigned x = 0; x < ImageSize; x++)
+			texels[y * ImageSize + x] = ((x ^ y) & 8) ? ~0u : 0xff000000u;
+
+	// One upload and one round of mip generation per image, like sample 02.
+	{
+		Vulkan::ImageCreateInfo info = Vulkan::ImageCreateInfo::immutable_2d_image(ImageSize, ImageSize, VK_FORMAT_R8G8B8A8_UNORM);
+		info.initial_layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		info.levels = 0;
+		info.misc = Vulkan::IMAGE_MISC_GENERATE_MIPS_BIT;
+
+		Vulkan::ImageInitialData initial_data = {};
+		initial_data.data = texels.data();
+
+		std::vector<Vulkan::ImageHandle> images;
+		auto start = std::chrono::steady_clock::now();
+		for (unsigned i = 0; i < NumImages; i++)
+			images.push_back(device.create_image(info, &initial_data));
+		device.wait_idle();
+		auto end = std::chrono::steady_clock::now();
+
+		LOGI("IMAGE_MISC_GENERATE_MIPS_BIT: %u images in %.3f ms.\n", NumImages,
+		     std::chrono::duration<double, std::milli>(end - start).count());
+	}
+
+	// All the images have the same level 0 here, so they can share the staging data.
+	Vulkan::BufferCreateInfo staging_info;
+	staging_info.size = texels.size() * sizeof(uint32_t);
+	staging_info.domain = Vulkan::BufferDomain::Host;
+	staging_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+	auto staging = device.create_buffer(staging_info, texels.data());
+
+	MipGenerator generator(device);
+
+	for (auto method : { MipMethod::Blit, MipMethod::Compute })
+	{
+		Vulkan::ImageCreateInfo info = Vulkan::ImageCreateInfo::immutable_2d_image(ImageSize, ImageSize, VK_FORMAT_R8G8B8A8_UNORM);
+		info.initial_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+		info.levels = NumLevels;
+		info.usage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_STORAGE_BIT;
+
+		std::vector<Vulkan::ImageHandle> images;
+		auto start = std::chrono::steady_clock::now();
+
+		for (unsigned i = 0; i < NumImages; i++)
+		{
+			images.push_back(device.create_image(info));
+			generator.add_image(images.back(), staging, 0, method);
+		}
+
+		auto cmd = device.request_command_buffer();
+		auto start_ts = cmd->write_timestamp(VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT);
+		unsigned num_barriers = generator.record(*cmd);
+		auto end_ts = cmd->write_timestamp(VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+		device.submit(cmd);
+		device.wait_idle();
+
+		auto end = std::chrono::steady_clock::now();
+
+		// See sample 20 for more about timestamps.
+		double gpu_ms = 0.0;
+		if (start_ts->is_signalled() && end_ts->is_signalled())
+		{
+			gpu_ms = double(end_ts->get_timestamp() - start_ts->get_timestamp()) *
+			         device.get_gpu_properties().limits.timestampPeriod * 1e-6;
+		}
+
+		LOGI("Batched %s: %u images in %.3f ms, %.3f ms on GPU, %u barriers.\n",
+		     method == MipMethod::Blit ? "blits" : "compute",
+		     NumImages, std::chrono::duration<double, std::milli>(end - start).count(), gpu_ms, num_barriers);
+	}
+}
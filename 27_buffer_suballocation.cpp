@@ -0,0 +1,310 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "vulkan.hpp"
+#include "device.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <string.h>
+
+// Sample 02 creates a VkBuffer and a memory allocation for every buffer, even if it's just 64 bytes.
+// With hundreds of thousands of small buffers, creation, destruction and memory allocation become expensive,
+// and some drivers have a limited number of VkBuffers they can deal with efficiently.
+// Here, small buffers are carved out of large shared VkBuffers instead, and a small buffer is just a buffer + offset.
+// Every API in Granite which takes a buffer also takes an offset, so the slices can be used directly:
+// - cmd->set_vertex_binding(binding, *slice.buffer, slice.offset, stride)
+// - cmd->set_index_buffer(*slice.buffer, slice.offset, index_type)
+// - cmd->set_uniform_buffer(set, binding, *slice.buffer, slice.offset, slice.size)
+// - cmd->set_storage_buffer(set, binding, *slice.buffer, slice.offset, slice.size)
+// Uniform buffers are bound with dynamic offsets (see sample 17), so slices from the same block share descriptor sets.
+
+struct BufferSlice
+{
+	// The shared buffer. The heap holds the reference.
+	Vulkan::Buffer *buffer = nullptr;
+	VkDeviceSize offset = 0;
+	VkDeviceSize size = 0;
+	// Persistently mapped pointer for host buffers, nullptr otherwise.
+	uint8_t *mapped = nullptr;
+
+	// Used by the heap to free the slice.
+	unsigned size_class = 0;
+};
+
+// Every block is split into equally sized slots for one size class. Size classes are powers of two.
+// Allocation and freeing is a push or pop on a free list.
+class BufferHeap
+{
+public:
+	enum { MinSizeLog2 = 4, MaxSizeLog2 = 16, NumSizeClasses = MaxSizeLog2 - MinSizeLog2 + 1 };
+
+	BufferHeap(Vulkan::Device &device_, Vulkan::BufferDomain domain_, VkBufferUsageFlags usage_,
+	           VkDeviceSize block_size_ = 4 * 1024 * 1024)
+		: device(device_), domain(domain_), usage(usage_), block_size(block_size_)
+	{
+		auto &limits = device.get_gpu_properties().limits;
+		alignment = std::max<VkDeviceSize>(limits.minUniformBufferOffsetAlignment, limits.minStorageBufferOffsetAlignment);
+	}
+
+	~BufferHeap()
+	{
+		for (auto &block : blocks)
+			if (block.mapped)
+				device.unmap_host_buffer(*block.buffer, Vulkan::MEMORY_ACCESS_WRITE_BIT);
+	}
+
+	// Returns an empty slice if the size is too large for the heap. Use a dedicated buffer for those.
+	BufferSlice allocate(VkDeviceSize size)
+	{
+		unsigned size_class = get_size_class(std::max(size, alignment));
+		if (size_class >= NumSizeClasses)
+			return {};
+
+		auto &free_list = free_slots[size_class];
+		if (free_list.empty())
+			add_block(size_class);
+
+		BufferSlice slice = free_list.back();
+		free_list.pop_back();
+		slice.size = size;
+		return slice;
+	}
+
+	// The GPU might still be using the slice, so it's not reused until retire() has been called
+	// and the fence passed to it has signalled.
+	void free(const BufferSlice &slice)
+	{
+		if (slice.buffer)
+			unretired.push_back(slice);
+	}
+
+	// Slices which have been freed since the last call can be reused once the fence has signalled.
+	// The fence must come from a submission made after the last command buffer which used any of them.
+	// A null fence means the GPU never used them.
+	// We could key this on frame contexts instead, like Granite does, but then the heap would have to keep its own
+	// frame index in sync with the Device's, which the Device doesn't help us with.
+	void retire(Vulkan::Fence fence)
+	{
+		if (unretired.empty())
+			return;
+		pending_free.push_back({ std::move(fence), std::move(unretired) });
+		unretired.clear();
+	}
+
+	// Non-blocking. Call once per frame or so.
+	void reclaim()
+	{
+		while (!pending_free.empty() && (!pending_free.front().fence || pending_free.front().fence->wait_timeout(0)))
+		{
+			for (auto &slice : pending_free.front().slices)
+				free_slots[slice.size_class].push_back(slice);
+			pending_free.pop_front();
+		}
+	}
+
+	unsigned get_num_vk_buffers() const
+	{
+		return unsigned(blocks.size());
+	}
+
+private:
+	Vulkan::Device &device;
+	Vulkan::BufferDomain domain;
+	VkBufferUsageFlags usage;
+	VkDeviceSize block_size;
+	VkDeviceSize alignment;
+
+	struct Block
+	{
+		Vulkan::BufferHandle buffer;
+		uint8_t *mapped;
+	};
+	std::vector<Block> blocks;
+	std::vector<BufferSlice> free_slots[NumSizeClasses];
+	std::vector<BufferSlice> unretired;
+
+	struct PendingFree
+	{
+		Vulkan::Fence fence;
+		std::vector<BufferSlice> slices;
+	};
+	std::deque<PendingFree> pending_free;
+
+	static unsigned get_size_class(VkDeviceSize size)
+	{
+		unsigned size_log2 = MinSizeLog2;
+		while ((VkDeviceSize(1) << size_log2) < size)
+			size_log2++;
+		return size_log2 - MinSizeLog2;
+	}
+
+	void add_block(unsigned size_class)
+	{
+		Vulkan::BufferCreateInfo info;
+		info.size = block_size;
+		info.domain = domain;
+		info.usage = usage;
+
+		Block block;
+		block.buffer = device.create_buffer(info);
+		block.mapped = domain != Vulkan::BufferDomain::Device ?
+		               static_cast<uint8_t *>(device.map_host_buffer(*block.buffer, Vulkan::MEMORY_ACCESS_WRITE_BIT)) :
+		               nullptr;
+
+		VkDeviceSize slot_size = VkDeviceSize(1) << (size_class + MinSizeLog2);
+		auto &free_list = free_slots[size_class];
+
+		// Push in reverse so allocations come out in increasing offset order.
+		for (VkDeviceSize offset = block_size; offset >= slot_size; offset -= slot_size)
+		{
+			BufferSlice slice;
+			slice.buffer = block.buffer.get();
+			slice.offset = offset - slot_size;
+			slice.mapped = block.mapped ? block.mapped + slice.offset : nullptr;
+			slice.size_class = size_class;
+			free_list.push_back(slice);
+		}
+
+		blocks.push_back(std::move(block));
+	}
+};
+
+static const unsigned NumBuffers = 100000;
+static const VkDeviceSize BufferSize = 64;
+
+int main()
+{
+	// See sample 01.
+	if (!Vulkan::Context::init_loader(nullptr))
+	{
+		LOGE("Failed to create loader!\n");
+		return 1;
+	}
+
+	Vulkan::Context context;
+	if (!context.init_instance_and_device(nullptr, 0, nullptr, 0))
+	{
+		LOGE("Failed to create VkInstance and VkDevice.\n");
+		return 1;
+	}
+
+	Vulkan::Device device;
+	device.set_context(context);
+	////
+
+
+	uint8_t data[BufferSize];
+	for (unsigned i = 0; i < BufferSize; i++)
+		data[i] = uint8_t(i);
+
+	for (auto domain : { Vulkan::BufferDomain::Device, Vulkan::BufferDomain::Host })
+	{
+		const char *domain_name = domain == Vulkan::BufferDomain::Device ? "Device" : "Host";
+		const void *initial_data = domain == Vulkan::BufferDomain::Host ? data : nullptr;
+
+		// Device buffers would need a staging upload, which is not what we're measuring here.
+		if (!initial_data)
+		{
+			LOGI("%s: Neither path writes any data, so these numbers are allocation only and can't be compared with Host.\n",
+			     domain_name);
+		}
+
+		// One VkBuffer per buffer, like sample 02.
+		{
+			Vulkan::BufferCreateInfo info;
+			info.size = BufferSize;
+			info.domain = domain;
+			info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+
+			std::vector<Vulkan::BufferHandle> buffers;
+			buffers.reserve(NumBuffers);
+
+			auto start = std::chrono::steady_clock::now();
+			for (unsigned i = 0; i < NumBuffers; i++)
+				buffers.push_back(device.create_buffer(info, initial_data));
+			auto created = std::chrono::steady_clock::now();
+
+			// Destruction is deferred to the frame context. wait_idle() carries it out.
+			buffers.clear();
+			device.wait_idle();
+			auto end = std::chrono::steady_clock::now();
+
+			LOGI("%s, VkBuffer per buffer: create %.3f ms, destroy %.3f ms, %u VkBuffers.\n", domain_name,
+			     std::chrono::duration<double, std::milli>(created - start).count(),
+			     std::chrono::duration<double, std::milli>(end - created).count(),
+			     NumBuffers);
+		}
+
+		// Sub-allocated.
+		{
+			BufferHeap heap(device, domain,
+			                VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+
+			std::vector<BufferSlice> slices;
+			slices.reserve(NumBuffers);
+
+			auto start = std::chrono::steady_clock::now();
+			for (unsigned i = 0; i < NumBuffers; i++)
+			{
+				slices.push_back(heap.allocate(BufferSize));
+				if (initial_data)
+					memcpy(slices.back().mapped, initial_data, BufferSize);
+			}
+			auto created = std::chrono::steady_clock::now();
+
+			// Nothing was submitted which uses the slices, but in a real application this would be the fence
+			// of the last submission which used them. The slots come back once it has signalled.
+			for (auto &slice : slices)
+				heap.free(slice);
+			slices.clear();
+			auto cmd = device.request_command_buffer();
+			Vulkan::Fence fence;
+			device.submit(cmd, &fence);
+			heap.retire(fence);
+			fence->wait();
+			heap.reclaim();
+			auto end = std::chrono::steady_clock::now();
+
+			LOGI("%s, sub-allocated: create %.3f ms, destroy %.3f ms, %u VkBuffers.\n", domain_name,
+			     std::chrono::duration<double, std::milli>(created - start).count(),
+			     std::chrono::duration<double, std::milli>(end - created).count(),
+			     heap.get_num_vk_buffers());
+
+			// A second round reuses the freed slots, and doesn't create any new VkBuffers.
+			start = std::chrono::steady_clock::now();
+			for (unsigned i = 0; i < NumBuffers; i++)
+				slices.push_back(heap.allocate(BufferSize));
+			end = std::chrono::steady_clock::now();
+			LOGI("%s, sub-allocated, recycled: create %.3f ms, %u VkBuffers.\n", domain_name,
+			     std::chrono::duration<double, std::milli>(end - start).count(),
+			     heap.get_num_vk_buffers());
+
+			for (auto &slice : slices)
+				heap.free(slice);
+			heap.retire({});
+			device.wait_idle();
+		}
+	}
+}
@@ -0,0 +1,265 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "intrusive.hpp"
+#include "object_pool.hpp"
+#include "thread_id.hpp"
+#include "util.hpp"
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <chrono>
+#include <stdint.h>
+
+// Sample 02 mentions that handle objects are allocated from object pools, so creating handles never needs to touch the heap
+// in the steady state. When many threads create and destroy handles, a pool protected by a single mutex
+// becomes a contention point, since every allocation and every free takes the lock.
+
+// The classic fix is a magazine allocator:
+// - Every thread has a cache of free objects (a "magazine") which it allocates from and frees into without locking.
+// - Only when a magazine runs empty or full do we go to the shared depot and exchange a whole magazine under the lock.
+// - With 64 objects per magazine, we take the lock at most once per 64 operations, and the common path is a plain array push/pop.
+// Caches are indexed by thread index, the same way Granite indexes per-thread command pools (see sample 18).
+// Objects freed on a different thread than they were allocated on simply end up in that thread's cache.
+
+template <typename T>
+class MagazineObjectPool
+{
+public:
+	enum { MagazineSize = 64 };
+
+	explicit MagazineObjectPool(unsigned num_thread_indices)
+		: num_caches(num_thread_indices)
+	{
+		// std::vector can't be trusted with over-aligned types before C++17, so align the caches by hand.
+		cache_storage.reset(new uint8_t[num_caches * sizeof(ThreadCache) + CacheLineSize - 1]);
+		uintptr_t addr = reinterpret_cast<uintptr_t>(cache_storage.get());
+		addr = (addr + CacheLineSize - 1) & ~uintptr_t(CacheLineSize - 1);
+		caches = reinterpret_cast<ThreadCache *>(addr);
+		for (unsigned i = 0; i < num_caches; i++)
+			new (&caches[i]) ThreadCache();
+	}
+
+	~MagazineObjectPool()
+	{
+		for (unsigned i = 0; i < num_caches; i++)
+			caches[i].~ThreadCache();
+	}
+
+	MagazineObjectPool(const MagazineObjectPool &) = delete;
+	void operator=(const MagazineObjectPool &) = delete;
+
+	template <typename... P>
+	T *allocate(P &&... p)
+	{
+		auto &cache = caches[Util::get_current_thread_index()];
+		if (cache.loaded.count == 0)
+		{
+			if (cache.previous.count != 0)
+				std::swap(cache.loaded, cache.previous);
+			else
+				refill(cache.loaded);
+		}
+
+		T *ptr = cache.loaded.objects[--cache.loaded.count];
+		return new (ptr) T(std::forward<P>(p)...);
+	}
+
+	void free(T *ptr)
+	{
+		ptr->~T();
+
+		auto &cache = caches[Util::get_current_thread_index()];
+		if (cache.loaded.count == MagazineSize)
+		{
+			if (cache.previous.count == 0)
+				std::swap(cache.loaded, cache.previous);
+			else
+			{
+				// Both magazines are full, hand one of them back to the depot.
+				std::lock_guard<std::mutex> holder{lock};
+				full_magazines.push_back(cache.previous);
+				cache.previous = cache.loaded;
+				cache.loaded.count = 0;
+			}
+		}
+
+		cache.loaded.objects[cache.loaded.count++] = ptr;
+	}
+
+private:
+	struct Magazine
+	{
+		T *objects[MagazineSize];
+		unsigned count = 0;
+	};
+
+	// Keeping the two magazines of a thread on their own cache lines avoids false sharing.
+	// alignas(64) alone is not enough, operator new only guarantees alignof(std::max_align_t) before C++17.
+	// Instead, the cache is padded to a whole number of cache lines, and the array is aligned when it's allocated.
+	enum { CacheLineSize = 64 };
+
+	struct ThreadCacheData
+	{
+		Magazine loaded;
+		Magazine previous;
+	};
+
+	struct ThreadCache : ThreadCacheData
+	{
+		uint8_t padding[CacheLineSize - sizeof(ThreadCacheData) % CacheLineSize];
+	};
+	static_assert(sizeof(ThreadCache) % CacheLineSize == 0, "ThreadCache must fill whole cache lines.");
+
+	using Storage = typename std::aligned_storage<sizeof(T), alignof(T)>::type;
+
+	std::unique_ptr<uint8_t[]> cache_storage;
+	ThreadCache *caches = nullptr;
+	unsigned num_caches;
+	std::mutex lock;
+	std::vector<Magazine> full_magazines;
+	std::vector<std::unique_ptr<Storage[]>> blocks;
+
+	void refill(Magazine &magazine)
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		if (!full_magazines.empty())
+		{
+			magazine = full_magazines.back();
+			full_magazines.pop_back();
+			return;
+		}
+
+		// No free objects anywhere, allocate a new block of objects.
+		std::unique_ptr<Storage[]> block(new Storage[MagazineSize]);
+		for (unsigned i = 0; i < MagazineSize; i++)
+			magazine.objects[i] = static_cast<T *>(static_cast<void *>(&block[i]));
+		magazine.count = MagazineSize;
+		blocks.push_back(std::move(block));
+	}
+};
+
+// A stand-in for a handle type like Vulkan::Buffer. The deleter returns the object to the pool it came from,
+// like Granite's handle deleters do.
+template <typename Pool>
+struct PooledResource;
+
+template <typename Pool>
+struct PooledResourceDeleter
+{
+	void operator()(PooledResource<Pool> *resource);
+};
+
+template <typename Pool>
+struct PooledResource : Util::IntrusivePtrEnabled<PooledResource<Pool>, PooledResourceDeleter<Pool>, Util::MultiThreadCounter>
+{
+	PooledResource(Pool &pool_, uint64_t cookie_)
+		: pool(pool_), cookie(cookie_)
+	{
+	}
+
+	Pool &pool;
+	uint64_t cookie;
+	uint8_t payload[48];
+};
+
+template <typename Pool>
+void PooledResourceDeleter<Pool>::operator()(PooledResource<Pool> *resource)
+{
+	resource->pool.free(resource);
+}
+
+// Both pools need to know the resource type, and the resource needs to know the pool type,
+// so tie the knot with a small wrapper.
+struct LockedPool;
+struct CachedPool;
+using LockedResource = PooledResource<LockedPool>;
+using CachedResource = PooledResource<CachedPool>;
+
+struct LockedPool : Util::ThreadSafeObjectPool<LockedResource>
+{
+};
+
+struct CachedPool : MagazineObjectPool<CachedResource>
+{
+	using MagazineObjectPool<CachedResource>::MagazineObjectPool;
+};
+
+static const unsigned MaxThreads = 32;
+static const unsigned IterationsPerThread = 1 << 16;
+static const unsigned LiveHandles = 32;
+
+// Every iteration creates a batch of handles, copies them around a bit, and drops them.
+template <typename Pool>
+static double run_benchmark(Pool &pool, unsigned num_threads)
+{
+	std::vector<std::thread> threads;
+	auto start = std::chrono::steady_clock::now();
+
+	for (unsigned i = 0; i < num_threads; i++)
+	{
+		threads.emplace_back([&pool, i]() {
+			// Thread index 0 is the main thread.
+			Util::register_thread_index(i + 1);
+
+			std::vector<Util::IntrusivePtr<PooledResource<Pool>>> handles;
+			handles.reserve(2 * LiveHandles);
+
+			for (unsigned iter = 0; iter < IterationsPerThread; iter++)
+			{
+				for (unsigned j = 0; j < LiveHandles; j++)
+					handles.emplace_back(pool.allocate(pool, uint64_t(iter) * LiveHandles + j));
+				for (unsigned j = 0; j < LiveHandles; j++)
+					handles.push_back(handles[j]);
+				handles.clear();
+			}
+		});
+	}
+
+	for (auto &thread : threads)
+		thread.join();
+
+	auto end = std::chrono::steady_clock::now();
+	double seconds = std::chrono::duration<double>(end - start).count();
+
+	// One allocation and one free per handle.
+	return 2.0 * double(num_threads) * IterationsPerThread * LiveHandles / seconds;
+}
+
+int main()
+{
+	Util::register_thread_index(0);
+
+	LockedPool locked_pool;
+	CachedPool cached_pool(1 + MaxThreads);
+
+	for (unsigned num_threads = 1; num_threads <= MaxThreads; num_threads *= 2)
+	{
+		double locked_ops = run_benchmark(locked_pool, num_threads);
+		double cached_ops = run_benchmark(cached_pool, num_threads);
+		LOGI("%2u threads: mutex pool %8.2f Mops/s, magazine pool %8.2f Mops/s (%.2fx).\n",
+		     num_threads, locked_ops * 1e-6, cached_ops * 1e-6, cached_ops / locked_ops);
+	}
+}
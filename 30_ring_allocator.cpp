@@ -0,0 +1,425 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "vulkan.hpp"
+#include "device.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <string.h>
+
+// Sample 07 uses the linear allocators in the command buffer, i.e. allocate_vertex_data() and friends.
+// Those are backed by a pool of fixed-size buffers per type. Once a buffer is exhausted, it's parked in the frame context
+// until the frame context comes around again. This is great for small and frequent allocations,
+// but if we push tens of MB of CPU particle data every frame, we keep cycling through blocks,
+// and we end up holding on to a lot more memory than we need.
+
+// Here's an alternative backend: a ring buffer which is shared by all frames in flight.
+// - Allocations bump a head offset. If we run into the end of the buffer, we wrap around.
+// - When a frame context is recycled, the tail is moved to where that frame ended. Everything before it is free.
+// - If the ring is full, we fall back to overflow blocks which are released when the frame context is recycled.
+// - The ring is resized based on the high-water mark of the last N frames,
+//   so a steady workload ends up never touching the overflow path.
+// The allocations are just buffer + offset, and can be bound directly, e.g.:
+// - cmd->set_vertex_binding(binding, *alloc.buffer, alloc.offset, stride)
+// - cmd->set_index_buffer(*alloc.buffer, alloc.offset, index_type)
+// - cmd->set_uniform_buffer(set, binding, *alloc.buffer, alloc.offset, size)
+
+struct RingAllocation
+{
+	Vulkan::Buffer *buffer = nullptr;
+	VkDeviceSize offset = 0;
+	// Persistently mapped pointer. Write the data before submitting the command buffer.
+	uint8_t *host = nullptr;
+};
+
+struct RingAllocatorStats
+{
+	VkDeviceSize bytes_allocated = 0;
+	// Number of blocks which had to be touched. The ring counts as one block per frame.
+	unsigned blocks_consumed = 0;
+	// Space at the end of the ring or an overflow block we had to skip because an allocation did not fit.
+	VkDeviceSize wasted_tail_bytes = 0;
+	unsigned overflow_blocks = 0;
+	unsigned resizes = 0;
+};
+
+class RingAllocator
+{
+public:
+	enum { HistoryFrames = 16 };
+
+	RingAllocator(Vulkan::Device &device_, VkBufferUsageFlags usage_, VkDeviceSize alignment_,
+	              unsigned num_frame_contexts_, VkDeviceSize initial_frame_size = 64 * 1024)
+		: device(device_), usage(usage_), alignment(alignment_),
+		  num_frame_contexts(num_frame_contexts_),
+		  frame_end(num_frame_contexts_), overflow(num_frame_contexts_)
+	{
+		resize(next_pow2(initial_frame_size * num_frame_contexts));
+	}
+
+	~RingAllocator()
+	{
+		unmap();
+	}
+
+	RingAllocation allocate(VkDeviceSize size)
+	{
+		frame_stats.bytes_allocated += size;
+		frame_bytes += size;
+
+		VkDeviceSize offset = align(head);
+		VkDeviceSize physical = offset & (capacity - 1);
+		VkDeviceSize waste = offset - head;
+
+		// Never split an allocation across the end of the ring, skip to the start instead.
+		if (physical + size > capacity)
+		{
+			waste += capacity - physical;
+			offset += capacity - physical;
+			physical = 0;
+		}
+
+		if (offset + size - tail <= capacity)
+		{
+			if (head == frame_start)
+				frame_stats.blocks_consumed++;
+			frame_stats.wasted_tail_bytes += waste;
+			head = offset + size;
+			return { ring.get(), physical, ring_host + physical };
+		}
+
+		return allocate_overflow(size);
+	}
+
+	// Call after Device::next_frame_context().
+	void next_frame_context()
+	{
+		frame_end[frame_index] = head;
+		history[history_index] = frame_bytes;
+		history_index = (history_index + 1) % HistoryFrames;
+
+		total_stats.bytes_allocated += frame_stats.bytes_allocated;
+		total_stats.blocks_consumed += frame_stats.blocks_consumed;
+		total_stats.wasted_tail_bytes += frame_stats.wasted_tail_bytes;
+		total_stats.overflow_blocks += frame_stats.overflow_blocks;
+		last_frame_stats = frame_stats;
+		frame_stats = {};
+		frame_bytes = 0;
+
+		// The GPU is done with everything this frame context allocated, so the tail can move forward.
+		frame_index = (frame_index + 1) % num_frame_contexts;
+		tail = std::max(tail, frame_end[frame_index]);
+		// Dropping the handles defers destruction to the frame context, like any other buffer.
+		for (auto &block : overflow[frame_index])
+			device.unmap_host_buffer(*block.buffer, Vulkan::MEMORY_ACCESS_WRITE_BIT);
+		overflow[frame_index].clear();
+
+		// Every frame in flight needs to fit in the ring at the same time.
+		// Round up to power-of-two so we don't resize for small fluctuations.
+		VkDeviceSize high_water = *std::max_element(history, history + HistoryFrames);
+		VkDeviceSize target = std::max<VkDeviceSize>(next_pow2(high_water * num_frame_contexts + high_water / 4), MinCapacity);
+
+		// Grow eagerly, shrink lazily.
+		if (target > capacity || target * 4 < capacity)
+		{
+			resize(target);
+			total_stats.resizes++;
+		}
+
+		frame_start = head;
+	}
+
+	VkDeviceSize get_capacity() const
+	{
+		return capacity;
+	}
+
+	const RingAllocatorStats &get_last_frame_stats() const
+	{
+		return last_frame_stats;
+	}
+
+	const RingAllocatorStats &get_total_stats() const
+	{
+		return total_stats;
+	}
+
+private:
+	enum { MinCapacity = 64 * 1024 };
+
+	Vulkan::Device &device;
+	VkBufferUsageFlags usage;
+	VkDeviceSize alignment;
+	unsigned num_frame_contexts;
+
+	Vulkan::BufferHandle ring;
+	uint8_t *ring_host = nullptr;
+	VkDeviceSize capacity = 0;
+
+	// Virtual offsets which grow forever. The physical offset is the virtual offset modulo capacity.
+	VkDeviceSize head = 0;
+	VkDeviceSize tail = 0;
+	VkDeviceSize frame_start = 0;
+	std::vector<VkDeviceSize> frame_end;
+	unsigned frame_index = 0;
+
+	struct OverflowBlock
+	{
+		Vulkan::BufferHandle buffer;
+		uint8_t *host;
+		VkDeviceSize offset;
+		VkDeviceSize size;
+	};
+	std::vector<std::vector<OverflowBlock>> overflow;
+
+	VkDeviceSize history[HistoryFrames] = {};
+	unsigned history_index = 0;
+	VkDeviceSize frame_bytes = 0;
+
+	RingAllocatorStats frame_stats;
+	RingAllocatorStats last_frame_stats;
+	RingAllocatorStats total_stats;
+
+	VkDeviceSize align(VkDeviceSize offset) const
+	{
+		return (offset + alignment - 1) & ~(alignment - 1);
+	}
+
+	static VkDeviceSize next_pow2(VkDeviceSize size)
+	{
+		VkDeviceSize result = 1;
+		while (result < size)
+			result <<= 1;
+		return result;
+	}
+
+	Vulkan::BufferHandle create_block(VkDeviceSize size, uint8_t *&host)
+	{
+		Vulkan::BufferCreateInfo info;
+		info.size = size;
+		info.domain = Vulkan::BufferDomain::Host;
+		info.usage = usage;
+		auto buffer = device.create_buffer(info);
+		host = static_cast<uint8_t *>(device.map_host_buffer(*buffer, Vulkan::MEMORY_ACCESS_WRITE_BIT));
+		return buffer;
+	}
+
+	void unmap()
+	{
+		if (ring)
+			device.unmap_host_buffer(*ring, Vulkan::MEMORY_ACCESS_WRITE_BIT);
+		for (auto &blocks : overflow)
+			for (auto &block : blocks)
+				device.unmap_host_buffer(*block.buffer, Vulkan::MEMORY_ACCESS_WRITE_BIT);
+	}
+
+	void resize(VkDeviceSize new_capacity)
+	{
+		// Frames in flight might still read from the old ring.
+		// Granite defers the destruction until the current frame context is recycled, which is after all of them.
+		if (ring)
+			device.unmap_host_buffer(*ring, Vulkan::MEMORY_ACCESS_WRITE_BIT);
+		capacity = new_capacity;
+		ring = create_block(capacity, ring_host);
+		head = tail = frame_start = 0;
+		std::fill(frame_end.begin(), frame_end.end(), 0);
+	}
+
+	RingAllocation allocate_overflow(VkDeviceSize size)
+	{
+		auto &blocks = overflow[frame_index];
+		if (!blocks.empty())
+		{
+			auto &block = blocks.back();
+			VkDeviceSize offset = align(block.offset);
+			if (offset + size <= block.size)
+			{
+				block.offset = offset + size;
+				return { block.buffer.get(), offset, block.host + offset };
+			}
+			frame_stats.wasted_tail_bytes += block.size - block.offset;
+		}
+
+		// Size overflow blocks like one frame's worth of the ring, so a sudden spike only needs a few of them.
+		OverflowBlock block;
+		block.size = std::max(next_pow2(size), capacity / num_frame_contexts);
+		block.buffer = create_block(block.size, block.host);
+		block.offset = size;
+		frame_stats.blocks_consumed++;
+		frame_stats.overflow_blocks++;
+		blocks.push_back(std::move(block));
+
+		auto &new_block = blocks.back();
+		return { new_block.buffer.get(), 0, new_block.host };
+	}
+};
+
+static const unsigned NumFrameContexts = 2;
+static const unsigned NumFrames = 300;
+
+struct Particle
+{
+	float position[3];
+	float velocity[3];
+	uint32_t color;
+	float size;
+};
+
+static void log_stats(const char *name, const RingAllocator &allocator)
+{
+	auto &stats = allocator.get_total_stats();
+	LOGI("  %s: %.3f MB allocated, %u blocks consumed (%u overflow), %.3f KB wasted tail space, %u resizes, ring is %.3f MB.\n",
+	     name, double(stats.bytes_allocated) / (1024.0 * 1024.0),
+	     stats.blocks_consumed, stats.overflow_blocks,
+	     double(stats.wasted_tail_bytes) / 1024.0, stats.resizes,
+	     double(allocator.get_capacity()) / (1024.0 * 1024.0));
+}
+
+int main()
+{
+	// See sample 01.
+	if (!Vulkan::Context::init_loader(nullptr))
+	{
+		LOGE("Failed to create loader!\n");
+		return 1;
+	}
+
+	Vulkan::Context context;
+	if (!context.init_instance_and_device(nullptr, 0, nullptr, 0))
+	{
+		LOGE("Failed to create VkInstance and VkDevice.\n");
+		return 1;
+	}
+
+	Vulkan::Device device;
+	device.set_context(context);
+	////
+
+	device.init_frame_contexts(NumFrameContexts);
+
+	auto &limits = device.get_gpu_properties().limits;
+
+	// One ring per allocator type, just like the command buffer has one linear allocator per type.
+	RingAllocator vertex_ring(device, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, 16, NumFrameContexts);
+	RingAllocator index_ring(device, VK_BUFFER_USAGE_INDEX_BUFFER_BIT, 4, NumFrameContexts);
+	RingAllocator uniform_ring(device, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+	                           std::max<VkDeviceSize>(16, limits.minUniformBufferOffsetAlignment), NumFrameContexts);
+
+	std::vector<Particle> particles(500000);
+	for (size_t i = 0; i < particles.size(); i++)
+		particles[i].color = uint32_t(i);
+
+	// Emulate a CPU particle system which ramps between 50k and 500k particles, i.e. 1.6 MB to 16 MB per frame.
+	auto get_num_particles = [&](unsigned frame) -> size_t {
+		double phase = 0.5 + 0.5 * std::sin(double(frame) * 0.05);
+		return size_t(50000 + phase * 450000);
+	};
+
+	const unsigned ParticlesPerEmitter = 1024;
+
+	// First, the linear allocators in the command buffer.
+	{
+		auto start = std::chrono::steady_clock::now();
+		for (unsigned frame = 0; frame < NumFrames; frame++)
+		{
+			auto cmd = device.request_command_buffer();
+			size_t num_particles = get_num_particles(frame);
+
+			// One allocation per emitter.
+			for (size_t i = 0; i < num_particles; i += ParticlesPerEmitter)
+			{
+				size_t count = std::min<size_t>(ParticlesPerEmitter, num_particles - i);
+				memcpy(cmd->allocate_vertex_data(0, count * sizeof(Particle), sizeof(Particle)),
+				       &particles[i], count * sizeof(Particle));
+
+				auto *indices = static_cast<uint16_t *>(cmd->allocate_index_data(6 * sizeof(uint16_t), VK_INDEX_TYPE_UINT16));
+				for (unsigned j = 0; j < 6; j++)
+					indices[j] = uint16_t(j);
+
+				auto *ubo = cmd->allocate_typed_constant_data<float>(0, 0, 16);
+				for (unsigned j = 0; j < 16; j++)
+					ubo[j] = float(j);
+			}
+
+			device.submit(cmd);
+			device.next_frame_context();
+		}
+		device.wait_idle();
+		auto end = std::chrono::steady_clock::now();
+
+		LOGI("Command buffer linear allocators: %.3f ms for %u frames.\n",
+		     std::chrono::duration<double, std::milli>(end - start).count(), NumFrames);
+	}
+
+	// Then the ring allocators.
+	{
+		auto start = std::chrono::steady_clock::now();
+		for (unsigned frame = 0; frame < NumFrames; frame++)
+		{
+			auto cmd = device.request_command_buffer();
+			size_t num_particles = get_num_particles(frame);
+
+			for (size_t i = 0; i < num_particles; i += ParticlesPerEmitter)
+			{
+				size_t count = std::min<size_t>(ParticlesPerEmitter, num_particles - i);
+				auto vertices = vertex_ring.allocate(count * sizeof(Particle));
+				memcpy(vertices.host, &particles[i], count * sizeof(Particle));
+				cmd->set_vertex_binding(0, *vertices.buffer, vertices.offset, sizeof(Particle));
+
+				auto indices = index_ring.allocate(6 * sizeof(uint16_t));
+				for (unsigned j = 0; j < 6; j++)
+					reinterpret_cast<uint16_t *>(indices.host)[j] = uint16_t(j);
+				cmd->set_index_buffer(*indices.buffer, indices.offset, VK_INDEX_TYPE_UINT16);
+
+				auto ubo = uniform_ring.allocate(16 * sizeof(float));
+				for (unsigned j = 0; j < 16; j++)
+					reinterpret_cast<float *>(ubo.host)[j] = float(j);
+				cmd->set_uniform_buffer(0, 0, *ubo.buffer, ubo.offset, 16 * sizeof(float));
+			}
+
+			device.submit(cmd);
+			device.next_frame_context();
+			vertex_ring.next_frame_context();
+			index_ring.next_frame_context();
+			uniform_ring.next_frame_context();
+
+			if ((frame % 50) == 0)
+			{
+				auto &stats = vertex_ring.get_last_frame_stats();
+				LOGI("Frame %u: %.3f MB vertex data, %u blocks, %u overflow, ring is %.3f MB.\n", frame,
+				     double(stats.bytes_allocated) / (1024.0 * 1024.0), stats.blocks_consumed, stats.overflow_blocks,
+				     double(vertex_ring.get_capacity()) / (1024.0 * 1024.0));
+			}
+		}
+		device.wait_idle();
+		auto end = std::chrono::steady_clock::now();
+
+		LOGI("Ring allocators: %.3f ms for %u frames.\n",
+		     std::chrono::duration<double, std::milli>(end - start).count(), NumFrames);
+		log_stats("Vertex", vertex_ring);
+		log_stats("Index", index_ring);
+		log_stats("Uniform", uniform_ring);
+	}
+}
@@ -0,0 +1,330 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "vulkan.hpp"
+#include "device.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <vector>
+#include <chrono>
+#include <stddef.h>
+#include <string.h>
+
+// Sample 07 mentions that the linear allocators can be backed by a CPU side and GPU side buffer pair,
+// which is copied on the DMA queue when the command buffer is submitted.
+// Reading host memory over PCI is fine when every byte is read once, but on a discrete GPU,
+// a large vertex stream which is read by many draws ends up crossing the bus over and over.
+// Here the staged mode is an explicit option per allocator:
+// - HostVisible: Allocations are written straight into a persistently mapped buffer, and the GPU reads them over PCI.
+// - Staged: Allocations are written to a host buffer, and flush() copies the used range to a DEVICE_LOCAL buffer.
+//   The copies are coalesced into one copy per block, recorded on the async transfer queue,
+//   and the graphics queue waits on a semaphore before vertex input.
+// On an integrated GPU, all memory is the same, and the staged mode is pure overhead.
+
+struct StagedAllocation
+{
+	// The buffer to bind. For the staged mode, this is the device local buffer.
+	Vulkan::Buffer *buffer = nullptr;
+	VkDeviceSize offset = 0;
+	// Write the data here before calling flush().
+	uint8_t *host = nullptr;
+};
+
+class StagedLinearAllocator
+{
+public:
+	enum class Mode
+	{
+		HostVisible,
+		Staged
+	};
+
+	StagedLinearAllocator(Vulkan::Device &device_, Mode mode_, VkBufferUsageFlags usage_,
+	                      unsigned num_frame_contexts, VkDeviceSize block_size_ = 8 * 1024 * 1024)
+		: device(device_), mode(mode_), usage(usage_), block_size(block_size_), frames(num_frame_contexts)
+	{
+	}
+
+	~StagedLinearAllocator()
+	{
+		for (auto &blocks : frames)
+			for (auto &block : blocks)
+				if (block.mapped)
+					device.unmap_host_buffer(*block.host, Vulkan::MEMORY_ACCESS_WRITE_BIT);
+	}
+
+	StagedAllocation allocate(VkDeviceSize size, VkDeviceSize alignment = 16)
+	{
+		auto &blocks = frames[frame_index];
+		for (; current_block < blocks.size(); current_block++)
+		{
+			auto &block = blocks[current_block];
+			VkDeviceSize offset = (block.offset + alignment - 1) & ~(alignment - 1);
+			if (offset + size <= block.size)
+				return allocate_from_block(block, offset, size);
+		}
+
+		blocks.push_back(create_block(std::max(size, block_size)));
+		return allocate_from_block(blocks.back(), 0, size);
+	}
+
+	// Makes everything allocated so far visible to the next submission on the graphics queue.
+	// Call before submitting the command buffers which use the allocations.
+	void flush()
+	{
+		Vulkan::CommandBufferHandle cmd;
+
+		for (auto &block : frames[frame_index])
+		{
+			if (block.offset == block.flushed)
+				continue;
+
+			// Flushes the CPU writes if the memory is not coherent.
+			device.unmap_host_buffer(*block.host, Vulkan::MEMORY_ACCESS_WRITE_BIT);
+			block.mapped = nullptr;
+
+			if (mode == Mode::Staged)
+			{
+				if (!cmd)
+					cmd = device.request_command_buffer(Vulkan::CommandBuffer::Type::AsyncTransfer);
+
+				// Only the range we wrote since the last flush, as one copy.
+				cmd->copy_buffer(*block.gpu, block.flushed, *block.host, block.flushed, block.offset - block.flushed);
+				bytes_copied += block.offset - block.flushed;
+			}
+
+			block.flushed = block.offset;
+		}
+
+		if (cmd)
+		{
+			Vulkan::Semaphore sem;
+			device.submit(cmd, nullptr, 1, &sem);
+			device.add_wait_semaphore(Vulkan::CommandBuffer::Type::Generic, sem,
+			                          VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, true);
+		}
+	}
+
+	// Call after Device::next_frame_context().
+	// The GPU is done with this frame context, so its blocks can be reused.
+	void next_frame_context()
+	{
+		frame_index = (frame_index + 1) % frames.size();
+		current_block = 0;
+		for (auto &block : frames[frame_index])
+			block.offset = block.flushed = 0;
+	}
+
+	VkDeviceSize get_bytes_copied() const
+	{
+		return bytes_copied;
+	}
+
+private:
+	Vulkan::Device &device;
+	Mode mode;
+	VkBufferUsageFlags usage;
+	VkDeviceSize block_size;
+
+	struct Block
+	{
+		Vulkan::BufferHandle host;
+		// Same as host for the HostVisible mode.
+		Vulkan::BufferHandle gpu;
+		uint8_t *mapped;
+		VkDeviceSize offset;
+		VkDeviceSize flushed;
+		VkDeviceSize size;
+	};
+	std::vector<std::vector<Block>> frames;
+	unsigned frame_index = 0;
+	size_t current_block = 0;
+	VkDeviceSize bytes_copied = 0;
+
+	Block create_block(VkDeviceSize size)
+	{
+		Block block;
+		block.size = size;
+		block.offset = 0;
+		block.flushed = 0;
+		block.mapped = nullptr;
+
+		Vulkan::BufferCreateInfo info;
+		info.size = size;
+		info.domain = Vulkan::BufferDomain::Host;
+		info.usage = mode == Mode::Staged ? VK_BUFFER_USAGE_TRANSFER_SRC_BIT : usage;
+		block.host = device.create_buffer(info);
+
+		if (mode == Mode::Staged)
+		{
+			info.domain = Vulkan::BufferDomain::Device;
+			info.usage = usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+			block.gpu = device.create_buffer(info);
+		}
+		else
+			block.gpu = block.host;
+
+		return block;
+	}
+
+	StagedAllocation allocate_from_block(Block &block, VkDeviceSize offset, VkDeviceSize size)
+	{
+		if (!block.mapped)
+			block.mapped = static_cast<uint8_t *>(device.map_host_buffer(*block.host, Vulkan::MEMORY_ACCESS_WRITE_BIT));
+		block.offset = offset + size;
+		return { block.gpu.get(), offset, block.mapped + offset };
+	}
+};
+
+static const uint32_t triangle_vert[] =
+#include "shaders/triangle.vert.inc"
+;
+
+static const uint32_t triangle_frag[] =
+#include "shaders/triangle.frag.inc"
+;
+
+static const unsigned NumFrameContexts = 2;
+static const unsigned NumFrames = 64;
+static const unsigned NumVertices = 3 * 65536;
+static const unsigned NumDrawsPerFrame = 64;
+
+struct Vertex
+{
+	float position[2];
+	float color[4];
+};
+
+static void run_mode(Vulkan::Device &device, Vulkan::Program *prog, StagedLinearAllocator::Mode mode)
+{
+	const char *mode_name = mode == StagedLinearAllocator::Mode::Staged ? "Staged" : "Host visible";
+	StagedLinearAllocator allocator(device, mode, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, NumFrameContexts);
+
+	std::vector<Vertex> vertices(NumVertices);
+	for (unsigned i = 0; i < NumVertices; i++)
+	{
+		vertices[i].position[0] = float(i % 3) - 1.0f;
+		vertices[i].position[1] = float((i + 1) % 3) - 1.0f;
+		vertices[i].color[0] = 1.0f;
+		vertices[i].color[1] = 0.0f;
+		vertices[i].color[2] = 0.0f;
+		vertices[i].color[3] = 1.0f;
+	}
+
+	std::vector<std::pair<Vulkan::QueryPoolHandle, Vulkan::QueryPoolHandle>> queries;
+	double timestamp_period = device.get_gpu_properties().limits.timestampPeriod;
+
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned frame = 0; frame < NumFrames; frame++)
+	{
+		// A new vertex stream every frame, like a CPU particle system would.
+		auto stream = allocator.allocate(NumVertices * sizeof(Vertex));
+		memcpy(stream.host, vertices.data(), NumVertices * sizeof(Vertex));
+
+		// Must happen before the graphics command buffer is submitted.
+		allocator.flush();
+
+		auto cmd = device.request_command_buffer();
+
+		Vulkan::RenderPassInfo rp;
+		rp.num_color_attachments = 1;
+		rp.color_attachments[0] = &device.get_transient_attachment(256, 256, VK_FORMAT_R8G8B8A8_UNORM);
+		rp.clear_attachments = 1 << 0;
+		cmd->begin_render_pass(rp);
+
+		cmd->set_program(prog);
+		cmd->set_opaque_state();
+		cmd->set_vertex_binding(0, *stream.buffer, stream.offset, sizeof(Vertex));
+		cmd->set_vertex_attrib(0, 0, VK_FORMAT_R32G32_SFLOAT, offsetof(Vertex, position));
+		cmd->set_vertex_attrib(1, 0, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(Vertex, color));
+
+		// Scale everything down to a point, so the triangles are culled, and we're only measuring vertex fetch.
+		// see shaders/triangle.vert and shaders/triangle.frag.
+		float *vert_ubo = cmd->allocate_typed_constant_data<float>(0, 0, 4);
+		vert_ubo[0] = 0.0f;
+		vert_ubo[1] = 0.0f;
+		vert_ubo[2] = 0.0f;
+		vert_ubo[3] = 0.0f;
+		float *frag_ubo = cmd->allocate_typed_constant_data<float>(0, 1, 4);
+		for (unsigned i = 0; i < 4; i++)
+			frag_ubo[i] = 1.0f;
+
+		auto query_start = cmd->write_timestamp(VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT);
+		for (unsigned draw = 0; draw < NumDrawsPerFrame; draw++)
+			cmd->draw(NumVertices);
+		auto query_end = cmd->write_timestamp(VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+		queries.emplace_back(query_start, query_end);
+
+		cmd->end_render_pass();
+		device.submit(cmd);
+		device.next_frame_context();
+		allocator.next_frame_context();
+	}
+	device.wait_idle();
+	auto end = std::chrono::steady_clock::now();
+
+	double gpu_us = 0.0;
+	for (auto &query : queries)
+	{
+		if (query.first->is_signalled() && query.second->is_signalled())
+			gpu_us += double(query.second->get_timestamp() - query.first->get_timestamp()) * timestamp_period * 1e-3;
+	}
+
+	LOGI("%s: %.3f ms / frame wall clock, %.3f ms / frame for draws on GPU, %.3f MB copied on the transfer queue.\n",
+	     mode_name,
+	     std::chrono::duration<double, std::milli>(end - start).count() / NumFrames,
+	     gpu_us * 1e-3 / NumFrames,
+	     double(allocator.get_bytes_copied()) / (1024.0 * 1024.0));
+}
+
+int main()
+{
+	// See sample 01.
+	if (!Vulkan::Context::init_loader(nullptr))
+	{
+		LOGE("Failed to create loader!\n");
+		return 1;
+	}
+
+	Vulkan::Context context;
+	if (!context.init_instance_and_device(nullptr, 0, nullptr, 0))
+	{
+		LOGE("Failed to create VkInstance and VkDevice.\n");
+		return 1;
+	}
+
+	Vulkan::Device device;
+	device.set_context(context);
+	////
+
+	device.init_frame_contexts(NumFrameContexts);
+
+	Vulkan::Program *prog = device.request_program(
+			device.request_shader(triangle_vert, sizeof(triangle_vert)),
+			device.request_shader(triangle_frag, sizeof(triangle_frag)));
+
+	LOGI("%u vertices (%.3f MB) read by %u draws per frame.\n", NumVertices,
+	     double(NumVertices * sizeof(Vertex)) / (1024.0 * 1024.0), NumDrawsPerFrame);
+
+	for (auto mode : { StagedLinearAllocator::Mode::HostVisible, StagedLinearAllocator::Mode::Staged })
+		run_mode(device, prog, mode);
+}
@@ -0,0 +1,501 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "vulkan.hpp"
+#include "device.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define PACK_SSE2 1
+#endif
+
+#if defined(__AVX2__) && defined(__F16C__)
+#include <immintrin.h>
+#define PACK_AVX2 1
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define PACK_NEON 1
+#endif
+
+// Sample 07 copies 32-bit floats into the pointer returned by allocate_vertex_data(),
+// and declares R32G32B32_SFLOAT and R32G32B32A32_SFLOAT attributes.
+// For dynamic geometry which is rewritten every frame, full precision floats are rarely needed:
+// - Positions: RGBA16_SFLOAT, 8 bytes rather than 16.
+// - Normals: RGBA16_SNORM, 8 bytes rather than 16.
+// - Colors: RGBA8_UNORM, 4 bytes rather than 16.
+// That's 20 bytes per vertex rather than 48. The vertex shader does not change,
+// the fixed function vertex fetch expands the data back to floats.
+
+// The memory we get from allocate_vertex_data() is typically write-combined.
+// Writes are fast as long as we write full cache lines sequentially, but reads are extremely slow.
+// This means we should never pack in-place (read-modify-write), and we should not
+// write a vertex component by component in a scalar loop either.
+// The kernels below convert from floats in normal memory, and write with streaming (non-temporal) stores,
+// which go straight to the write-combine buffers, and don't pollute the cache with data we're never going to read again.
+
+// The SIMD path is selected at compile time:
+// - AVX2 + F16C when built with e.g. -mavx2 -mf16c (or -march=native).
+// - SSE2 on any x86-64.
+// - NEON on AArch64. There is no non-temporal store intrinsic for NEON, so regular stores are used.
+// - Scalar otherwise. The scalar functions are also used for the unaligned head and tail of the arrays.
+
+static uint16_t float_to_half(float f)
+{
+	uint32_t u;
+	memcpy(&u, &f, sizeof(u));
+	uint32_t sign = (u >> 16) & 0x8000u;
+	uint32_t abs_bits = u & 0x7fffffffu;
+
+	// Inf or NaN.
+	if (abs_bits >= 0x7f800000u)
+		return uint16_t(sign | 0x7c00u | (abs_bits > 0x7f800000u ? 0x200u : 0u));
+
+	// Rounds to infinity, 65520.0 is half-way between the largest half and 2^16.
+	if (abs_bits >= 0x477ff000u)
+		return uint16_t(sign | 0x7c00u);
+
+	// Denormal half. Scale by 2^24, so that one denormal ULP becomes 1.0, and round to nearest even.
+	if (abs_bits < 0x38800000u)
+		return uint16_t(sign | uint32_t(std::nearbyint(std::fabs(f) * 16777216.0f)));
+
+	// Rebias the exponent from 127 to 15, and round the mantissa to nearest even.
+	uint32_t h = abs_bits - 0x38000000u;
+	h += 0xfffu + ((h >> 13) & 1u);
+	return uint16_t(sign | (h >> 13));
+}
+
+static int16_t float_to_snorm16(float f)
+{
+	return int16_t(std::nearbyint(std::min(std::max(f, -1.0f), 1.0f) * 32767.0f));
+}
+
+static uint8_t float_to_unorm8(float f)
+{
+	return uint8_t(std::nearbyint(std::min(std::max(f, 0.0f), 1.0f) * 255.0f));
+}
+
+static void pack_half_scalar(uint16_t *dst, const float *src, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		dst[i] = float_to_half(src[i]);
+}
+
+static void pack_snorm16_scalar(int16_t *dst, const float *src, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		dst[i] = float_to_snorm16(src[i]);
+}
+
+static void pack_unorm8_scalar(uint8_t *dst, const float *src, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		dst[i] = float_to_unorm8(src[i]);
+}
+
+// Streaming stores need aligned addresses. Convert with scalar code until we get there.
+template <typename T, typename Func>
+static void pack_head(T *&dst, const float *&src, size_t &count, uintptr_t alignment, const Func &func)
+{
+	while (count && (reinterpret_cast<uintptr_t>(dst) & (alignment - 1)))
+	{
+		*dst++ = func(*src++);
+		count--;
+	}
+}
+
+#if PACK_SSE2 && !PACK_AVX2
+// Same as float_to_half(), four at a time.
+// The results are in the low 16 bits of each 32-bit lane.
+static __m128i float_to_half_sse2(__m128 f)
+{
+	__m128i u = _mm_castps_si128(f);
+	__m128i sign = _mm_and_si128(_mm_srli_epi32(u, 16), _mm_set1_epi32(0x8000));
+	__m128i abs_bits = _mm_and_si128(u, _mm_set1_epi32(0x7fffffff));
+
+	__m128i h = _mm_sub_epi32(abs_bits, _mm_set1_epi32(0x38000000));
+	__m128i lsb = _mm_and_si128(_mm_srli_epi32(h, 13), _mm_set1_epi32(1));
+	h = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(h, _mm_set1_epi32(0xfff)), lsb), 13);
+
+	// _mm_cvtps_epi32 rounds to nearest even with the default rounding mode.
+	__m128i denorm = _mm_cvtps_epi32(_mm_mul_ps(_mm_castsi128_ps(abs_bits), _mm_set1_ps(16777216.0f)));
+	__m128i is_denorm = _mm_cmplt_epi32(abs_bits, _mm_set1_epi32(0x38800000));
+	h = _mm_or_si128(_mm_and_si128(is_denorm, denorm), _mm_andnot_si128(is_denorm, h));
+
+	// abs_bits is always positive, so the signed compares are fine.
+	__m128i is_inf = _mm_cmpgt_epi32(abs_bits, _mm_set1_epi32(0x477fefff));
+	h = _mm_or_si128(_mm_and_si128(is_inf, _mm_set1_epi32(0x7c00)), _mm_andnot_si128(is_inf, h));
+	__m128i is_nan = _mm_cmpgt_epi32(abs_bits, _mm_set1_epi32(0x7f800000));
+	h = _mm_or_si128(h, _mm_and_si128(is_nan, _mm_set1_epi32(0x200)));
+
+	h = _mm_or_si128(h, sign);
+	// Sign extend so that _mm_packs_epi32 does not saturate.
+	return _mm_srai_epi32(_mm_slli_epi32(h, 16), 16);
+}
+#endif
+
+static void pack_half(uint16_t *dst, const float *src, size_t count)
+{
+#if PACK_AVX2
+	pack_head(dst, src, count, 16, float_to_half);
+	for (; count >= 8; count -= 8, src += 8, dst += 8)
+	{
+		__m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(src), _MM_FROUND_TO_NEAREST_INT);
+		_mm_stream_si128(reinterpret_cast<__m128i *>(dst), h);
+	}
+	_mm_sfence();
+#elif PACK_SSE2
+	pack_head(dst, src, count, 16, float_to_half);
+	for (; count >= 8; count -= 8, src += 8, dst += 8)
+	{
+		__m128i lo = float_to_half_sse2(_mm_loadu_ps(src));
+		__m128i hi = float_to_half_sse2(_mm_loadu_ps(src + 4));
+		_mm_stream_si128(reinterpret_cast<__m128i *>(dst), _mm_packs_epi32(lo, hi));
+	}
+	_mm_sfence();
+#elif PACK_NEON
+	for (; count >= 4; count -= 4, src += 4, dst += 4)
+		vst1_u16(dst, vreinterpret_u16_f16(vcvt_f16_f32(vld1q_f32(src))));
+#endif
+	pack_half_scalar(dst, src, count);
+}
+
+static void pack_snorm16(int16_t *dst, const float *src, size_t count)
+{
+#if PACK_AVX2
+	pack_head(dst, src, count, 32, float_to_snorm16);
+	const __m256 lo = _mm256_set1_ps(-1.0f);
+	const __m256 hi = _mm256_set1_ps(1.0f);
+	const __m256 scale = _mm256_set1_ps(32767.0f);
+	for (; count >= 16; count -= 16, src += 16, dst += 16)
+	{
+		__m256i a = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(src), lo), hi), scale));
+		__m256i b = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(src + 8), lo), hi), scale));
+		// The AVX2 pack instructions work within each 128-bit lane, so the 64-bit chunks come out as a0, b0, a1, b1.
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+		_mm256_stream_si256(reinterpret_cast<__m256i *>(dst), packed);
+	}
+	_mm_sfence();
+#elif PACK_SSE2
+	pack_head(dst, src, count, 16, float_to_snorm16);
+	const __m128 lo = _mm_set1_ps(-1.0f);
+	const __m128 hi = _mm_set1_ps(1.0f);
+	const __m128 scale = _mm_set1_ps(32767.0f);
+	for (; count >= 8; count -= 8, src += 8, dst += 8)
+	{
+		__m128i a = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(src), lo), hi), scale));
+		__m128i b = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + 4), lo), hi), scale));
+		_mm_stream_si128(reinterpret_cast<__m128i *>(dst), _mm_packs_epi32(a, b));
+	}
+	_mm_sfence();
+#elif PACK_NEON
+	const float32x4_t lo = vdupq_n_f32(-1.0f);
+	const float32x4_t hi = vdupq_n_f32(1.0f);
+	for (; count >= 8; count -= 8, src += 8, dst += 8)
+	{
+		int32x4_t a = vcvtnq_s32_f32(vmulq_n_f32(vminq_f32(vmaxq_f32(vld1q_f32(src), lo), hi), 32767.0f));
+		int32x4_t b = vcvtnq_s32_f32(vmulq_n_f32(vminq_f32(vmaxq_f32(vld1q_f32(src + 4), lo), hi), 32767.0f));
+		vst1q_s16(dst, vcombine_s16(vqmovn_s32(a), vqmovn_s32(b)));
+	}
+#endif
+	pack_snorm16_scalar(dst, src, count);
+}
+
+static void pack_unorm8(uint8_t *dst, const float *src, size_t count)
+{
+#if PACK_AVX2
+	pack_head(dst, src, count, 32, float_to_unorm8);
+	const __m256 lo = _mm256_setzero_ps();
+	const __m256 hi = _mm256_set1_ps(1.0f);
+	const __m256 scale = _mm256_set1_ps(255.0f);
+	for (; count >= 32; count -= 32, src += 32, dst += 32)
+	{
+		__m256i v[4];
+		for (unsigned i = 0; i < 4; i++)
+			v[i] = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(src + 8 * i), lo), hi), scale));
+		__m256i ab = _mm256_permute4x64_epi64(_mm256_packs_epi32(v[0], v[1]), 0xd8);
+		__m256i cd = _mm256_permute4x64_epi64(_mm256_packs_epi32(v[2], v[3]), 0xd8);
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(ab, cd), 0xd8);
+		_mm256_stream_si256(reinterpret_cast<__m256i *>(dst), packed);
+	}
+	_mm_sfence();
+#elif PACK_SSE2
+	pack_head(dst, src, count, 16, float_to_unorm8);
+	const __m128 lo = _mm_setzero_ps();
+	const __m128 hi = _mm_set1_ps(1.0f);
+	const __m128 scale = _mm_set1_ps(255.0f);
+	for (; count >= 16; count -= 16, src += 16, dst += 16)
+	{
+		__m128i v[4];
+		for (unsigned i = 0; i < 4; i++)
+			v[i] = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + 4 * i), lo), hi), scale));
+		__m128i packed = _mm_packus_epi16(_mm_packs_epi32(v[0], v[1]), _mm_packs_epi32(v[2], v[3]));
+		_mm_stream_si128(reinterpret_cast<__m128i *>(dst), packed);
+	}
+	_mm_sfence();
+#elif PACK_NEON
+	const float32x4_t lo = vdupq_n_f32(0.0f);
+	const float32x4_t hi = vdupq_n_f32(1.0f);
+	for (; count >= 16; count -= 16, src += 16, dst += 16)
+	{
+		uint32x4_t v[4];
+		for (unsigned i = 0; i < 4; i++)
+			v[i] = vcvtnq_u32_f32(vmulq_n_f32(vminq_f32(vmaxq_f32(vld1q_f32(src + 4 * i), lo), hi), 255.0f));
+		uint16x8_t ab = vcombine_u16(vqmovn_u32(v[0]), vqmovn_u32(v[1]));
+		uint16x8_t cd = vcombine_u16(vqmovn_u32(v[2]), vqmovn_u32(v[3]));
+		vst1q_u8(dst, vcombine_u8(vqmovn_u16(ab), vqmovn_u16(cd)));
+	}
+#endif
+	pack_unorm8_scalar(dst, src, count);
+}
+
+static const char *get_simd_path()
+{
+#if PACK_AVX2
+	return "AVX2 + F16C";
+#elif PACK_SSE2
+	return "SSE2";
+#elif PACK_NEON
+	return "NEON";
+#else
+	return "scalar";
+#endif
+}
+
+static const uint32_t triangle_vert[] =
+#include "shaders/triangle.vert.inc"
+;
+
+static const uint32_t triangle_frag[] =
+#include "shaders/triangle.frag.inc"
+;
+
+static const unsigned NumVertices = 3 * 100000;
+static const unsigned NumFrames = 32;
+
+enum class Path
+{
+	Float,
+	PackedScalar,
+	PackedSIMD
+};
+
+static const char *path_to_string(Path path)
+{
+	switch (path)
+	{
+	case Path::Float:
+		return "32-bit float";
+	case Path::PackedScalar:
+		return "Packed, scalar";
+	case Path::PackedSIMD:
+		return "Packed, SIMD";
+	default:
+		return "?";
+	}
+}
+
+// Source data in normal cached memory, like a CPU particle system or skinning would produce.
+struct VertexStreams
+{
+	std::vector<float> positions;
+	std::vector<float> normals;
+	std::vector<float> colors;
+};
+
+static bool verify_kernels(const VertexStreams &streams)
+{
+	// Odd sizes and offsets to exercise the head and tail paths.
+	const size_t count = 4 * 1001 + 3;
+	std::vector<float> values(count + 1);
+	for (size_t i = 0; i < values.size(); i++)
+	{
+		values[i] = streams.positions[i] * 1000.0f;
+		// Throw in some denormals and values which are out of range.
+		if ((i % 17) == 0)
+			values[i] = float(i) * 1e-7f;
+		else if ((i % 19) == 0)
+			values[i] = -100000.0f;
+	}
+
+	std::vector<uint16_t> half_simd(count + 1), half_scalar(count + 1);
+	std::vector<int16_t> snorm_simd(count + 1), snorm_scalar(count + 1);
+	std::vector<uint8_t> unorm_simd(count + 1), unorm_scalar(count + 1);
+
+	pack_half(half_simd.data() + 1, values.data() + 1, count);
+	pack_half_scalar(half_scalar.data() + 1, values.data() + 1, count);
+	pack_snorm16(snorm_simd.data() + 1, streams.normals.data() + 1, count);
+	pack_snorm16_scalar(snorm_scalar.data() + 1, streams.normals.data() + 1, count);
+	pack_unorm8(unorm_simd.data() + 1, streams.colors.data() + 1, count);
+	pack_unorm8_scalar(unorm_scalar.data() + 1, streams.colors.data() + 1, count);
+
+	return half_simd == half_scalar && snorm_simd == snorm_scalar && unorm_simd == unorm_scalar;
+}
+
+static double run_path(Vulkan::Device &device, Vulkan::Program *prog, const VertexStreams &streams, Path path)
+{
+	double total_ms = 0.0;
+
+	for (unsigned frame = 0; frame < NumFrames; frame++)
+	{
+		auto cmd = device.request_command_buffer();
+
+		Vulkan::RenderPassInfo rp;
+		rp.num_color_attachments = 1;
+		rp.color_attachments[0] = &device.get_transient_attachment(256, 256, VK_FORMAT_R8G8B8A8_UNORM);
+		rp.clear_attachments = 1 << 0;
+		cmd->begin_render_pass(rp);
+
+		cmd->set_program(prog);
+		cmd->set_opaque_state();
+
+		auto start = std::chrono::steady_clock::now();
+		if (path == Path::Float)
+		{
+			// Same as sample 07.
+			memcpy(cmd->allocate_vertex_data(0, NumVertices * 4 * sizeof(float), 4 * sizeof(float)),
+			       streams.positions.data(), NumVertices * 4 * sizeof(float));
+			memcpy(cmd->allocate_vertex_data(1, NumVertices * 4 * sizeof(float), 4 * sizeof(float)),
+			       streams.colors.data(), NumVertices * 4 * sizeof(float));
+			memcpy(cmd->allocate_vertex_data(2, NumVertices * 4 * sizeof(float), 4 * sizeof(float)),
+			       streams.normals.data(), NumVertices * 4 * sizeof(float));
+			cmd->set_vertex_attrib(0, 0, VK_FORMAT_R32G32B32A32_SFLOAT, 0);
+			cmd->set_vertex_attrib(1, 1, VK_FORMAT_R32G32B32A32_SFLOAT, 0);
+			cmd->set_vertex_attrib(2, 2, VK_FORMAT_R32G32B32A32_SFLOAT, 0);
+		}
+		else
+		{
+			auto *positions = static_cast<uint16_t *>(cmd->allocate_vertex_data(0, NumVertices * 4 * sizeof(uint16_t), 4 * sizeof(uint16_t)));
+			auto *colors = static_cast<uint8_t *>(cmd->allocate_vertex_data(1, NumVertices * 4 * sizeof(uint8_t), 4 * sizeof(uint8_t)));
+			auto *normals = static_cast<int16_t *>(cmd->allocate_vertex_data(2, NumVertices * 4 * sizeof(int16_t), 4 * sizeof(int16_t)));
+
+			if (path == Path::PackedSIMD)
+			{
+				pack_half(positions, streams.positions.data(), NumVertices * 4);
+				pack_unorm8(colors, streams.colors.data(), NumVertices * 4);
+				pack_snorm16(normals, streams.normals.data(), NumVertices * 4);
+			}
+			else
+			{
+				pack_half_scalar(positions, streams.positions.data(), NumVertices * 4);
+				pack_unorm8_scalar(colors, streams.colors.data(), NumVertices * 4);
+				pack_snorm16_scalar(normals, streams.normals.data(), NumVertices * 4);
+			}
+
+			// The vertex shader still sees vec4 inputs.
+			cmd->set_vertex_attrib(0, 0, VK_FORMAT_R16G16B16A16_SFLOAT, 0);
+			cmd->set_vertex_attrib(1, 1, VK_FORMAT_R8G8B8A8_UNORM, 0);
+			cmd->set_vertex_attrib(2, 2, VK_FORMAT_R16G16B16A16_SNORM, 0);
+		}
+		auto end = std::chrono::steady_clock::now();
+
+		// triangle.vert does not read normals, but a lit shader would.
+		// Attributes which the shader does not consume are ignored when the pipeline is created.
+
+		// see shaders/triangle.vert and shaders/triangle.frag.
+		float *vert_ubo = cmd->allocate_typed_constant_data<float>(0, 0, 4);
+		vert_ubo[0] = 0.0f;
+		vert_ubo[1] = 0.0f;
+		vert_ubo[2] = 1.0f;
+		vert_ubo[3] = 1.0f;
+		float *frag_ubo = cmd->allocate_typed_constant_data<float>(0, 1, 4);
+		for (unsigned i = 0; i < 4; i++)
+			frag_ubo[i] = 1.0f;
+
+		cmd->draw(NumVertices);
+		cmd->end_render_pass();
+		device.submit(cmd);
+		device.next_frame_context();
+
+		total_ms += std::chrono::duration<double, std::milli>(end - start).count();
+	}
+
+	device.wait_idle();
+	return total_ms / NumFrames;
+}
+
+int main()
+{
+	// See sample 01.
+	if (!Vulkan::Context::init_loader(nullptr))
+	{
+		LOGE("Failed to create loader!\n");
+		return 1;
+	}
+
+	Vulkan::Context context;
+	if (!context.init_instance_and_device(nullptr, 0, nullptr, 0))
+	{
+		LOGE("Failed to create VkInstance and VkDevice.\n");
+		return 1;
+	}
+
+	Vulkan::Device device;
+	device.set_context(context);
+	////
+
+	Vulkan::Program *prog = device.request_program(
+			device.request_shader(triangle_vert, sizeof(triangle_vert)),
+			device.request_shader(triangle_frag, sizeof(triangle_frag)));
+
+	VertexStreams streams;
+	streams.positions.resize(NumVertices * 4);
+	streams.normals.resize(NumVertices * 4);
+	streams.colors.resize(NumVertices * 4);
+	for (unsigned i = 0; i < NumVertices; i++)
+	{
+		float phase = float(i) * 0.001f;
+		streams.positions[4 * i + 0] = std::cos(phase) * 0.9f;
+		streams.positions[4 * i + 1] = std::sin(phase * 1.3f) * 0.9f;
+		streams.positions[4 * i + 2] = 0.0f;
+		streams.positions[4 * i + 3] = 1.0f;
+		streams.normals[4 * i + 0] = std::cos(phase);
+		streams.normals[4 * i + 1] = std::sin(phase);
+		streams.normals[4 * i + 2] = 0.0f;
+		streams.normals[4 * i + 3] = 0.0f;
+		streams.colors[4 * i + 0] = 0.5f + 0.5f * std::sin(phase * 3.0f);
+		streams.colors[4 * i + 1] = 0.5f + 0.5f * std::sin(phase * 5.0f);
+		streams.colors[4 * i + 2] = 0.5f + 0.5f * std::sin(phase * 7.0f);
+		streams.colors[4 * i + 3] = 1.0f;
+	}
+
+	if (!verify_kernels(streams))
+	{
+		LOGE("SIMD kernels (%s) do not match the scalar reference!\n", get_simd_path());
+		return 1;
+	}
+
+	LOGI("SIMD path: %s.\n", get_simd_path());
+	LOGI("%u vertices, %u bytes / vertex as floats, %u bytes / vertex packed.\n",
+	     NumVertices, unsigned(12 * sizeof(float)), unsigned(4 * sizeof(uint16_t) + 4 * sizeof(int16_t) + 4));
+
+	for (auto path : { Path::Float, Path::PackedScalar, Path::PackedSIMD })
+		LOGI("%s: %.3f ms / frame writing vertex data.\n", path_to_string(path), run_path(device, prog, streams, path));
+}
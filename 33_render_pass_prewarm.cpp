@@ -0,0 +1,466 @@
+/* Copyright (c) 2019 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "vulkan.hpp"
+#include "device.hpp"
+#include "util.hpp"
+#include <vector>
+#include <chrono>
+#include <stdio.h>
+
+// Sample 08 shows how VkRenderPass objects, "compatible" render passes and VkFramebuffers are created lazily
+// in begin_render_pass(), based on hashing the RenderPassInfo.
+// - Render passes live in a persistent hashmap. A miss only happens the first time a combination is used.
+// - Framebuffers depend on the actual image views, and live in a temporary hashmap.
+//   A framebuffer which is not used for a few frames is destroyed.
+// This means that a render target which is only rendered to now and then (reflections, a picture-in-picture view, etc)
+// has its framebuffer destroyed and created again every time it's used, and that shows up as a spike.
+// The same thing happens on the first frame after a resize, where every render target is new.
+
+// Here we do two things:
+// - RenderPassPrewarmer: Render passes are declared up front, and created in one warm-up command buffer,
+//   at startup and after a resize. For passes which are used intermittently, keep_alive() touches the framebuffer
+//   with a 1x1 render area, so it never gets old enough to be evicted.
+// - We count the real vkCmdBeginRenderPass, vkCreateRenderPass and vkCreateFramebuffer calls, and the destroy counterparts,
+//   to see cache hits and misses, how many objects are created inside frames, and how many framebuffers are evicted.
+
+// To see what actually happens, we count the Vulkan calls which begin render passes, and which create and destroy
+// render passes and framebuffers. Like sample 17, we patch Granite's VolkDeviceTable, since that's what it dispatches through.
+// Compatible render passes are VkRenderPass objects too, so they are included in the render pass count.
+// From these we get hits and misses: Every begin_render_pass() looks up a render pass, a compatible render pass and
+// a framebuffer. Whatever was not created must have been found in a cache.
+struct RenderPassCallCounters
+{
+	unsigned render_passes_begun = 0;
+	unsigned render_passes_created = 0;
+	unsigned render_passes_destroyed = 0;
+	unsigned framebuffers_created = 0;
+	unsigned framebuffers_destroyed = 0;
+};
+
+static RenderPassCallCounters call_counters;
+static PFN_vkCmdBeginRenderPass real_vkCmdBeginRenderPass;
+static PFN_vkCmdBeginRenderPass2KHR real_vkCmdBeginRenderPass2KHR;
+static PFN_vkCreateRenderPass real_vkCreateRenderPass;
+static PFN_vkCreateRenderPass2KHR real_vkCreateRenderPass2KHR;
+static PFN_vkDestroyRenderPass real_vkDestroyRenderPass;
+static PFN_vkCreateFramebuffer real_vkCreateFramebuffer;
+static PFN_vkDestroyFramebuffer real_vkDestroyFramebuffer;
+
+static VKAPI_ATTR void VKAPI_CALL counting_vkCmdBeginRenderPass(
+		VkCommandBuffer cmd, const VkRenderPassBeginInfo *info, VkSubpassContents contents)
+{
+	call_counters.render_passes_begun++;
+	real_vkCmdBeginRenderPass(cmd, info, contents);
+}
+
+static VKAPI_ATTR void VKAPI_CALL counting_vkCmdBeginRenderPass2KHR(
+		VkCommandBuffer cmd, const VkRenderPassBeginInfo *info, const VkSubpassBeginInfoKHR *subpass_info)
+{
+	call_counters.render_passes_begun++;
+	real_vkCmdBeginRenderPass2KHR(cmd, info, subpass_info);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL counting_vkCreateRenderPass(
+		VkDevice device, const VkRenderPassCreateInfo *info, const VkAllocationCallbacks *allocator, VkRenderPass *render_pass)
+{
+	call_counters.render_passes_created++;
+	return real_vkCreateRenderPass(device, info, allocator, render_pass);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL counting_vkCreateRenderPass2KHR(
+		VkDevice device, const VkRenderPassCreateInfo2KHR *info, const VkAllocationCallbacks *allocator, VkRenderPass *render_pass)
+{
+	call_counters.render_passes_created++;
+	return real_vkCreateRenderPass2KHR(device, info, allocator, render_pass);
+}
+
+static VKAPI_ATTR void VKAPI_CALL counting_vkDestroyRenderPass(
+		VkDevice device, VkRenderPass render_pass, const VkAllocationCallbacks *allocator)
+{
+	if (render_pass != VK_NULL_HANDLE)
+		call_counters.render_passes_destroyed++;
+	real_vkDestroyRenderPass(device, render_pass, allocator);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL counting_vkCreateFramebuffer(
+		VkDevice device, const VkFramebufferCreateInfo *info, const VkAllocationCallbacks *allocator, VkFramebuffer *framebuffer)
+{
+	call_counters.framebuffers_created++;
+	return real_vkCreateFramebuffer(device, info, allocator, framebuffer);
+}
+
+static VKAPI_ATTR void VKAPI_CALL counting_vkDestroyFramebuffer(
+		VkDevice device, VkFramebuffer framebuffer, const VkAllocationCallbacks *allocator)
+{
+	if (framebuffer != VK_NULL_HANDLE)
+		call_counters.framebuffers_destroyed++;
+	real_vkDestroyFramebuffer(device, framebuffer, allocator);
+}
+
+// Must be called for every Context, after the VkDevice is created and before Device::set_context().
+static void install_call_counters(VolkDeviceTable &table)
+{
+	call_counters = {};
+
+	real_vkCmdBeginRenderPass = table.vkCmdBeginRenderPass;
+	table.vkCmdBeginRenderPass = counting_vkCmdBeginRenderPass;
+	real_vkCreateRenderPass = table.vkCreateRenderPass;
+	table.vkCreateRenderPass = counting_vkCreateRenderPass;
+	real_vkDestroyRenderPass = table.vkDestroyRenderPass;
+	table.vkDestroyRenderPass = counting_vkDestroyRenderPass;
+	real_vkCreateFramebuffer = table.vkCreateFramebuffer;
+	table.vkCreateFramebuffer = counting_vkCreateFramebuffer;
+	real_vkDestroyFramebuffer = table.vkDestroyFramebuffer;
+	table.vkDestroyFramebuffer = counting_vkDestroyFramebuffer;
+
+	// Only there if the device supports VK_KHR_create_renderpass2.
+	if (table.vkCreateRenderPass2KHR)
+	{
+		real_vkCreateRenderPass2KHR = table.vkCreateRenderPass2KHR;
+		table.vkCreateRenderPass2KHR = counting_vkCreateRenderPass2KHR;
+	}
+
+	if (table.vkCmdBeginRenderPass2KHR)
+	{
+		real_vkCmdBeginRenderPass2KHR = table.vkCmdBeginRenderPass2KHR;
+		table.vkCmdBeginRenderPass2KHR = counting_vkCmdBeginRenderPass2KHR;
+	}
+}
+
+static void log_call_counters(const char *tag, const RenderPassCallCounters &counters)
+{
+	// A render pass and a compatible render pass are looked up per begin, see above.
+	unsigned render_pass_lookups = 2 * counters.render_passes_begun;
+	unsigned framebuffer_lookups = counters.render_passes_begun;
+	unsigned render_pass_hits = render_pass_lookups > counters.render_passes_created ?
+	                            render_pass_lookups - counters.render_passes_created : 0;
+	unsigned framebuffer_hits = framebuffer_lookups > counters.framebuffers_created ?
+	                            framebuffer_lookups - counters.framebuffers_created : 0;
+
+	LOGI("%s: %u render passes begun. Render passes: %u hits, %u misses (created), %u destroyed. "
+	     "Framebuffers: %u hits, %u misses (created), %u evicted (destroyed).\n", tag,
+	     counters.render_passes_begun,
+	     render_pass_hits, counters.render_passes_created, counters.render_passes_destroyed,
+	     framebuffer_hits, counters.framebuffers_created, counters.framebuffers_destroyed);
+}
+
+static RenderPassCallCounters operator-(const RenderPassCallCounters &a, const RenderPassCallCounters &b)
+{
+	RenderPassCallCounters c;
+	c.render_passes_begun = a.render_passes_begun - b.render_passes_begun;
+	c.render_passes_created = a.render_passes_created - b.render_passes_created;
+	c.render_passes_destroyed = a.render_passes_destroyed - b.render_passes_destroyed;
+	c.framebuffers_created = a.framebuffers_created - b.framebuffers_created;
+	c.framebuffers_destroyed = a.framebuffers_destroyed - b.framebuffers_destroyed;
+	return c;
+}
+
+static RenderPassCallCounters operator+(const RenderPassCallCounters &a, const RenderPassCallCounters &b)
+{
+	RenderPassCallCounters c;
+	c.render_passes_begun = a.render_passes_begun + b.render_passes_begun;
+	c.render_passes_created = a.render_passes_created + b.render_passes_created;
+	c.render_passes_destroyed = a.render_passes_destroyed + b.render_passes_destroyed;
+	c.framebuffers_created = a.framebuffers_created + b.framebuffers_created;
+	c.framebuffers_destroyed = a.framebuffers_destroyed + b.framebuffers_destroyed;
+	return c;
+}
+
+class RenderPassPrewarmer
+{
+public:
+	explicit RenderPassPrewarmer(Vulkan::Device &device_)
+		: device(device_)
+	{
+	}
+
+	// The image views in the RenderPassInfo must stay alive for as long as the pass is declared.
+	unsigned declare(const Vulkan::RenderPassInfo &info)
+	{
+		passes.push_back({ info, 0 });
+		return unsigned(passes.size() - 1);
+	}
+
+	// Call after the render targets have been re-created, e.g. on resize, followed by prewarm().
+	void update(unsigned index, const Vulkan::RenderPassInfo &info)
+	{
+		passes[index].info = info;
+	}
+
+	const Vulkan::RenderPassInfo &get_info(unsigned index) const
+	{
+		return passes[index].info;
+	}
+
+	// Records one command buffer which begins and ends every declared render pass,
+	// creating render passes, compatible render passes and framebuffers along the way.
+	// The attachments are cleared or loaded according to the RenderPassInfo, which is fine
+	// for render targets which have just been created.
+	void prewarm()
+	{
+		auto cmd = device.request_command_buffer();
+		for (auto &pass : passes)
+		{
+			cmd->begin_render_pass(pass.info);
+			cmd->end_render_pass();
+			pass.last_used = frame;
+		}
+		device.submit(cmd);
+	}
+
+	// Same as CommandBuffer::begin_render_pass(), but remembers when the pass was last used.
+	void begin_render_pass(Vulkan::CommandBuffer &cmd, unsigned index)
+	{
+		passes[index].last_used = frame;
+		cmd.begin_render_pass(passes[index].info);
+	}
+
+	// Touches framebuffers of declared passes which have not been used for a while.
+	// The compatible render pass is the same when only load and store ops change, so the same framebuffer is used.
+	// The first time we do this, an extra VkRenderPass is created for the keep-alive variant, but that's persistent.
+	// Attachments which the declared pass stores are loaded and stored, so their contents survive.
+	// Attachments which it does not store have no contents worth keeping, e.g. the depth buffer of a color pass,
+	// so they are only cleared. Loading them would read data which was never stored.
+	void keep_alive(Vulkan::CommandBuffer &cmd)
+	{
+		for (auto &pass : passes)
+		{
+			if (frame - pass.last_used < KeepAliveFrames)
+				continue;
+
+			Vulkan::RenderPassInfo info = pass.info;
+			unsigned color_mask = (1u << info.num_color_attachments) - 1u;
+			unsigned stored_mask = info.store_attachments & color_mask;
+			info.load_attachments = stored_mask;
+			info.clear_attachments = color_mask & ~stored_mask;
+
+			info.op_flags &= ~(Vulkan::RENDER_PASS_OP_CLEAR_DEPTH_STENCIL_BIT | Vulkan::RENDER_PASS_OP_LOAD_DEPTH_STENCIL_BIT);
+			if (info.depth_stencil)
+			{
+				if (info.op_flags & Vulkan::RENDER_PASS_OP_STORE_DEPTH_STENCIL_BIT)
+					info.op_flags |= Vulkan::RENDER_PASS_OP_LOAD_DEPTH_STENCIL_BIT;
+				else
+					info.op_flags |= Vulkan::RENDER_PASS_OP_CLEAR_DEPTH_STENCIL_BIT;
+			}
+
+			// Only touch a single pixel, which keeps the cost of loading and storing negligible.
+			info.render_area.offset = { 0, 0 };
+			info.render_area.extent = { 1, 1 };
+
+			cmd.begin_render_pass(info);
+			cmd.end_render_pass();
+			pass.last_used = frame;
+		}
+	}
+
+	void next_frame()
+	{
+		frame++;
+	}
+
+private:
+	// Well within the eviction window of the framebuffer cache.
+	enum { KeepAliveFrames = 4 };
+
+	Vulkan::Device &device;
+
+	struct Pass
+	{
+		Vulkan::RenderPassInfo info;
+		uint64_t last_used;
+	};
+	std::vector<Pass> passes;
+	uint64_t frame = 0;
+};
+
+// A view is a set of render targets which are rendered to every interval frames.
+struct View
+{
+	const char *name;
+	unsigned width, height;
+	bool has_color;
+	unsigned interval;
+	Vulkan::ImageHandle color;
+	Vulkan::ImageHandle depth;
+	unsigned pass_index;
+
+	void create(Vulkan::Device &device)
+	{
+		color.reset();
+		if (has_color)
+			color = device.create_image(Vulkan::ImageCreateInfo::render_target(width, height, VK_FORMAT_R8G8B8A8_UNORM));
+		depth = device.create_image(Vulkan::ImageCreateInfo::render_target(width, height, device.get_default_depth_format()));
+	}
+
+	Vulkan::RenderPassInfo get_render_pass_info() const
+	{
+		Vulkan::RenderPassInfo rp;
+		if (color)
+		{
+			rp.num_color_attachments = 1;
+			rp.color_attachments[0] = &color->get_view();
+			rp.clear_attachments = 1 << 0;
+			rp.store_attachments = 1 << 0;
+		}
+		rp.depth_stencil = &depth->get_view();
+		rp.op_flags = Vulkan::RENDER_PASS_OP_CLEAR_DEPTH_STENCIL_BIT;
+		// A shadow map needs to be stored, the depth buffer of a color pass does not.
+		if (!color)
+			rp.op_flags |= Vulkan::RENDER_PASS_OP_STORE_DEPTH_STENCIL_BIT;
+		return rp;
+	}
+};
+
+static const unsigned NumFrames = 240;
+static const unsigned ResizeFrame = 120;
+
+static void run(bool use_prewarm)
+{
+	// Every run gets its own device, so the second run does not benefit from render passes created in the first.
+	// See sample 01.
+	Vulkan::Context context;
+	if (!context.init_instance_and_device(nullptr, 0, nullptr, 0))
+	{
+		LOGE("Failed to create VkInstance and VkDevice.\n");
+		return;
+	}
+
+	// The Context owns the table, so it's fine to modify it through the const reference.
+	install_call_counters(const_cast<VolkDeviceTable &>(context.get_device_table()));
+
+	Vulkan::Device device;
+	device.set_context(context);
+	////
+
+	std::vector<View> views = {
+		{ "Main", 1280, 720, true, 1 },
+		{ "Shadow", 2048, 2048, false, 1 },
+		// Used now and then, so the framebuffer is evicted in-between unless we keep it alive.
+		{ "Reflection", 512, 512, true, 24 },
+	};
+
+	RenderPassPrewarmer prewarmer(device);
+
+	for (auto &view : views)
+	{
+		view.create(device);
+		view.pass_index = prewarmer.declare(view.get_render_pass_info());
+	}
+
+	// Everything created by prewarm() is kept apart from what is created in the middle of a frame.
+	RenderPassCallCounters prewarm_calls;
+	if (use_prewarm)
+	{
+		RenderPassCallCounters before = call_counters;
+		prewarmer.prewarm();
+		prewarm_calls = call_counters - before;
+	}
+
+	RenderPassCallCounters loop_start = call_counters;
+	RenderPassCallCounters resize_prewarm_calls;
+
+	double total_ms = 0.0;
+	double worst_ms = 0.0;
+	unsigned worst_frame = 0;
+
+	for (unsigned frame = 0; frame < NumFrames; frame++)
+	{
+		// Pretend the window was resized.
+		if (frame == ResizeFrame)
+		{
+			views[0].width = 1920;
+			views[0].height = 1080;
+			views[0].create(device);
+			prewarmer.update(views[0].pass_index, views[0].get_render_pass_info());
+			if (use_prewarm)
+			{
+				RenderPassCallCounters before = call_counters;
+				prewarmer.prewarm();
+				resize_prewarm_calls = call_counters - before;
+			}
+		}
+
+		auto cmd = device.request_command_buffer();
+		double frame_ms = 0.0;
+
+		for (auto &view : views)
+		{
+			if ((frame % view.interval) != 0)
+				continue;
+
+			// This is where render passes and framebuffers would be created.
+			auto start = std::chrono::steady_clock::now();
+			prewarmer.begin_render_pass(*cmd, view.pass_index);
+			auto end = std::chrono::steady_clock::now();
+			cmd->end_render_pass();
+
+			frame_ms += std::chrono::duration<double, std::milli>(end - start).count();
+		}
+
+		if (use_prewarm)
+			prewarmer.keep_alive(*cmd);
+
+		device.submit(cmd);
+		device.next_frame_context();
+		prewarmer.next_frame();
+
+		// A fresh device has no render passes, so the first frame (or prewarm()) must have created some.
+		// If nothing was counted, Granite did not call through the table we patched, and the numbers below are meaningless.
+		if (frame == 0 && (call_counters.render_passes_begun == 0 || call_counters.render_passes_created == 0))
+			LOGE("No render pass calls were counted, the counters are not installed in the table Granite uses.\n");
+
+		total_ms += frame_ms;
+		if (frame_ms > worst_ms)
+		{
+			worst_ms = frame_ms;
+			worst_frame = frame;
+		}
+	}
+
+	// wait_idle() tears down the framebuffer cache, so take the counts before that.
+	RenderPassCallCounters in_frames = (call_counters - loop_start) - resize_prewarm_calls;
+	prewarm_calls = prewarm_calls + resize_prewarm_calls;
+	device.wait_idle();
+
+	const char *tag = use_prewarm ? "Prewarm" : "Lazy";
+	LOGI("%s: begin_render_pass() %.3f ms / frame on average, worst frame %u with %.3f ms.\n",
+	     tag, total_ms / NumFrames, worst_frame, worst_ms);
+	char name[64];
+	snprintf(name, sizeof(name), "%s, prewarm()", tag);
+	log_call_counters(name, prewarm_calls);
+	snprintf(name, sizeof(name), "%s, in frames", tag);
+	log_call_counters(name, in_frames);
+}
+
+int main()
+{
+	// See sample 01.
+	if (!Vulkan::Context::init_loader(nullptr))
+	{
+		LOGE("Failed to create loader!\n");
+		return 1;
+	}
+
+	run(false);
+	run(true);
+}
@@ -1,8 +1,14 @@
 #!/bin/bash
 
+# Set GRANITE_REVISION to check out a specific Granite commit instead of the one recorded in the superproject.
+# Some samples depend on Granite internals, see README.md.
 git submodule update --init Granite
 
 cd Granite
+if [ -n "$GRANITE_REVISION" ]; then
+	git fetch origin
+	git checkout "$GRANITE_REVISION"
+fi
 git submodule update --init third_party/volk
 git submodule update --init third_party/spirv-cross
 cd ..
@@ -0,0 +1,23 @@
+#version 450
+#extension GL_EXT_nonuniform_qualifier : require
+layout(location = 0) out vec4 FragColor;
+
+layout(set = 0, binding = 0) uniform sampler uSampler;
+layout(set = 1, binding = 0) uniform texture2D uTextures[];
+
+layout(set = 2, binding = 0, std430) readonly buffer BufferHeap
+{
+    vec4 data[];
+} heap;
+
+layout(push_constant) uniform Registers
+{
+    uint texture_index;
+    uint buffer_index;
+} registers;
+
+void main()
+{
+    FragColor = texture(sampler2D(uTextures[registers.texture_index], uSampler), gl_FragCoord.xy * (1.0 / 64.0)) *
+                heap.data[registers.buffer_index];
+}
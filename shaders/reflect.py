@@ -0,0 +1,328 @@
+#!/usr/bin/env python3
+
+# Offline SPIR-V reflection for the samples.
+#
+# Takes a SPIR-V module in the C array format emitted by "glslc -mfmt=c" and emits a compact
+# binary reflection blob in the same format. The blob mirrors Vulkan::ResourceLayout,
+# so the application can skip SPIRV-Cross entirely when creating shaders.
+# See 14_shader_reflection.cpp for the consumer side.
+#
+# Blob layout (all uint32_t):
+#   [0] magic ('GRFL')
+#   [1] version
+#   [2] input_mask
+#   [3] output_mask
+#   [4] push_constant_size
+#   [5] spec_constant_mask
+#   For each of the 4 descriptor sets:
+#     sampled_image_mask, storage_image_mask, uniform_buffer_mask, storage_buffer_mask,
+#     sampled_buffer_mask, input_attachment_mask, sampler_mask, separate_image_mask, fp_mask,
+#     array_size[16] packed as four words, little-endian bytes.
+
+import re
+import struct
+import sys
+
+MAGIC = 0x4c465247
+VERSION = 1
+
+NUM_SETS = 4
+NUM_BINDINGS = 16
+UNSIZED_ARRAY = 0xff
+
+SET_MASKS = [
+    'sampled_image_mask',
+    'storage_image_mask',
+    'uniform_buffer_mask',
+    'storage_buffer_mask',
+    'sampled_buffer_mask',
+    'input_attachment_mask',
+    'sampler_mask',
+    'separate_image_mask',
+    'fp_mask',
+]
+
+# Opcodes
+OP_FUNCTION = 54
+OP_FUNCTION_CALL = 57
+OP_VARIABLE = 59
+OP_IMAGE_TEXEL_POINTER = 60
+OP_LOAD = 61
+OP_STORE = 62
+OP_COPY_MEMORY = 63
+OP_ACCESS_CHAIN = 65
+OP_IN_BOUNDS_ACCESS_CHAIN = 66
+OP_ARRAY_LENGTH = 68
+OP_DECORATE = 71
+OP_MEMBER_DECORATE = 72
+OP_TYPE_BOOL = 20
+OP_TYPE_INT = 21
+OP_TYPE_FLOAT = 22
+OP_TYPE_VECTOR = 23
+OP_TYPE_MATRIX = 24
+OP_TYPE_IMAGE = 25
+OP_TYPE_SAMPLER = 26
+OP_TYPE_SAMPLED_IMAGE = 27
+OP_TYPE_ARRAY = 28
+OP_TYPE_RUNTIME_ARRAY = 29
+OP_TYPE_STRUCT = 30
+OP_TYPE_POINTER = 32
+OP_CONSTANT = 43
+OP_SPEC_CONSTANT = 50
+
+# Decorations
+DEC_SPEC_ID = 1
+DEC_BLOCK = 2
+DEC_BUFFER_BLOCK = 3
+DEC_ARRAY_STRIDE = 6
+DEC_MATRIX_STRIDE = 7
+DEC_BUILTIN = 11
+DEC_LOCATION = 30
+DEC_BINDING = 33
+DEC_DESCRIPTOR_SET = 34
+DEC_OFFSET = 35
+
+# Storage classes
+SC_UNIFORM_CONSTANT = 0
+SC_INPUT = 1
+SC_UNIFORM = 2
+SC_OUTPUT = 3
+SC_PUSH_CONSTANT = 9
+SC_STORAGE_BUFFER = 12
+
+# Image dimensions
+DIM_BUFFER = 5
+DIM_SUBPASS_DATA = 6
+
+
+class Module:
+    def __init__(self, words):
+        if len(words) < 5 or words[0] != 0x07230203:
+            raise ValueError('Not a SPIR-V module.')
+
+        self.types = {}
+        self.constants = {}
+        self.variables = []
+        self.decorations = {}
+        self.member_decorations = {}
+        self.accessed = set()
+
+        in_function = False
+        offset = 5
+        while offset < len(words):
+            op = words[offset] & 0xffff
+            count = words[offset] >> 16
+            if count == 0:
+                raise ValueError('Invalid instruction.')
+            args = words[offset + 1:offset + count]
+            offset += count
+
+            if op == OP_FUNCTION:
+                in_function = True
+            elif op == OP_DECORATE:
+                self.decorations.setdefault(args[0], {})[args[1]] = args[2] if len(args) > 2 else True
+            elif op == OP_MEMBER_DECORATE:
+                self.member_decorations.setdefault(args[0], {}).setdefault(args[1], {})[args[2]] = \
+                    args[3] if len(args) > 3 else True
+            elif op in (OP_TYPE_BOOL, OP_TYPE_INT, OP_TYPE_FLOAT, OP_TYPE_VECTOR, OP_TYPE_MATRIX,
+                        OP_TYPE_IMAGE, OP_TYPE_SAMPLER, OP_TYPE_SAMPLED_IMAGE, OP_TYPE_ARRAY,
+                        OP_TYPE_RUNTIME_ARRAY, OP_TYPE_STRUCT, OP_TYPE_POINTER):
+                self.types[args[0]] = (op, args[1:])
+            elif op in (OP_CONSTANT, OP_SPEC_CONSTANT):
+                self.constants[args[1]] = args[2] if len(args) > 2 else 0
+            elif op == OP_VARIABLE and not in_function:
+                self.variables.append((args[1], args[0], args[2]))
+            elif in_function:
+                # A variable is considered active if it is ever accessed from a function.
+                # This matches what SPIRV-Cross considers active closely enough for our purposes.
+                if op in (OP_LOAD, OP_ACCESS_CHAIN, OP_IN_BOUNDS_ACCESS_CHAIN,
+                          OP_IMAGE_TEXEL_POINTER, OP_ARRAY_LENGTH):
+                    self.accessed.add(args[2])
+                elif op == OP_STORE:
+                    self.accessed.add(args[0])
+                elif op == OP_COPY_MEMORY:
+                    self.accessed.update(args[0:2])
+                elif op == OP_FUNCTION_CALL:
+                    self.accessed.update(args[3:])
+
+    def decoration(self, id, dec):
+        return self.decorations.get(id, {}).get(dec)
+
+    def strip_arrays(self, type_id):
+        """Returns the element type and the descriptor array size."""
+        op, args = self.types[type_id]
+        if op == OP_TYPE_ARRAY:
+            return args[0], self.constants[args[1]]
+        elif op == OP_TYPE_RUNTIME_ARRAY:
+            return args[0], UNSIZED_ARRAY
+        return type_id, 1
+
+    def is_float_image(self, type_id):
+        op, args = self.types[type_id]
+        if op == OP_TYPE_SAMPLED_IMAGE:
+            op, args = self.types[args[0]]
+        return self.types[args[0]][0] == OP_TYPE_FLOAT
+
+    def location_count(self, type_id):
+        op, args = self.types[type_id]
+        if op == OP_TYPE_ARRAY:
+            return self.constants[args[1]] * self.location_count(args[0])
+        elif op == OP_TYPE_MATRIX:
+            return args[1]
+        return 1
+
+    def type_size(self, type_id):
+        op, args = self.types[type_id]
+        if op in (OP_TYPE_INT, OP_TYPE_FLOAT):
+            return args[0] // 8
+        elif op == OP_TYPE_BOOL:
+            return 4
+        elif op == OP_TYPE_VECTOR:
+            return args[1] * self.type_size(args[0])
+        elif op == OP_TYPE_MATRIX:
+            stride = self.decoration(type_id, DEC_MATRIX_STRIDE)
+            return args[1] * (stride if stride else self.type_size(args[0]))
+        elif op == OP_TYPE_ARRAY:
+            stride = self.decoration(type_id, DEC_ARRAY_STRIDE)
+            return self.constants[args[1]] * (stride if stride else self.type_size(args[0]))
+        elif op == OP_TYPE_STRUCT:
+            return self.struct_size(type_id, args)
+        raise ValueError('Cannot compute size of type %u.' % type_id)
+
+    def struct_size(self, type_id, members):
+        size = 0
+        members_dec = self.member_decorations.get(type_id, {})
+        for index, member in enumerate(members):
+            offset = members_dec.get(index, {}).get(DEC_OFFSET, 0)
+            member_op, member_args = self.types[member]
+            if member_op == OP_TYPE_MATRIX:
+                # Matrix strides are decorated on the struct member.
+                stride = members_dec.get(index, {}).get(DEC_MATRIX_STRIDE)
+                member_size = member_args[1] * (stride if stride else self.type_size(member_args[0]))
+            else:
+                member_size = self.type_size(member)
+            size = max(size, offset + member_size)
+        return size
+
+
+def reflect(words):
+    module = Module(words)
+
+    layout = {
+        'input_mask': 0,
+        'output_mask': 0,
+        'push_constant_size': 0,
+        'spec_constant_mask': 0,
+        'sets': [dict([(mask, 0) for mask in SET_MASKS] + [('array_size', [0] * NUM_BINDINGS)])
+                 for _ in range(NUM_SETS)],
+    }
+
+    for id, decs in module.decorations.items():
+        if DEC_SPEC_ID in decs:
+            layout['spec_constant_mask'] |= 1 << decs[DEC_SPEC_ID]
+
+    for var_id, pointer_type, storage in module.variables:
+        if var_id not in module.accessed:
+            continue
+
+        type_id = module.types[pointer_type][1][1]
+
+        if storage in (SC_INPUT, SC_OUTPUT):
+            location = module.decoration(var_id, DEC_LOCATION)
+            # Builtins do not have locations.
+            if location is None:
+                continue
+            mask = ((1 << module.location_count(type_id)) - 1) << location
+            layout['input_mask' if storage == SC_INPUT else 'output_mask'] |= mask
+            continue
+
+        if storage == SC_PUSH_CONSTANT:
+            layout['push_constant_size'] = module.type_size(type_id)
+            continue
+
+        if storage not in (SC_UNIFORM_CONSTANT, SC_UNIFORM, SC_STORAGE_BUFFER):
+            continue
+
+        desc_set = module.decoration(var_id, DEC_DESCRIPTOR_SET) or 0
+        binding = module.decoration(var_id, DEC_BINDING) or 0
+        if desc_set >= NUM_SETS or binding >= NUM_BINDINGS:
+            raise ValueError('Descriptor (%u, %u) is out of range.' % (desc_set, binding))
+
+        element_type, array_size = module.strip_arrays(type_id)
+        op, args = module.types[element_type]
+        mask = 1 << binding
+        set_layout = layout['sets'][desc_set]
+
+        if storage == SC_STORAGE_BUFFER:
+            kind = 'storage_buffer_mask'
+        elif storage == SC_UNIFORM:
+            if module.decoration(element_type, DEC_BUFFER_BLOCK):
+                kind = 'storage_buffer_mask'
+            else:
+                kind = 'uniform_buffer_mask'
+        elif op == OP_TYPE_SAMPLER:
+            kind = 'sampler_mask'
+        elif op == OP_TYPE_SAMPLED_IMAGE:
+            image_args = module.types[args[0]][1]
+            kind = 'sampled_buffer_mask' if image_args[1] == DIM_BUFFER else 'sampled_image_mask'
+        elif op == OP_TYPE_IMAGE:
+            dim, sampled = args[1], args[5]
+            if dim == DIM_SUBPASS_DATA:
+                kind = 'input_attachment_mask'
+            elif sampled == 2:
+                kind = 'storage_image_mask'
+            elif dim == DIM_BUFFER:
+                kind = 'sampled_buffer_mask'
+            else:
+                kind = 'separate_image_mask'
+        else:
+            raise ValueError('Unsupported resource type for variable %u.' % var_id)
+
+        set_layout[kind] |= mask
+        if op in (OP_TYPE_IMAGE, OP_TYPE_SAMPLED_IMAGE) and module.is_float_image(element_type):
+            set_layout['fp_mask'] |= mask
+        set_layout['array_size'][binding] = array_size
+
+    return layout
+
+
+def encode(layout):
+    words = [MAGIC, VERSION,
+             layout['input_mask'], layout['output_mask'],
+             layout['push_constant_size'], layout['spec_constant_mask']]
+    for set_layout in layout['sets']:
+        words += [set_layout[mask] for mask in SET_MASKS]
+        words += struct.unpack('<4I', bytes(set_layout['array_size']))
+    return words
+
+
+def read_c_array(path):
+    with open(path) as f:
+        return [int(word, 16) for word in re.findall(r'0x[0-9a-fA-F]+', f.read())]
+
+
+def write_c_array(path, words):
+    lines = []
+    for i in range(0, len(words), 4):
+        lines.append(','.join('0x%08x' % word for word in words[i:i + 4]))
+    with open(path, 'w') as f:
+        f.write('{' + ',\n'.join(lines) + '}\n')
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.stderr.write('Usage: %s <input.inc> <output.refl.inc>\n' % sys.argv[0])
+        return 1
+
+    try:
+        words = encode(reflect(read_c_array(sys.argv[1])))
+    except (ValueError, KeyError, IndexError) as e:
+        sys.stderr.write('Failed to reflect %s: %s\n' % (sys.argv[1], e))
+        return 1
+
+    write_c_array(sys.argv[2], words)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
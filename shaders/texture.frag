@@ -0,0 +1,9 @@
+#version 450
+layout(location = 0) out vec4 FragColor;
+
+layout(set = 2, binding = 0) uniform sampler2D uTexture;
+
+void main()
+{
+    FragColor = texture(uTexture, gl_FragCoord.xy * (1.0 / 64.0));
+}